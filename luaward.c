@@ -9,17 +9,51 @@
 #include <linux/audit.h>
 #include <sys/prctl.h>
 #include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <signal.h>
 #include <errno.h>
+#include <time.h>
+#include <math.h>
 
 #define DEFAULT_MAX_MEMORY (5 * 1024 * 1024)
+#define POLLER_MAX_EVENTS 256
+#define DEFAULT_HOOK_PERIOD 1000
+#define PROFILE_MAX_DEPTH 32
+#define CHANNEL_POLL_INTERVAL 0.1
+#define LOAD_CACHE_BYTES (512 * 1024)     // Keys and bytecode held by load()'s cache
+#define TEMPLATE_CACHE_BYTES (256 * 1024) // Sources and ops held by template.render()'s cache
+#define CACHE_ENTRY_OVERHEAD 64 // Table slot and object headers charged per cache entry
+#define TEMPLATE_MAX_DEPTH 16
+#define TEMPLATE_METATABLE "luaward.template"
+#define SET_METATABLE "luaward.set"
+#define BITSET_METATABLE "luaward.bitset"
+#define BLOOM_METATABLE "luaward.bloom"
+#define HEAP_METATABLE "luaward.heap"
+#define BYTES_PER_INSTRUCTION 16
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
 
 typedef struct {
     size_t total_allocated;
+    size_t peak_allocated; // High-water mark since the current execution started
     size_t max_memory;
     unsigned long long instruction_count;
     unsigned long long instruction_limit;
+    double deadline; // CLOCK_MONOTONIC seconds, 0 for none
+    int hook_period; // Instructions between two count hook calls
+    int counting; // Count instructions even without a limit, deadline or profile
+    PyObject *profile; // Folded stack -> samples while profiling, else NULL
 } MemControl;
 
+static double monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
 static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
     MemControl *mc = (MemControl *)ud;
     if (nsize == 0) {
@@ -66,21 +100,116 @@ static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
         void* newptr = realloc(ptr, nsize);
         if (newptr) {
             mc->total_allocated = new_total;
+            if (new_total > mc->peak_allocated) {
+                mc->peak_allocated = new_total;
+            }
         }
         return newptr;
     }
 }
 
+static const char *global_function_name(lua_State *L, lua_Debug *ar) {
+    // Name of a global holding the frame's function, for frames the call
+    // site gives no name (functions called from Python). The name stays
+    // valid while _G holds it; nothing here allocates or raises.
+    if (!lua_checkstack(L, 4)) {
+        return NULL;
+    }
+    lua_getinfo(L, "f", ar);
+    lua_pushglobaltable(L);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        if (lua_type(L, -2) == LUA_TSTRING && lua_rawequal(L, -1, -4)) {
+            const char *name = lua_tostring(L, -2);
+            lua_pop(L, 4);
+            return name;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+    return NULL;
+}
+
+static void profile_sample(lua_State *L, PyObject *profile) {
+    // Counts the current stack in folded form, outermost frame first:
+    // "name@source:line;name@source:line". Errors cannot be raised from a
+    // hook, so a sample that fails to record is dropped.
+    lua_Debug frames[PROFILE_MAX_DEPTH];
+    int depth = 0;
+    while (depth < PROFILE_MAX_DEPTH && lua_getstack(L, depth, &frames[depth])) {
+        lua_getinfo(L, "nSl", &frames[depth]);
+        if (frames[depth].name == NULL && strcmp(frames[depth].what, "Lua") == 0) {
+            frames[depth].name = global_function_name(L, &frames[depth]);
+        }
+        depth++;
+    }
+    char stack[2048];
+    size_t len = 0;
+    for (int i = depth - 1; i >= 0 && len < sizeof(stack); i--) {
+        int n = snprintf(stack + len, sizeof(stack) - len, "%s%s@%s:%d", len ? ";" : "",
+                         frames[i].name ? frames[i].name : "?", frames[i].short_src, frames[i].currentline);
+        if (n < 0) {
+            return;
+        }
+        len += (size_t)n;
+    }
+    if (len >= sizeof(stack)) {
+        len = sizeof(stack) - 1; // Truncated
+    }
+
+    PyObject *key = PyUnicode_DecodeUTF8(stack, (Py_ssize_t)len, "replace");
+    PyObject *count = key ? PyDict_GetItemWithError(profile, key) : NULL;
+    PyObject *next = NULL;
+    if (key != NULL && !PyErr_Occurred()) {
+        next = PyLong_FromLong(count ? PyLong_AsLong(count) + 1 : 1);
+    }
+    if (next == NULL || PyDict_SetItem(profile, key, next) < 0) {
+        PyErr_Clear();
+    }
+    Py_XDECREF(next);
+    Py_XDECREF(key);
+}
+
 static void instruction_count_hook(lua_State *L, lua_Debug *ar) {
     MemControl *mc;
     lua_getallocf(L, (void **)&mc);
     
-    // We set the hook count to 1000, so we increment by 1000
-    mc->instruction_count += 1000;
+    // The hook runs every hook_period instructions
+    mc->instruction_count += mc->hook_period;
+    if (mc->profile != NULL) {
+        profile_sample(L, mc->profile);
+    }
     
     if (mc->instruction_limit > 0 && mc->instruction_count > mc->instruction_limit) {
         luaL_error(L, "Instruction limit exceeded");
     }
+    if (mc->deadline > 0 && monotonic_now() >= mc->deadline) {
+        luaL_error(L, "Deadline exceeded");
+    }
+}
+
+// Cancellation: the parent queues a signal whose value is the request ID it
+// wants aborted. If that request is the one running, the handler installs a
+// hook that raises a Lua error at the next instruction (lua_sethook is
+// async-signal-safe). Any other request ID is ignored, so a cancel racing with
+// the end of a request cannot hit the next one.
+static lua_State *volatile running_L = NULL;
+static volatile sig_atomic_t running_request = 0;
+static volatile sig_atomic_t cancel_requested = 0;
+
+static void cancel_hook(lua_State *L, lua_Debug *ar) {
+    luaL_error(L, "Execution cancelled");
+}
+
+static void cancel_signal_handler(int signum, siginfo_t *info, void *context) {
+    if (info->si_code != SI_QUEUE || info->si_value.sival_int != running_request) {
+        return;
+    }
+    cancel_requested = 1;
+    lua_State *L = running_L;
+    if (L) {
+        lua_sethook(L, cancel_hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+    }
 }
 
 typedef struct {
@@ -88,10 +217,48 @@ typedef struct {
     lua_State *L;
     MemControl mc;
     PyObject* callbacks; // Dictionary of name -> callable
+    PyObject *channels; // Dictionary of name -> channel, or NULL
+    PyObject *functions; // Frozenset last returned by global_functions(), or NULL
+    int globals_added;   // A function was stored under a new global name since
 } LuaVM;
 
+// A value converted once and kept in the VM's registry, passed to call()
+// in place of the Python value it was built from
+typedef struct {
+    PyObject_HEAD
+    LuaVM *vm; // Strong reference: the registry slot lives in its state
+    int ref;
+} PinnedValue;
+
+static PyTypeObject PinnedValueType;
+
+// Resets the per-execution budget and arms the hooks before running Lua code
+static void begin_execution(LuaVM *self) {
+    self->mc.instruction_count = 0;
+    self->mc.peak_allocated = self->mc.total_allocated;
+    if (self->mc.instruction_limit > 0 || self->mc.deadline > 0 || self->mc.profile != NULL ||
+        self->mc.counting) {
+        lua_sethook(self->L, instruction_count_hook, LUA_MASKCOUNT, self->mc.hook_period);
+    } else {
+        lua_sethook(self->L, NULL, 0, 0);
+    }
+    running_L = self->L;
+    if (cancel_requested) {
+        // Cancel arrived before the Lua code started
+        lua_sethook(self->L, cancel_hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+    }
+}
+
+static void end_execution(LuaVM *self) {
+    running_L = NULL;
+    lua_sethook(self->L, NULL, 0, 0);
+}
+
 static void LuaVM_dealloc(LuaVM *self) {
     Py_XDECREF(self->callbacks);
+    Py_XDECREF(self->channels);
+    Py_XDECREF(self->functions);
+    Py_XDECREF(self->mc.profile);
     if (self->L) {
         lua_close(self->L);
     }
@@ -112,6 +279,8 @@ static int convert_python_to_lua(lua_State *L, PyObject *arg) {
     } else if (PyUnicode_Check(arg)) {
         const char *s = PyUnicode_AsUTF8(arg);
         lua_pushstring(L, s);
+    } else if (PyObject_TypeCheck(arg, &PinnedValueType) && ((PinnedValue *)arg)->vm->L == L) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ((PinnedValue *)arg)->ref);
     } else {
         return -1; // Unsupported
     }
@@ -139,6 +308,2042 @@ static PyObject* convert_lua_to_python(lua_State *L, int index) {
 }
 
 
+// Nesting limit of dicts/lists converted to tables and back; also stops
+// reference cycles
+#define MAX_CONVERT_DEPTH 32
+
+typedef struct {
+    PyObject *values;      // Mapping being loaded (set_globals/set_context)
+    const char *name;      // Global receiving the whole mapping, or NULL
+    int readonly;          // Wrap every table in a read-only proxy
+    const char *bad_type;  // Type name of an unconvertible value
+} GlobalsLoad;
+
+static int readonly_newindex(lua_State *L) {
+    return luaL_error(L, "Attempt to modify a read-only table");
+}
+
+static int readonly_next(lua_State *L) {
+    // Iterates the proxied table (upvalue 1) without handing it out
+    lua_settop(L, 2);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushvalue(L, 2);
+    if (lua_next(L, -2)) {
+        return 2;
+    }
+    return 0;
+}
+
+static int readonly_pairs(lua_State *L) {
+    lua_getmetatable(L, 1);
+    lua_getfield(L, -1, "__index");
+    lua_pushcclosure(L, readonly_next, 1);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+static int readonly_len(lua_State *L) {
+    lua_getmetatable(L, 1);
+    lua_getfield(L, -1, "__index");
+    lua_pushinteger(L, (lua_Integer)lua_rawlen(L, -1));
+    return 1;
+}
+
+static void make_readonly(lua_State *L) {
+    // Replaces the table on top of the stack by an empty proxy that reads
+    // through to it and rejects writes. rawset and setmetatable are not in
+    // the sandbox, so scripts cannot get past the proxy.
+    lua_newtable(L);
+    lua_createtable(L, 0, 5);
+    lua_pushvalue(L, -3);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, readonly_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, readonly_pairs);
+    lua_setfield(L, -2, "__pairs");
+    lua_pushcfunction(L, readonly_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "__metatable");
+    lua_setmetatable(L, -2);
+    lua_replace(L, -2);
+}
+
+static void push_python_value(lua_State *L, PyObject *obj, int depth, GlobalsLoad *load) {
+    // Runs under lua_pcall: a memory error unwinds through here, so only
+    // borrowed references may be held.
+    if (depth > MAX_CONVERT_DEPTH) {
+        luaL_error(L, "Value nested too deeply");
+    }
+    luaL_checkstack(L, 4, "Value nested too deeply");
+    if (PyDict_Check(obj)) {
+        PyObject *key, *value;
+        Py_ssize_t pos = 0;
+        lua_createtable(L, 0, (int)PyDict_GET_SIZE(obj));
+        while (PyDict_Next(obj, &pos, &key, &value)) {
+            push_python_value(L, key, depth + 1, load);
+            push_python_value(L, value, depth + 1, load);
+            lua_rawset(L, -3);
+        }
+    } else if (PyList_Check(obj) || PyTuple_Check(obj)) {
+        Py_ssize_t n = PySequence_Fast_GET_SIZE(obj);
+        lua_createtable(L, (int)n, 0);
+        for (Py_ssize_t i = 0; i < n; i++) {
+            push_python_value(L, PySequence_Fast_GET_ITEM(obj, i), depth + 1, load);
+            lua_rawseti(L, -2, (lua_Integer)i + 1);
+        }
+    } else if (convert_python_to_lua(L, obj) == 0) {
+        return;
+    } else {
+        load->bad_type = Py_TYPE(obj)->tp_name;
+        luaL_error(L, "Unsupported value type '%s'", load->bad_type);
+    }
+    if (load->readonly) {
+        make_readonly(L);
+    }
+}
+
+static int load_globals_protected(lua_State *L) {
+    GlobalsLoad *load = (GlobalsLoad *)lua_touserdata(L, 1);
+    if (load->name != NULL) {
+        push_python_value(L, load->values, 0, load);
+        lua_setglobal(L, load->name);
+        return 0;
+    }
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    lua_pushglobaltable(L);
+    while (PyDict_Next(load->values, &pos, &key, &value)) {
+        push_python_value(L, value, 0, load);
+        lua_setfield(L, -2, PyUnicode_AsUTF8(key)); // Keys checked beforehand
+    }
+    return 0;
+}
+
+static int fetch_globals_protected(lua_State *L) {
+    // Pushes the value of each name in the sequence passed as userdata
+    PyObject *names = (PyObject *)lua_touserdata(L, 1);
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(names);
+    luaL_checkstack(L, (int)n, "Too many names");
+    for (Py_ssize_t i = 0; i < n; i++) {
+        lua_getglobal(L, PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(names, i)));
+    }
+    return (int)n;
+}
+
+static PyObject *lua_value_to_python(lua_State *L, int index, int depth) {
+    // Like convert_lua_to_python, but tables become lists (sequences) or
+    // dicts. Read-only proxies convert as the table they expose.
+    if (lua_type(L, index) != LUA_TTABLE) {
+        return convert_lua_to_python(L, index);
+    }
+    if (depth > MAX_CONVERT_DEPTH) {
+        PyErr_SetString(PyExc_ValueError, "Table nested too deeply");
+        return NULL;
+    }
+    if (!lua_checkstack(L, 4)) {
+        PyErr_SetString(PyExc_MemoryError, "Lua stack exhausted");
+        return NULL;
+    }
+    index = lua_absindex(L, index);
+    int pushed = 0;
+    if (lua_getmetatable(L, index)) {
+        lua_getfield(L, -1, "__newindex");
+        int proxy = lua_tocfunction(L, -1) == readonly_newindex;
+        lua_pop(L, 1);
+        if (proxy) {
+            lua_getfield(L, -1, "__index");
+            lua_remove(L, -2);
+            index = lua_gettop(L);
+            pushed = 1;
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+
+    // A sequence has exactly the integer keys 1..#t
+    lua_Integer length = (lua_Integer)lua_rawlen(L, index);
+    lua_Integer count = 0;
+    int sequence = length > 0;
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+        count++;
+        if (!lua_isinteger(L, -2) || lua_tointeger(L, -2) < 1 || lua_tointeger(L, -2) > length) {
+            sequence = 0;
+        }
+        lua_pop(L, 1);
+    }
+    sequence = sequence && count == length;
+
+    PyObject *result = sequence ? PyList_New((Py_ssize_t)length) : PyDict_New();
+    if (result != NULL && sequence) {
+        for (lua_Integer i = 1; i <= length; i++) {
+            lua_rawgeti(L, index, i);
+            PyObject *item = lua_value_to_python(L, -1, depth + 1);
+            lua_pop(L, 1);
+            if (item == NULL) {
+                Py_CLEAR(result);
+                break;
+            }
+            PyList_SET_ITEM(result, (Py_ssize_t)(i - 1), item);
+        }
+    } else if (result != NULL) {
+        lua_pushnil(L);
+        while (lua_next(L, index) != 0) {
+            PyObject *key = convert_lua_to_python(L, -2);
+            PyObject *value = key ? lua_value_to_python(L, -1, depth + 1) : NULL;
+            if (value == NULL || PyDict_SetItem(result, key, value) < 0) {
+                Py_XDECREF(key);
+                Py_XDECREF(value);
+                Py_CLEAR(result);
+                lua_pop(L, 2);
+                break;
+            }
+            Py_DECREF(key);
+            Py_DECREF(value);
+            lua_pop(L, 1);
+        }
+    }
+    if (pushed) {
+        lua_pop(L, 1);
+    }
+    return result;
+}
+
+
+// Channels: channel.send(name, value [, timeout]) and channel.recv(name
+// [, timeout]) call send(value, timeout) and recv(timeout) on the Python
+// object registered under that name, which raise TimeoutError when the wait
+// runs out. Waits are cut into CHANNEL_POLL_INTERVAL slices so a
+// cancellation or the request deadline interrupts them.
+
+static int push_value_protected(lua_State *L) {
+    GlobalsLoad *load = (GlobalsLoad *)lua_touserdata(L, 1);
+    push_python_value(L, load->values, 0, load);
+    return 1;
+}
+
+static void channel_error(char *error, size_t size) {
+    // Moves the pending Python exception into error, as its message
+    PyObject *type, *value, *traceback;
+    PyErr_Fetch(&type, &value, &traceback);
+    PyObject *text = value ? PyObject_Str(value) : NULL;
+    const char *message = text ? PyUnicode_AsUTF8(text) : NULL;
+    snprintf(error, size, "Channel error: %s", message ? message : "unknown");
+    Py_XDECREF(text);
+    Py_XDECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(traceback);
+    PyErr_Clear();
+}
+
+static PyObject *channel_transfer(lua_State *L, int sending, int *timed_out, char *error, size_t size) {
+    // Sends the value at index 2 or receives one, waiting in slices until
+    // the timeout at index 2 or 3 runs out. Returns the result of send/recv,
+    // or NULL with either *timed_out or error set. The GIL must be held.
+    LuaVM *vm = (LuaVM *)lua_touserdata(L, lua_upvalueindex(1));
+    const char *name = lua_tostring(L, 1);
+    int timeout_index = sending ? 3 : 2;
+    double now = monotonic_now();
+    double until = lua_isnoneornil(L, timeout_index) ? 0 : now + lua_tonumber(L, timeout_index);
+    int deadline_bound = vm->mc.deadline > 0 && (until == 0 || vm->mc.deadline < until);
+    if (deadline_bound) {
+        until = vm->mc.deadline;
+    }
+
+    PyObject *channel = vm->channels ? PyDict_GetItemString(vm->channels, name) : NULL;
+    if (channel == NULL) {
+        snprintf(error, size, "Unknown channel '%s'", name);
+        return NULL;
+    }
+    PyObject *value = NULL;
+    if (sending) {
+        value = lua_value_to_python(L, 2, 0);
+        if (value == NULL) {
+            channel_error(error, size);
+            return NULL;
+        }
+    }
+    for (;;) {
+        double slice = CHANNEL_POLL_INTERVAL;
+        if (until > 0 && until - monotonic_now() < slice) {
+            slice = until - monotonic_now();
+        }
+        if (slice < 0) {
+            slice = 0;
+        }
+        PyObject *result = sending ? PyObject_CallMethod(channel, "send", "Od", value, slice)
+                                   : PyObject_CallMethod(channel, "recv", "d", slice);
+        if (result != NULL) {
+            Py_XDECREF(value);
+            return result;
+        }
+        if (!PyErr_ExceptionMatches(PyExc_TimeoutError)) {
+            Py_XDECREF(value);
+            channel_error(error, size);
+            return NULL;
+        }
+        PyErr_Clear();
+        if (cancel_requested) {
+            snprintf(error, size, "Execution cancelled");
+            break;
+        }
+        if (until > 0 && monotonic_now() >= until) {
+            if (deadline_bound) {
+                snprintf(error, size, "Deadline exceeded");
+            } else {
+                *timed_out = 1;
+            }
+            break;
+        }
+    }
+    Py_XDECREF(value);
+    return NULL;
+}
+
+static int lua_channel_send(lua_State *L) {
+    // Returns true once sent, false if the channel stayed full
+    luaL_checkstring(L, 1);
+    luaL_checkany(L, 2);
+    luaL_optnumber(L, 3, 0);
+    char error[256];
+    int timed_out = 0;
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    PyObject *result = channel_transfer(L, 1, &timed_out, error, sizeof(error));
+    Py_XDECREF(result);
+    PyGILState_Release(gstate);
+    if (result == NULL && !timed_out) {
+        return luaL_error(L, "%s", error);
+    }
+    lua_pushboolean(L, result != NULL);
+    return 1;
+}
+
+static int lua_channel_recv(lua_State *L) {
+    // Returns true and the value, or false if nothing arrived in time
+    luaL_checkstring(L, 1);
+    luaL_optnumber(L, 2, 0);
+    char error[256];
+    int timed_out = 0;
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    PyObject *result = channel_transfer(L, 0, &timed_out, error, sizeof(error));
+    if (result == NULL) {
+        PyGILState_Release(gstate);
+        if (!timed_out) {
+            return luaL_error(L, "%s", error);
+        }
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    // Converted under pcall so a memory error cannot leak the value
+    GlobalsLoad load = {result, NULL, 0, NULL};
+    lua_pushboolean(L, 1);
+    lua_pushcfunction(L, push_value_protected);
+    lua_pushlightuserdata(L, &load);
+    int status = lua_pcall(L, 1, 1, 0);
+    Py_DECREF(result);
+    if (status == LUA_OK && PyErr_Occurred()) {
+        channel_error(error, sizeof(error)); // Integer overflow or unencodable string
+        PyGILState_Release(gstate);
+        return luaL_error(L, "%s", error);
+    }
+    PyGILState_Release(gstate);
+    if (status != LUA_OK) {
+        return lua_error(L);
+    }
+    return 2;
+}
+
+static void charge_instructions(lua_State *L, unsigned long long cost) {
+    // Bills work done in C on behalf of a script as Lua instructions, with
+    // the checks of the count hook, which does not run meanwhile
+    MemControl *mc;
+    lua_getallocf(L, (void **)&mc);
+    mc->instruction_count += cost;
+    if (mc->instruction_limit > 0 && mc->instruction_count > mc->instruction_limit) {
+        luaL_error(L, "Instruction limit exceeded");
+    }
+    if (mc->deadline > 0 && monotonic_now() >= mc->deadline) {
+        luaL_error(L, "Deadline exceeded");
+    }
+    if (cancel_requested) {
+        luaL_error(L, "Execution cancelled");
+    }
+}
+
+static void charge_bytes(lua_State *L, size_t len) {
+    // Bills a pass over len bytes of string data
+    charge_instructions(L, len / BYTES_PER_INSTRUCTION + 1);
+}
+
+// Sandbox load(): compiles text chunks only, into the environment given or
+// a fresh empty table, never the globals. Compiling charges one instruction
+// per source byte. Compiled chunks are kept as bytecode dumps in a cache
+// table (upvalue 1, holding upvalue 2 bytes of keys and dumps) keyed by
+// chunk name and source, so a source loaded again is only undumped. The
+// cache is emptied when it would pass LOAD_CACHE_BYTES, and an entry over a
+// quarter of that is not kept; it counts against the memory limit.
+
+typedef struct {
+    int init;
+    luaL_Buffer buffer;
+} ChunkWriter;
+
+static int chunk_writer(lua_State *L, const void *p, size_t size, void *ud) {
+    ChunkWriter *writer = (ChunkWriter *)ud;
+    if (!writer->init) {
+        // Only now: the buffer pushes onto the stack that lua_dump reads
+        writer->init = 1;
+        luaL_buffinit(L, &writer->buffer);
+    }
+    luaL_addlstring(&writer->buffer, (const char *)p, size);
+    return 0;
+}
+
+static int sandbox_load(lua_State *L) {
+    // load(chunk [, chunkname [, mode [, env]]])
+    size_t len;
+    const char *source = luaL_checklstring(L, 1, &len);
+    const char *chunkname = luaL_optstring(L, 2, "=(load)");
+    const char *mode = luaL_optstring(L, 3, "t");
+    if (strcmp(mode, "t") != 0) {
+        return luaL_error(L, "load: only text chunks are allowed");
+    }
+    if (!lua_isnoneornil(L, 4)) {
+        luaL_checktype(L, 4, LUA_TTABLE);
+    }
+    lua_settop(L, 4);
+
+    lua_pushvalue(L, lua_upvalueindex(1)); // 5: cache
+    luaL_Buffer key;
+    luaL_buffinit(L, &key);
+    luaL_addstring(&key, chunkname);
+    luaL_addchar(&key, '\0');
+    luaL_addlstring(&key, source, len);
+    luaL_pushresult(&key); // 6: cache key
+    lua_pushvalue(L, 6);
+    int status;
+    if (lua_rawget(L, 5) == LUA_TSTRING) {
+        // Our own dump of a chunk compiled from text
+        size_t size;
+        const char *dump = lua_tolstring(L, 7, &size);
+        status = luaL_loadbufferx(L, dump, size, chunkname, "b");
+    } else {
+        charge_instructions(L, len);
+        status = luaL_loadbufferx(L, source, len, chunkname, "t");
+        if (status == LUA_OK) {
+            ChunkWriter writer = {0};
+            lua_dump(L, chunk_writer, &writer, 0);
+            if (writer.init) {
+                luaL_pushresult(&writer.buffer);
+                lua_Integer cost = (lua_Integer)(lua_rawlen(L, 6) + lua_rawlen(L, -1)) + CACHE_ENTRY_OVERHEAD;
+                if (cost <= LOAD_CACHE_BYTES / 4) {
+                    lua_Integer held = lua_tointeger(L, lua_upvalueindex(2));
+                    if (held + cost > LOAD_CACHE_BYTES) {
+                        lua_newtable(L);
+                        lua_copy(L, -1, lua_upvalueindex(1));
+                        lua_replace(L, 5);
+                        held = 0;
+                    }
+                    lua_pushinteger(L, held + cost);
+                    lua_replace(L, lua_upvalueindex(2));
+                    lua_pushvalue(L, 6);
+                    lua_insert(L, -2);
+                    lua_rawset(L, 5);
+                } else {
+                    lua_pop(L, 1);
+                }
+            }
+        }
+    }
+    if (status != LUA_OK) {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        return 2; // nil, error message
+    }
+    if (lua_isnil(L, 4)) {
+        lua_newtable(L);
+    } else {
+        lua_pushvalue(L, 4);
+    }
+    if (lua_setupvalue(L, -2, 1) == NULL) { // _ENV
+        lua_pop(L, 1);
+    }
+    return 1;
+}
+
+// Templates: the `template` library renders text such as
+//   "Hello {{user.name}}{{#if admin}} (admin){{/if}}:{{#each items}} {{.}}{{/each}}"
+// against a table. {{path}} is HTML-escaped, {{{path}}} and {{&path}} are
+// not, {{! ...}} is a comment. Paths are dotted keys (digits index
+// sequences), looked up in the innermost {{#each}} item first, then outer
+// ones, then the table; {{.}} is the current item and {{@index}} its
+// position. A template compiles once into an array of ops over its source;
+// output goes to a luaL_Buffer, so it is allocated (and limited) by l_alloc.
+// Rendering charges one instruction per op executed.
+
+enum { T_TEXT, T_VAR, T_RAW, T_IF, T_ELSE, T_EACH, T_END_EACH };
+
+typedef struct {
+    int kind;
+    int jump;    // Op to continue at: past the branch, loop or back to the loop body
+    size_t off;  // Text or path within the source
+    size_t len;
+} TemplateOp;
+
+typedef struct {
+    int nops;
+    TemplateOp ops[1];
+} Template;
+
+static void template_error(lua_State *L, const char *src, size_t off, const char *message) {
+    int line = 1;
+    for (size_t i = 0; i < off; i++) {
+        line += src[i] == '\n';
+    }
+    luaL_error(L, "template: %s on line %d", message, line);
+}
+
+static size_t template_trim(const char *src, size_t *off, size_t len) {
+    while (len > 0 && (src[*off] == ' ' || src[*off] == '\t')) {
+        (*off)++;
+        len--;
+    }
+    while (len > 0 && (src[*off + len - 1] == ' ' || src[*off + len - 1] == '\t')) {
+        len--;
+    }
+    return len;
+}
+
+static Template *template_compile(lua_State *L, int src_index) {
+    // Pushes a compiled template userdata holding the source string as its
+    // user value
+    size_t src_len;
+    const char *src = luaL_checklstring(L, src_index, &src_len);
+    int max_ops = 1;
+    for (const char *p = src; (p = strstr(p, "{{")) != NULL; p += 2) {
+        max_ops += 2;
+    }
+    Template *t = (Template *)lua_newuserdatauv(L, sizeof(Template) + (size_t)max_ops * sizeof(TemplateOp), 1);
+    lua_pushvalue(L, src_index);
+    lua_setiuservalue(L, -2, 1);
+    luaL_setmetatable(L, TEMPLATE_METATABLE);
+    t->nops = 0;
+
+    int blocks[TEMPLATE_MAX_DEPTH * 2]; // Open #if/#each ops, innermost last
+    int nblocks = 0;
+    size_t pos = 0;
+    while (pos < src_len) {
+        const char *open = strstr(src + pos, "{{");
+        size_t tag = open ? (size_t)(open - src) : src_len;
+        if (tag > pos) {
+            t->ops[t->nops++] = (TemplateOp){T_TEXT, 0, pos, tag - pos};
+        }
+        if (open == NULL) {
+            break;
+        }
+
+        int triple = src[tag + 2] == '{';
+        size_t start = tag + (triple ? 3 : 2);
+        const char *close = strstr(src + start, triple ? "}}}" : "}}");
+        if (close == NULL) {
+            template_error(L, src, tag, "unclosed tag");
+            return NULL;
+        }
+        size_t end = (size_t)(close - src);
+        pos = end + (triple ? 3 : 2);
+        size_t off = start;
+        size_t len = template_trim(src, &off, end - start);
+        char sigil = len > 0 ? src[off] : '\0';
+        TemplateOp *op = &t->ops[t->nops];
+
+        if (triple || sigil == '&') {
+            if (!triple) {
+                off++;
+                len = template_trim(src, &off, len - 1);
+            }
+            *op = (TemplateOp){T_RAW, 0, off, len};
+        } else if (sigil == '!') {
+            continue;
+        } else if (sigil == '#') {
+            int each = len > 5 && strncmp(src + off, "#each", 5) == 0 && (src[off + 5] == ' ' || src[off + 5] == '\t');
+            int cond = len > 3 && strncmp(src + off, "#if", 3) == 0 && (src[off + 3] == ' ' || src[off + 3] == '\t');
+            if (!each && !cond) {
+                template_error(L, src, tag, "unknown block");
+                return NULL;
+            }
+            if (nblocks == TEMPLATE_MAX_DEPTH * 2) {
+                template_error(L, src, tag, "blocks nested too deeply");
+                return NULL;
+            }
+            size_t skip = each ? 5 : 3;
+            off += skip;
+            len = template_trim(src, &off, len - skip);
+            *op = (TemplateOp){each ? T_EACH : T_IF, 0, off, len};
+            blocks[nblocks++] = t->nops;
+        } else if (sigil == '/' || (len == 4 && strncmp(src + off, "else", 4) == 0)) {
+            int kind = nblocks > 0 ? t->ops[blocks[nblocks - 1]].kind : -1;
+            if (sigil != '/') {
+                if (kind != T_IF) {
+                    template_error(L, src, tag, "{{else}} outside {{#if}}");
+                    return NULL;
+                }
+                // The #if jumps past the else; the else jumps to the end
+                t->ops[blocks[nblocks - 1]].jump = t->nops + 1;
+                *op = (TemplateOp){T_ELSE, 0, 0, 0};
+                blocks[nblocks - 1] = t->nops++;
+                continue;
+            }
+            int closes_each = len == 5 && strncmp(src + off, "/each", 5) == 0;
+            int closes_if = len == 3 && strncmp(src + off, "/if", 3) == 0;
+            if (kind < 0 || (closes_each ? kind != T_EACH : !closes_if || kind == T_EACH)) {
+                template_error(L, src, tag, "unmatched block end");
+                return NULL;
+            }
+            int block = blocks[--nblocks];
+            if (closes_each) {
+                *op = (TemplateOp){T_END_EACH, block + 1, 0, 0};
+                t->ops[block].jump = t->nops + 1;
+            } else {
+                t->ops[block].jump = t->nops; // Nothing emitted for {{/if}}
+                continue;
+            }
+        } else {
+            *op = (TemplateOp){T_VAR, 0, off, len};
+        }
+        if (op->kind != T_END_EACH && op->len == 0) {
+            template_error(L, src, tag, "empty tag");
+            return NULL;
+        }
+        t->nops++;
+    }
+    if (nblocks > 0) {
+        template_error(L, src, t->ops[blocks[nblocks - 1]].off, "unclosed block");
+        return NULL;
+    }
+    return t;
+}
+
+typedef struct {
+    lua_Integer index;
+    lua_Integer count;
+} TemplateLoop;
+
+static void template_lookup(lua_State *L, int frames, int depth, TemplateLoop *loops,
+                            const char *path, size_t len) {
+    // Pushes the value of a path; frames holds the table at 1 and, for each
+    // loop level d, its list at 2d and current item at 2d + 1
+    if (len == 1 && path[0] == '.') {
+        lua_rawgeti(L, frames, depth > 0 ? 2 * depth + 1 : 1);
+        return;
+    }
+    if (len == 6 && strncmp(path, "@index", 6) == 0) {
+        if (depth > 0) {
+            lua_pushinteger(L, loops[depth].index);
+        } else {
+            lua_pushnil(L);
+        }
+        return;
+    }
+    size_t seg = 0;
+    while (seg < len && path[seg] != '.') {
+        seg++;
+    }
+    lua_pushnil(L);
+    for (int d = depth; d >= 0 && lua_isnil(L, -1); d--) {
+        lua_pop(L, 1);
+        lua_rawgeti(L, frames, d > 0 ? 2 * d + 1 : 1);
+        if (lua_istable(L, -1)) {
+            lua_pushlstring(L, path, seg);
+            lua_gettable(L, -2);
+            lua_remove(L, -2);
+        } else {
+            lua_pop(L, 1);
+            lua_pushnil(L);
+        }
+    }
+    while (seg < len) {
+        size_t start = seg + 1;
+        size_t end = start;
+        int digits = 1;
+        while (end < len && path[end] != '.') {
+            digits = digits && path[end] >= '0' && path[end] <= '9';
+            end++;
+        }
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            lua_pushnil(L);
+            return;
+        }
+        if (digits && end > start) {
+            lua_geti(L, -1, (lua_Integer)strtoll(path + start, NULL, 10));
+        } else {
+            lua_pushlstring(L, path + start, end - start);
+            lua_gettable(L, -2);
+        }
+        lua_remove(L, -2);
+        seg = end;
+    }
+}
+
+static void template_add_escaped(luaL_Buffer *b, const char *s, size_t len) {
+    size_t run = 0;
+    for (size_t i = 0; i < len; i++) {
+        const char *entity = NULL;
+        switch (s[i]) {
+            case '&': entity = "&amp;"; break;
+            case '<': entity = "&lt;"; break;
+            case '>': entity = "&gt;"; break;
+            case '"': entity = "&quot;"; break;
+            case '\'': entity = "&#39;"; break;
+        }
+        if (entity != NULL) {
+            luaL_addlstring(b, s + run, i - run);
+            luaL_addstring(b, entity);
+            run = i + 1;
+        }
+    }
+    luaL_addlstring(b, s + run, len - run);
+}
+
+static void template_emit(lua_State *L, luaL_Buffer *b, const char *src, TemplateOp *op) {
+    // Adds the value on top of the stack, which sits above the buffer box,
+    // and pops it. The value stays on top: once the buffer outgrows its
+    // inline storage its box is a to-be-closed slot that must not move.
+    int type = lua_type(L, -1);
+    if (type == LUA_TNIL) {
+        lua_pop(L, 1);
+        return;
+    }
+    if (type == LUA_TBOOLEAN) {
+        int value = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        luaL_addstring(b, value ? "true" : "false");
+        return;
+    }
+    if (type != LUA_TSTRING && type != LUA_TNUMBER) {
+        luaL_error(L, "template: cannot render a %s at {{%s}}", lua_typename(L, type),
+                   lua_pushlstring(L, src + op->off, op->len));
+    }
+    size_t len;
+    const char *s = lua_tolstring(L, -1, &len); // Converts numbers in place
+    size_t plain = 0;
+    if (op->kind == T_VAR) {
+        while (plain < len && memchr("&<>\"'", s[plain], 5) == NULL) {
+            plain++;
+        }
+    }
+    if (plain < len && op->kind == T_VAR) {
+        luaL_Buffer escaped;
+        luaL_buffinit(L, &escaped);
+        template_add_escaped(&escaped, s, len);
+        luaL_pushresult(&escaped);
+        lua_remove(L, -2);
+    }
+    luaL_addvalue(b);
+}
+
+static int template_render_compiled(lua_State *L, Template *t, int template_index, int context) {
+    // Renders with the template at template_index and the table at context;
+    // pushes the result
+    luaL_checktype(L, context, LUA_TTABLE);
+    lua_getiuservalue(L, template_index, 1);
+    const char *src = lua_tostring(L, -1);
+    lua_createtable(L, 2 * TEMPLATE_MAX_DEPTH + 1, 0);
+    int frames = lua_gettop(L);
+    lua_pushvalue(L, context);
+    lua_rawseti(L, frames, 1);
+
+    TemplateLoop loops[TEMPLATE_MAX_DEPTH + 1];
+    int depth = 0;
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    int pc = 0;
+    unsigned long long executed = 0;
+    while (pc < t->nops) {
+        TemplateOp *op = &t->ops[pc];
+        if (++executed == DEFAULT_HOOK_PERIOD) {
+            charge_instructions(L, executed);
+            executed = 0;
+        }
+        switch (op->kind) {
+            case T_TEXT:
+                luaL_addlstring(&b, src + op->off, op->len);
+                pc++;
+                break;
+            case T_VAR:
+            case T_RAW:
+                template_lookup(L, frames, depth, loops, src + op->off, op->len);
+                template_emit(L, &b, src, op);
+                pc++;
+                break;
+            case T_IF: {
+                template_lookup(L, frames, depth, loops, src + op->off, op->len);
+                int truthy = lua_toboolean(L, -1);
+                lua_pop(L, 1);
+                pc = truthy ? pc + 1 : op->jump;
+                break;
+            }
+            case T_ELSE:
+                pc = op->jump;
+                break;
+            case T_EACH: {
+                template_lookup(L, frames, depth, loops, src + op->off, op->len);
+                lua_Integer count = lua_istable(L, -1) ? luaL_len(L, -1) : 0;
+                if (count <= 0) {
+                    lua_pop(L, 1);
+                    pc = op->jump;
+                    break;
+                }
+                if (depth == TEMPLATE_MAX_DEPTH) {
+                    return luaL_error(L, "template: loops nested too deeply");
+                }
+                depth++;
+                loops[depth] = (TemplateLoop){1, count};
+                lua_geti(L, -1, 1);
+                lua_rawseti(L, frames, 2 * depth + 1);
+                lua_rawseti(L, frames, 2 * depth);
+                pc++;
+                break;
+            }
+            case T_END_EACH:
+                if (++loops[depth].index <= loops[depth].count) {
+                    lua_rawgeti(L, frames, 2 * depth);
+                    lua_geti(L, -1, loops[depth].index);
+                    lua_rawseti(L, frames, 2 * depth + 1);
+                    lua_pop(L, 1);
+                    pc = op->jump;
+                } else {
+                    lua_pushnil(L);
+                    lua_rawseti(L, frames, 2 * depth + 1);
+                    lua_pushnil(L);
+                    lua_rawseti(L, frames, 2 * depth);
+                    depth--;
+                    pc++;
+                }
+                break;
+        }
+    }
+    charge_instructions(L, executed);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static int template_object_render(lua_State *L) {
+    // compiled:render(context)
+    Template *t = (Template *)luaL_checkudata(L, 1, TEMPLATE_METATABLE);
+    return template_render_compiled(L, t, 1, 2);
+}
+
+static int template_lib_compile(lua_State *L) {
+    // template.compile(source) -> compiled template with :render(context)
+    template_compile(L, 1);
+    return 1;
+}
+
+static int template_lib_render(lua_State *L) {
+    // template.render(source, context), compiling source once per VM; the
+    // cache (upvalue 1, holding upvalue 2 bytes of sources and compiled ops)
+    // is emptied when it would pass TEMPLATE_CACHE_BYTES, and a template
+    // over a quarter of that is not kept
+    luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    lua_pushvalue(L, 1);
+    if (lua_rawget(L, lua_upvalueindex(1)) == LUA_TNIL) {
+        lua_pop(L, 1);
+        template_compile(L, 1);
+        lua_Integer cost = (lua_Integer)(lua_rawlen(L, 1) + lua_rawlen(L, 3)) + CACHE_ENTRY_OVERHEAD;
+        if (cost <= TEMPLATE_CACHE_BYTES / 4) {
+            lua_Integer held = lua_tointeger(L, lua_upvalueindex(2));
+            if (held + cost > TEMPLATE_CACHE_BYTES) {
+                lua_newtable(L);
+                lua_replace(L, lua_upvalueindex(1));
+                held = 0;
+            }
+            lua_pushinteger(L, held + cost);
+            lua_replace(L, lua_upvalueindex(2));
+            lua_pushvalue(L, 1);
+            lua_pushvalue(L, 3);
+            lua_rawset(L, lua_upvalueindex(1));
+        }
+    }
+    return template_render_compiled(L, (Template *)lua_touserdata(L, 3), 3, 2);
+}
+
+static int template_lib_escape(lua_State *L) {
+    // template.escape(s): s with & < > " ' replaced by HTML entities
+    size_t len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    template_add_escaped(&b, s, len);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static void open_template_lib(lua_State *L) {
+    luaL_newmetatable(L, TEMPLATE_METATABLE);
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, template_object_render);
+    lua_setfield(L, -2, "render");
+    lua_setfield(L, -2, "__index");
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "__metatable");
+    lua_pop(L, 1);
+
+    lua_createtable(L, 0, 3);
+    lua_pushcfunction(L, template_lib_compile);
+    lua_setfield(L, -2, "compile");
+    lua_newtable(L);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, template_lib_render, 2);
+    lua_setfield(L, -2, "render");
+    lua_pushcfunction(L, template_lib_escape);
+    lua_setfield(L, -2, "escape");
+    lua_setglobal(L, "template");
+}
+
+// Collections: compact containers for scripts that would otherwise build
+// large sets and queues out of tables. Their storage lives in userdata held
+// as user values of the collection, so l_alloc accounts for (and limits)
+// it, running out raises the usual memory error, and the GC frees it.
+//   collections.intset([n]) / strset([n]): hash sets of integers / strings
+//   collections.bitset(n): n bits, indexed from 1
+//   collections.bloom(n [, p]): Bloom filter for n items, false positive rate p
+//   collections.heap(): min-priority queue, ties popped in insertion order
+// plus table.new(narr [, nrec]) and table.clear(t).
+
+enum { SET_INTEGER, SET_STRING };
+
+typedef struct {
+    int kind;
+    size_t cap;         // Slots, a power of two; 0 until the first add
+    size_t count;       // Members
+    size_t used;        // Members and removed slots
+    size_t live_bytes;  // String bytes of the members
+    uint8_t *ctrl;      // Per slot: 0 empty, 1 removed, 0x80 | 7 hash bits when full
+    uint64_t *keys;     // The integer, or offset << 32 | length in the arena
+    char *arena;        // String bytes; those of removed members go at the next rehash
+    size_t arena_used;
+    size_t arena_cap;
+} Set;
+
+typedef struct {
+    uint64_t i;
+    const char *s;
+    size_t len;
+    uint64_t hash;
+} SetKey;
+
+typedef struct {
+    lua_Integer size;
+    uint64_t words[1];
+} Bitset;
+
+typedef struct {
+    uint64_t bits;
+    int hashes;
+    uint64_t words[1];
+} Bloom;
+
+typedef struct {
+    lua_Number priority;
+    lua_Integer seq;
+} HeapEntry;
+
+typedef struct {
+    size_t count;
+    size_t cap;
+    lua_Integer seq;    // Insertion counter breaking ties between priorities
+    HeapEntry *entries; // Binary heap; the values are in user value 2 at index + 1
+} Heap;
+
+static uint64_t hash_integer(uint64_t x) {
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t hash_bytes(const char *s, size_t len) {
+    // FNV-1a, finalized so the low bits used as slot index are mixed
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+    }
+    return hash_integer(h ^ len);
+}
+
+static void *collection_alloc(lua_State *L, size_t size) {
+    // Pushes zeroed storage; the caller makes it a user value once filled
+    void *buf = lua_newuserdatauv(L, size, 0);
+    memset(buf, 0, size);
+    return buf;
+}
+
+static void set_key(lua_State *L, Set *set, int arg, SetKey *key) {
+    if (set->kind == SET_INTEGER) {
+        key->i = (uint64_t)luaL_checkinteger(L, arg);
+        key->hash = hash_integer(key->i);
+    } else {
+        key->s = luaL_checklstring(L, arg, &key->len);
+        luaL_argcheck(L, key->len <= UINT32_MAX, arg, "string too long");
+        key->hash = hash_bytes(key->s, key->len);
+    }
+}
+
+static size_t set_find(Set *set, const SetKey *key, int *found) {
+    // Slot holding key, or where to add it: the first removed slot probed,
+    // else the empty one ending the probe
+    size_t mask = set->cap - 1;
+    size_t insert = SIZE_MAX;
+    uint8_t tag = 0x80 | (uint8_t)(key->hash >> 57);
+    for (size_t i = key->hash & mask; ; i = (i + 1) & mask) {
+        uint8_t c = set->ctrl[i];
+        if (c == 0) {
+            *found = 0;
+            return insert != SIZE_MAX ? insert : i;
+        }
+        if (c == 1) {
+            if (insert == SIZE_MAX) {
+                insert = i;
+            }
+        } else if (c == tag) {
+            uint64_t k = set->keys[i];
+            if (set->kind == SET_INTEGER ? k == key->i
+                    : (k & 0xffffffffu) == key->len && memcmp(set->arena + (k >> 32), key->s, key->len) == 0) {
+                *found = 1;
+                return i;
+            }
+        }
+    }
+}
+
+static void set_rehash(lua_State *L, Set *set, int obj, size_t cap, size_t arena_cap) {
+    // Moves the members to cap slots and, for strings, a compacted arena
+    obj = lua_absindex(L, obj);
+    if (set->kind == SET_STRING && arena_cap > UINT32_MAX) {
+        luaL_error(L, "set: too much string data");
+    }
+    uint8_t *ctrl = (uint8_t *)collection_alloc(L, cap);
+    uint64_t *keys = (uint64_t *)collection_alloc(L, cap * sizeof(uint64_t));
+    char *arena = set->kind == SET_STRING ? (char *)collection_alloc(L, arena_cap) : NULL;
+    size_t arena_used = 0;
+    for (size_t i = 0; i < set->cap; i++) {
+        if (set->ctrl[i] < 0x80) {
+            continue;
+        }
+        uint64_t k = set->keys[i];
+        uint64_t hash;
+        if (set->kind == SET_INTEGER) {
+            hash = hash_integer(k);
+        } else {
+            size_t len = k & 0xffffffffu;
+            memcpy(arena + arena_used, set->arena + (k >> 32), len);
+            hash = hash_bytes(arena + arena_used, len);
+            k = ((uint64_t)arena_used << 32) | len;
+            arena_used += len;
+        }
+        size_t j = hash & (cap - 1);
+        while (ctrl[j] != 0) {
+            j = (j + 1) & (cap - 1);
+        }
+        ctrl[j] = 0x80 | (uint8_t)(hash >> 57);
+        keys[j] = k;
+    }
+    if (arena != NULL) {
+        lua_setiuservalue(L, obj, 3);
+        set->arena = arena;
+        set->arena_used = arena_used;
+        set->arena_cap = arena_cap;
+    }
+    lua_setiuservalue(L, obj, 2);
+    lua_setiuservalue(L, obj, 1);
+    set->ctrl = ctrl;
+    set->keys = keys;
+    set->cap = cap;
+    set->used = set->count;
+}
+
+static size_t set_capacity(size_t count) {
+    // Slots keeping count members at most half full
+    size_t cap = 8;
+    while (cap < count * 2) {
+        cap *= 2;
+    }
+    return cap;
+}
+
+static int set_add(lua_State *L) {
+    // set:add(value) -> true if value was not a member
+    Set *set = (Set *)luaL_checkudata(L, 1, SET_METATABLE);
+    SetKey key;
+    set_key(L, set, 2, &key);
+    int found = 0;
+    if (set->cap > 0) {
+        set_find(set, &key, &found);
+    }
+    if (found) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    int full = set->cap == 0 || (set->used + 1) * 4 > set->cap * 3;
+    if (full || (set->kind == SET_STRING && set->arena_used + key.len > set->arena_cap)) {
+        size_t arena_cap = set->arena_cap;
+        if (set->kind == SET_STRING && set->arena_used + key.len > arena_cap) {
+            arena_cap = (set->live_bytes + key.len) * 2 + 64;
+        }
+        set_rehash(L, set, 1, full ? set_capacity(set->count + 1) : set->cap, arena_cap);
+    }
+    size_t slot = set_find(set, &key, &found);
+    if (set->kind == SET_INTEGER) {
+        set->keys[slot] = key.i;
+    } else {
+        if (key.len > 0) {
+            memcpy(set->arena + set->arena_used, key.s, key.len);
+        }
+        set->keys[slot] = ((uint64_t)set->arena_used << 32) | key.len;
+        set->arena_used += key.len;
+        set->live_bytes += key.len;
+    }
+    set->used += set->ctrl[slot] == 0;
+    set->ctrl[slot] = 0x80 | (uint8_t)(key.hash >> 57);
+    set->count++;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int set_remove(lua_State *L) {
+    // set:remove(value) -> true if value was a member
+    Set *set = (Set *)luaL_checkudata(L, 1, SET_METATABLE);
+    SetKey key;
+    set_key(L, set, 2, &key);
+    int found = 0;
+    size_t slot = set->cap > 0 ? set_find(set, &key, &found) : 0;
+    if (found) {
+        set->ctrl[slot] = 1;
+        set->count--;
+        if (set->kind == SET_STRING) {
+            set->live_bytes -= key.len;
+        }
+    }
+    lua_pushboolean(L, found);
+    return 1;
+}
+
+static int set_has(lua_State *L) {
+    Set *set = (Set *)luaL_checkudata(L, 1, SET_METATABLE);
+    SetKey key;
+    set_key(L, set, 2, &key);
+    int found = 0;
+    if (set->cap > 0) {
+        set_find(set, &key, &found);
+    }
+    lua_pushboolean(L, found);
+    return 1;
+}
+
+static int set_clear(lua_State *L) {
+    // Empties the set, keeping its storage
+    Set *set = (Set *)luaL_checkudata(L, 1, SET_METATABLE);
+    if (set->cap > 0) {
+        memset(set->ctrl, 0, set->cap);
+    }
+    set->count = set->used = set->live_bytes = set->arena_used = 0;
+    return 0;
+}
+
+static int set_next(lua_State *L) {
+    // Iterator of set:items(); upvalue 2 is the next slot to look at
+    Set *set = (Set *)lua_touserdata(L, lua_upvalueindex(1));
+    size_t i = (size_t)lua_tointeger(L, lua_upvalueindex(2));
+    while (i < set->cap && set->ctrl[i] < 0x80) {
+        i++;
+    }
+    if (i >= set->cap) {
+        return 0;
+    }
+    lua_pushinteger(L, (lua_Integer)(i + 1));
+    lua_replace(L, lua_upvalueindex(2));
+    uint64_t k = set->keys[i];
+    if (set->kind == SET_INTEGER) {
+        lua_pushinteger(L, (lua_Integer)k);
+    } else {
+        lua_pushlstring(L, set->arena + (k >> 32), k & 0xffffffffu);
+    }
+    return 1;
+}
+
+static int set_items(lua_State *L) {
+    // for value in set:items() do ... end, in no particular order
+    luaL_checkudata(L, 1, SET_METATABLE);
+    lua_settop(L, 1);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, set_next, 2);
+    return 1;
+}
+
+static int set_len(lua_State *L) {
+    Set *set = (Set *)luaL_checkudata(L, 1, SET_METATABLE);
+    lua_pushinteger(L, (lua_Integer)set->count);
+    return 1;
+}
+
+static int set_new(lua_State *L, int kind) {
+    lua_Integer n = luaL_optinteger(L, 1, 0);
+    luaL_argcheck(L, n >= 0 && (lua_Unsigned)n <= SIZE_MAX / 32, 1, "size out of range");
+    Set *set = (Set *)lua_newuserdatauv(L, sizeof(Set), 3);
+    memset(set, 0, sizeof(Set));
+    set->kind = kind;
+    luaL_setmetatable(L, SET_METATABLE);
+    if (n > 0) {
+        set_rehash(L, set, -1, set_capacity((size_t)n), 0);
+    }
+    return 1;
+}
+
+static int collections_intset(lua_State *L) {
+    return set_new(L, SET_INTEGER);
+}
+
+static int collections_strset(lua_State *L) {
+    return set_new(L, SET_STRING);
+}
+
+static uint64_t bitset_index(lua_State *L, lua_Integer size, int arg) {
+    lua_Integer i = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, i >= 1 && i <= size, arg, "index out of range");
+    return (uint64_t)(i - 1);
+}
+
+static int bitset_set(lua_State *L) {
+    // bitset:set(i [, on = true])
+    Bitset *b = (Bitset *)luaL_checkudata(L, 1, BITSET_METATABLE);
+    uint64_t i = bitset_index(L, b->size, 2);
+    uint64_t bit = (uint64_t)1 << (i & 63);
+    if (lua_isnone(L, 3) || lua_toboolean(L, 3)) {
+        b->words[i >> 6] |= bit;
+    } else {
+        b->words[i >> 6] &= ~bit;
+    }
+    return 0;
+}
+
+static int bitset_get(lua_State *L) {
+    Bitset *b = (Bitset *)luaL_checkudata(L, 1, BITSET_METATABLE);
+    uint64_t i = bitset_index(L, b->size, 2);
+    lua_pushboolean(L, (b->words[i >> 6] >> (i & 63)) & 1);
+    return 1;
+}
+
+static int bitset_count(lua_State *L) {
+    // Number of bits set
+    Bitset *b = (Bitset *)luaL_checkudata(L, 1, BITSET_METATABLE);
+    lua_Integer count = 0;
+    size_t words = (size_t)(b->size + 63) / 64;
+    for (size_t w = 0; w < words; w++) {
+        count += __builtin_popcountll(b->words[w]);
+    }
+    charge_instructions(L, words / 64);
+    lua_pushinteger(L, count);
+    return 1;
+}
+
+static int bitset_clear(lua_State *L) {
+    Bitset *b = (Bitset *)luaL_checkudata(L, 1, BITSET_METATABLE);
+    memset(b->words, 0, (size_t)(b->size + 63) / 64 * sizeof(uint64_t));
+    return 0;
+}
+
+static int bitset_len(lua_State *L) {
+    Bitset *b = (Bitset *)luaL_checkudata(L, 1, BITSET_METATABLE);
+    lua_pushinteger(L, b->size);
+    return 1;
+}
+
+static int collections_bitset(lua_State *L) {
+    lua_Integer n = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, n >= 0 && (lua_Unsigned)n <= SIZE_MAX / 2, 1, "size out of range");
+    size_t words = (size_t)(n + 63) / 64;
+    Bitset *b = (Bitset *)collection_alloc(L, offsetof(Bitset, words) + (words ? words : 1) * sizeof(uint64_t));
+    b->size = n;
+    luaL_setmetatable(L, BITSET_METATABLE);
+    return 1;
+}
+
+static uint64_t bloom_hash(lua_State *L, int arg) {
+    // Integers hash by value, anything else by its string form
+    if (lua_isinteger(L, arg)) {
+        return hash_integer((uint64_t)lua_tointeger(L, arg));
+    }
+    size_t len;
+    const char *s = luaL_checklstring(L, arg, &len);
+    return hash_bytes(s, len) ^ 0x9e3779b97f4a7c15ULL;
+}
+
+static int bloom_probe(lua_State *L, int add) {
+    // Double hashing: bit j of the item is h1 + j * h2
+    Bloom *f = (Bloom *)luaL_checkudata(L, 1, BLOOM_METATABLE);
+    uint64_t h1 = bloom_hash(L, 2);
+    uint64_t h2 = hash_integer(h1) | 1;
+    int present = 1;
+    for (int j = 0; j < f->hashes; j++) {
+        uint64_t bit = (h1 + (uint64_t)j * h2) % f->bits;
+        uint64_t mask = (uint64_t)1 << (bit & 63);
+        present = present && (f->words[bit >> 6] & mask);
+        if (add) {
+            f->words[bit >> 6] |= mask;
+        }
+    }
+    lua_pushboolean(L, add ? !present : present);
+    return 1;
+}
+
+static int bloom_add(lua_State *L) {
+    // bloom:add(item) -> true unless item (or a collision) was already there
+    return bloom_probe(L, 1);
+}
+
+static int bloom_has(lua_State *L) {
+    // bloom:has(item) -> false if item was never added, true if it probably was
+    return bloom_probe(L, 0);
+}
+
+static int bloom_clear(lua_State *L) {
+    Bloom *f = (Bloom *)luaL_checkudata(L, 1, BLOOM_METATABLE);
+    memset(f->words, 0, f->bits / 8);
+    return 0;
+}
+
+static int collections_bloom(lua_State *L) {
+    // Sized for n items at false positive rate p: m = -n ln p / ln(2)^2 bits
+    // and k = m / n ln 2 hashes
+    lua_Integer n = luaL_checkinteger(L, 1);
+    lua_Number p = luaL_optnumber(L, 2, 0.01);
+    luaL_argcheck(L, n > 0, 1, "item count must be positive");
+    luaL_argcheck(L, p > 0 && p < 1, 2, "false positive rate must be between 0 and 1");
+    double ln2 = log(2.0);
+    double m = ceil(-(double)n * log(p) / (ln2 * ln2));
+    luaL_argcheck(L, m <= (double)(SIZE_MAX / 2), 1, "filter too large");
+    uint64_t bits = m < 64 ? 64 : ((uint64_t)m + 63) / 64 * 64;
+    int hashes = (int)lround((double)bits / (double)n * ln2);
+    Bloom *f = (Bloom *)collection_alloc(L, offsetof(Bloom, words) + bits / 8);
+    f->bits = bits;
+    f->hashes = hashes < 1 ? 1 : hashes > 16 ? 16 : hashes;
+    luaL_setmetatable(L, BLOOM_METATABLE);
+    return 1;
+}
+
+static int heap_less(const HeapEntry *a, const HeapEntry *b) {
+    return a->priority < b->priority || (a->priority == b->priority && a->seq < b->seq);
+}
+
+static void heap_move(lua_State *L, int values, size_t from, size_t to) {
+    lua_rawgeti(L, values, (lua_Integer)from + 1);
+    lua_rawseti(L, values, (lua_Integer)to + 1);
+}
+
+static int heap_push(lua_State *L) {
+    // heap:push(priority, value)
+    Heap *h = (Heap *)luaL_checkudata(L, 1, HEAP_METATABLE);
+    lua_Number priority = luaL_checknumber(L, 2);
+    luaL_argcheck(L, priority == priority, 2, "priority is NaN");
+    luaL_checkany(L, 3);
+    lua_settop(L, 3);
+    if (h->count == h->cap) {
+        size_t cap = h->cap ? h->cap * 2 : 16;
+        luaL_argcheck(L, cap <= SIZE_MAX / sizeof(HeapEntry), 1, "heap too large");
+        HeapEntry *entries = (HeapEntry *)collection_alloc(L, cap * sizeof(HeapEntry));
+        if (h->count > 0) {
+            memcpy(entries, h->entries, h->count * sizeof(HeapEntry));
+        }
+        lua_setiuservalue(L, 1, 1);
+        h->entries = entries;
+        h->cap = cap;
+    }
+    lua_getiuservalue(L, 1, 2);
+    HeapEntry entry = {priority, h->seq++};
+    size_t i = h->count++;
+    while (i > 0 && heap_less(&entry, &h->entries[(i - 1) / 2])) {
+        h->entries[i] = h->entries[(i - 1) / 2];
+        heap_move(L, 4, (i - 1) / 2, i);
+        i = (i - 1) / 2;
+    }
+    h->entries[i] = entry;
+    lua_pushvalue(L, 3);
+    lua_rawseti(L, 4, (lua_Integer)i + 1);
+    return 0;
+}
+
+static int heap_pop(lua_State *L) {
+    // heap:pop() -> value, priority of the lowest priority, or nothing if empty
+    Heap *h = (Heap *)luaL_checkudata(L, 1, HEAP_METATABLE);
+    if (h->count == 0) {
+        return 0;
+    }
+    lua_settop(L, 1);
+    lua_getiuservalue(L, 1, 2);
+    lua_rawgeti(L, 2, 1);
+    lua_pushnumber(L, h->entries[0].priority);
+    HeapEntry last = h->entries[--h->count];
+    if (h->count > 0) {
+        // Sift the last entry down from the root
+        size_t i = 0;
+        for (;;) {
+            size_t child = 2 * i + 1;
+            if (child >= h->count) {
+                break;
+            }
+            if (child + 1 < h->count && heap_less(&h->entries[child + 1], &h->entries[child])) {
+                child++;
+            }
+            if (!heap_less(&h->entries[child], &last)) {
+                break;
+            }
+            h->entries[i] = h->entries[child];
+            heap_move(L, 2, child, i);
+            i = child;
+        }
+        h->entries[i] = last;
+        heap_move(L, 2, h->count, i);
+    }
+    lua_pushnil(L);
+    lua_rawseti(L, 2, (lua_Integer)h->count + 1);
+    return 2;
+}
+
+static int heap_peek(lua_State *L) {
+    // heap:peek() -> value, priority popped next, or nothing if empty
+    Heap *h = (Heap *)luaL_checkudata(L, 1, HEAP_METATABLE);
+    if (h->count == 0) {
+        return 0;
+    }
+    lua_getiuservalue(L, 1, 2);
+    lua_rawgeti(L, -1, 1);
+    lua_pushnumber(L, h->entries[0].priority);
+    return 2;
+}
+
+static int heap_clear(lua_State *L) {
+    Heap *h = (Heap *)luaL_checkudata(L, 1, HEAP_METATABLE);
+    lua_newtable(L);
+    lua_setiuservalue(L, 1, 2);
+    h->count = 0;
+    return 0;
+}
+
+static int heap_len(lua_State *L) {
+    Heap *h = (Heap *)luaL_checkudata(L, 1, HEAP_METATABLE);
+    lua_pushinteger(L, (lua_Integer)h->count);
+    return 1;
+}
+
+static int collections_heap(lua_State *L) {
+    Heap *h = (Heap *)lua_newuserdatauv(L, sizeof(Heap), 2);
+    memset(h, 0, sizeof(Heap));
+    lua_newtable(L);
+    lua_setiuservalue(L, -2, 2);
+    luaL_setmetatable(L, HEAP_METATABLE);
+    return 1;
+}
+
+static int table_new(lua_State *L) {
+    // table.new(narr [, nrec]): an empty table presized for narr sequence
+    // items and nrec other fields
+    lua_Integer narr = luaL_checkinteger(L, 1);
+    lua_Integer nrec = luaL_optinteger(L, 2, 0);
+    luaL_argcheck(L, narr >= 0 && narr <= INT_MAX, 1, "size out of range");
+    luaL_argcheck(L, nrec >= 0 && nrec <= INT_MAX, 2, "size out of range");
+    lua_createtable(L, (int)narr, (int)nrec);
+    return 1;
+}
+
+static int table_clear(lua_State *L) {
+    // table.clear(t): removes every field, keeping the allocated size
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    unsigned long long cleared = 0;
+    lua_pushnil(L);
+    while (lua_next(L, 1) != 0) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, 1);
+        cleared++;
+    }
+    charge_instructions(L, cleared);
+    return 0;
+}
+
+static void open_collection_type(lua_State *L, const char *name, const luaL_Reg *methods, lua_CFunction len) {
+    luaL_newmetatable(L, name);
+    lua_newtable(L);
+    luaL_setfuncs(L, methods, 0);
+    lua_setfield(L, -2, "__index");
+    if (len != NULL) {
+        lua_pushcfunction(L, len);
+        lua_setfield(L, -2, "__len");
+    }
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "__metatable");
+    lua_pop(L, 1);
+}
+
+static void open_collections_lib(lua_State *L) {
+    static const luaL_Reg set_methods[] = {
+        {"add", set_add}, {"remove", set_remove}, {"has", set_has},
+        {"clear", set_clear}, {"items", set_items}, {NULL, NULL}
+    };
+    static const luaL_Reg bitset_methods[] = {
+        {"set", bitset_set}, {"get", bitset_get}, {"count", bitset_count},
+        {"clear", bitset_clear}, {NULL, NULL}
+    };
+    static const luaL_Reg bloom_methods[] = {
+        {"add", bloom_add}, {"has", bloom_has}, {"clear", bloom_clear}, {NULL, NULL}
+    };
+    static const luaL_Reg heap_methods[] = {
+        {"push", heap_push}, {"pop", heap_pop}, {"peek", heap_peek},
+        {"clear", heap_clear}, {NULL, NULL}
+    };
+    static const luaL_Reg lib[] = {
+        {"intset", collections_intset}, {"strset", collections_strset},
+        {"bitset", collections_bitset}, {"bloom", collections_bloom},
+        {"heap", collections_heap}, {NULL, NULL}
+    };
+    open_collection_type(L, SET_METATABLE, set_methods, set_len);
+    open_collection_type(L, BITSET_METATABLE, bitset_methods, bitset_len);
+    open_collection_type(L, BLOOM_METATABLE, bloom_methods, NULL);
+    open_collection_type(L, HEAP_METATABLE, heap_methods, heap_len);
+    luaL_newlib(L, lib);
+    lua_setglobal(L, "collections");
+
+    // Added to the filtered table library
+    lua_getglobal(L, "table");
+    lua_pushcfunction(L, table_new);
+    lua_setfield(L, -2, "new");
+    lua_pushcfunction(L, table_clear);
+    lua_setfield(L, -2, "clear");
+    lua_pop(L, 1);
+}
+
+// Codecs: the `codec` library hashes and encodes strings in C. Each call
+// charges one instruction per BYTES_PER_INSTRUCTION bytes of input
+// up front, so a large input fails against the budget before it is read;
+// output is built in a luaL_Buffer, allocated (and limited) by l_alloc.
+
+static uint32_t crc32_tables[8][256];
+
+static void codec_init(void) {
+    // Slicing-by-8 tables of the reflected IEEE polynomial
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ 0xedb88320u : c >> 1;
+        }
+        crc32_tables[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev = crc32_tables[t - 1][i];
+            crc32_tables[t][i] = (prev >> 8) ^ crc32_tables[0][prev & 0xff];
+        }
+    }
+}
+
+static const char *codec_input(lua_State *L, int arg, size_t *len) {
+    const char *s = luaL_checklstring(L, arg, len);
+    charge_bytes(L, *len);
+    return s;
+}
+
+static uint32_t load_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t load_le64(const unsigned char *p) {
+    return (uint64_t)load_le32(p) | (uint64_t)load_le32(p + 4) << 32;
+}
+
+static void push_hex(lua_State *L, const unsigned char *bytes, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    luaL_Buffer b;
+    char *out = luaL_buffinitsize(L, &b, len * 2);
+    for (size_t i = 0; i < len; i++) {
+        out[2 * i] = digits[bytes[i] >> 4];
+        out[2 * i + 1] = digits[bytes[i] & 15];
+    }
+    luaL_pushresultsize(&b, len * 2);
+}
+
+static int codec_crc32(lua_State *L) {
+    // codec.crc32(s [, crc]): CRC-32 (as zlib), continuing from crc if given
+    size_t len;
+    const unsigned char *p = (const unsigned char *)codec_input(L, 1, &len);
+    uint32_t crc = ~(uint32_t)luaL_optinteger(L, 2, 0);
+    while (len >= 8) {
+        uint32_t lo = load_le32(p) ^ crc;
+        uint32_t hi = load_le32(p + 4);
+        crc = crc32_tables[7][lo & 0xff] ^ crc32_tables[6][(lo >> 8) & 0xff] ^
+              crc32_tables[5][(lo >> 16) & 0xff] ^ crc32_tables[4][lo >> 24] ^
+              crc32_tables[3][hi & 0xff] ^ crc32_tables[2][(hi >> 8) & 0xff] ^
+              crc32_tables[1][(hi >> 16) & 0xff] ^ crc32_tables[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ crc32_tables[0][(crc ^ *p++) & 0xff];
+    }
+    lua_pushinteger(L, (lua_Integer)(~crc));
+    return 1;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t state[8], const unsigned char *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | (uint32_t)block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static int codec_sha256(lua_State *L) {
+    // codec.sha256(s [, raw]): hex digest, or the 32 bytes when raw is true
+    size_t len;
+    const unsigned char *p = (const unsigned char *)codec_input(L, 1, &len);
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    uint64_t bits = (uint64_t)len * 8;
+    size_t full = len & ~(size_t)63;
+    for (size_t off = 0; off < full; off += 64) {
+        sha256_block(state, p + off);
+    }
+    // Padding: 0x80, zeros, then the length in bits, over one or two blocks
+    unsigned char tail[128] = {0};
+    size_t rest = len - full;
+    memcpy(tail, p + full, rest);
+    tail[rest] = 0x80;
+    size_t tail_len = rest < 56 ? 64 : 128;
+    for (int i = 0; i < 8; i++) {
+        tail[tail_len - 1 - i] = (unsigned char)(bits >> (8 * i));
+    }
+    for (size_t off = 0; off < tail_len; off += 64) {
+        sha256_block(state, tail + off);
+    }
+    unsigned char digest[32];
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (unsigned char)(state[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(state[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(state[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)state[i];
+    }
+    if (lua_toboolean(L, 2)) {
+        lua_pushlstring(L, (const char *)digest, sizeof(digest));
+    } else {
+        push_hex(L, digest, sizeof(digest));
+    }
+    return 1;
+}
+
+#define XXH_PRIME64_1 0x9e3779b185ebca87ULL
+#define XXH_PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME64_3 0x165667b19e3779f9ULL
+#define XXH_PRIME64_4 0x85ebca77c2b2ae63ULL
+#define XXH_PRIME64_5 0x27d4eb2f165667c5ULL
+#define ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    return ROTL64(acc, 31) * XXH_PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t lane) {
+    acc ^= xxh64_round(0, lane);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static int codec_xxh64(lua_State *L) {
+    // codec.xxh64(s [, seed]): XXH64 as an integer (wrapping to negative
+    // values above math.maxinteger)
+    size_t len;
+    const unsigned char *p = (const unsigned char *)codec_input(L, 1, &len);
+    uint64_t seed = (uint64_t)luaL_optinteger(L, 2, 0);
+    const unsigned char *end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        do {
+            v1 = xxh64_round(v1, load_le64(p));
+            v2 = xxh64_round(v2, load_le64(p + 8));
+            v3 = xxh64_round(v3, load_le64(p + 16));
+            v4 = xxh64_round(v4, load_le64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+        h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+    h += (uint64_t)len;
+    for (; end - p >= 8; p += 8) {
+        h ^= xxh64_round(0, load_le64(p));
+        h = ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (end - p >= 4) {
+        h ^= (uint64_t)load_le32(p) * XXH_PRIME64_1;
+        h = ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_PRIME64_5;
+        h = ROTL64(h, 11) * XXH_PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    lua_pushinteger(L, (lua_Integer)h);
+    return 1;
+}
+
+static const char base64_digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int codec_base64_encode(lua_State *L) {
+    size_t len;
+    const unsigned char *p = (const unsigned char *)codec_input(L, 1, &len);
+    luaL_argcheck(L, len <= (SIZE_MAX - 3) / 4 * 3, 1, "string too long");
+    size_t out_len = (len + 2) / 3 * 4;
+    luaL_Buffer b;
+    char *out = luaL_buffinitsize(L, &b, out_len);
+    size_t i = 0, o = 0;
+    for (; i + 3 <= len; i += 3) {
+        uint32_t v = (uint32_t)p[i] << 16 | (uint32_t)p[i + 1] << 8 | p[i + 2];
+        out[o++] = base64_digits[v >> 18];
+        out[o++] = base64_digits[(v >> 12) & 63];
+        out[o++] = base64_digits[(v >> 6) & 63];
+        out[o++] = base64_digits[v & 63];
+    }
+    if (i < len) {
+        uint32_t v = (uint32_t)p[i] << 16 | (i + 1 < len ? (uint32_t)p[i + 1] << 8 : 0);
+        out[o++] = base64_digits[v >> 18];
+        out[o++] = base64_digits[(v >> 12) & 63];
+        out[o++] = i + 1 < len ? base64_digits[(v >> 6) & 63] : '=';
+        out[o++] = '=';
+    }
+    luaL_pushresultsize(&b, out_len);
+    return 1;
+}
+
+static int base64_value(unsigned char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+static int codec_base64_decode(lua_State *L) {
+    // codec.base64_decode(s) -> bytes, or nil and a message if s is not
+    // base64; the padding may be omitted
+    size_t len;
+    const unsigned char *p = (const unsigned char *)codec_input(L, 1, &len);
+    size_t data_len = len;
+    while (data_len > 0 && len - data_len < 2 && p[data_len - 1] == '=') {
+        data_len--;
+    }
+    if (data_len % 4 == 1 || (data_len < len && len % 4 != 0)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "invalid base64 length");
+        return 2;
+    }
+    luaL_Buffer b;
+    char *out = luaL_buffinitsize(L, &b, data_len / 4 * 3 + 2);
+    size_t o = 0;
+    uint32_t acc = 0;
+    for (size_t i = 0; i < data_len; i++) {
+        int v = base64_value(p[i]);
+        if (v < 0) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "invalid base64 character at position %d", (int)i + 1);
+            return 2;
+        }
+        acc = acc << 6 | (uint32_t)v;
+        if (i % 4 == 3) {
+            out[o++] = (char)(acc >> 16);
+            out[o++] = (char)(acc >> 8);
+            out[o++] = (char)acc;
+        }
+    }
+    if (data_len % 4 == 2) {
+        out[o++] = (char)(acc >> 4);
+    } else if (data_len % 4 == 3) {
+        out[o++] = (char)(acc >> 10);
+        out[o++] = (char)(acc >> 2);
+    }
+    luaL_pushresultsize(&b, o);
+    return 1;
+}
+
+static int codec_hex_encode(lua_State *L) {
+    // codec.hex_encode(s): lowercase hex of the bytes of s
+    size_t len;
+    const unsigned char *p = (const unsigned char *)codec_input(L, 1, &len);
+    luaL_argcheck(L, len <= SIZE_MAX / 2, 1, "string too long");
+    push_hex(L, p, len);
+    return 1;
+}
+
+static int hex_value(unsigned char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int codec_hex_decode(lua_State *L) {
+    // codec.hex_decode(s) -> bytes, or nil and a message if s is not hex
+    size_t len;
+    const unsigned char *p = (const unsigned char *)codec_input(L, 1, &len);
+    if (len % 2 != 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "odd hex length");
+        return 2;
+    }
+    luaL_Buffer b;
+    char *out = luaL_buffinitsize(L, &b, len / 2);
+    for (size_t i = 0; i < len; i += 2) {
+        int hi = hex_value(p[i]), lo = hex_value(p[i + 1]);
+        if (hi < 0 || lo < 0) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "invalid hex digit at position %d", (int)i + (hi < 0 ? 1 : 2));
+            return 2;
+        }
+        out[i / 2] = (char)(hi << 4 | lo);
+    }
+    luaL_pushresultsize(&b, len / 2);
+    return 1;
+}
+
+static void open_codec_lib(lua_State *L) {
+    static const luaL_Reg lib[] = {
+        {"crc32", codec_crc32}, {"sha256", codec_sha256}, {"xxh64", codec_xxh64},
+        {"base64_encode", codec_base64_encode}, {"base64_decode", codec_base64_decode},
+        {"hex_encode", codec_hex_encode}, {"hex_decode", codec_hex_decode},
+        {NULL, NULL}
+    };
+    luaL_newlib(L, lib);
+    lua_setglobal(L, "codec");
+}
+
+// String utilities added to the filtered `string` table, and so also
+// available as methods on strings: split, trim, startswith, endswith,
+// replace and join. Separators and patterns are plain strings. Each call
+// charges per BYTES_PER_INSTRUCTION bytes scanned, plus one instruction
+// per piece for split and join.
+
+static const char *find_plain(const char *s, size_t len, const char *p, size_t plen) {
+    // First occurrence of p (plen > 0) in s, or NULL
+    while (len >= plen) {
+        const char *hit = (const char *)memchr(s, *p, len - plen + 1);
+        if (hit == NULL) {
+            return NULL;
+        }
+        if (memcmp(hit + 1, p + 1, plen - 1) == 0) {
+            return hit;
+        }
+        len -= (size_t)(hit + 1 - s);
+        s = hit + 1;
+    }
+    return NULL;
+}
+
+static int string_split(lua_State *L) {
+    // string.split(s, sep [, limit]) -> table of the pieces of s between
+    // occurrences of sep; with limit, at most limit pieces, the last one
+    // holding the rest of s
+    size_t len, sep_len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    const char *sep = luaL_checklstring(L, 2, &sep_len);
+    lua_Integer limit = luaL_optinteger(L, 3, LUA_MAXINTEGER);
+    luaL_argcheck(L, sep_len > 0, 2, "empty separator");
+    luaL_argcheck(L, limit > 0, 3, "limit must be positive");
+    charge_bytes(L, len);
+    // Counted first so the table is created at its final size
+    const char *end = s + len;
+    lua_Integer count = 1;
+    for (const char *p = s; count < limit && (p = find_plain(p, (size_t)(end - p), sep, sep_len)) != NULL; p += sep_len) {
+        count++;
+    }
+    charge_instructions(L, (unsigned long long)count);
+    lua_createtable(L, count < INT_MAX ? (int)count : INT_MAX, 0);
+    const char *p = s;
+    for (lua_Integer i = 1; i < count; i++) {
+        const char *hit = find_plain(p, (size_t)(end - p), sep, sep_len);
+        lua_pushlstring(L, p, (size_t)(hit - p));
+        lua_rawseti(L, -2, i);
+        p = hit + sep_len;
+    }
+    lua_pushlstring(L, p, (size_t)(end - p));
+    lua_rawseti(L, -2, count);
+    return 1;
+}
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static int string_trim(lua_State *L) {
+    // string.trim(s) -> s without leading and trailing whitespace
+    size_t len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    size_t start = 0, end = len;
+    while (start < end && is_space(s[start])) {
+        start++;
+    }
+    while (end > start && is_space(s[end - 1])) {
+        end--;
+    }
+    charge_bytes(L, start + (len - end));
+    if (start == 0 && end == len) {
+        lua_settop(L, 1);
+    } else {
+        lua_pushlstring(L, s + start, end - start);
+    }
+    return 1;
+}
+
+static int string_startswith(lua_State *L) {
+    size_t len, prefix_len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    const char *prefix = luaL_checklstring(L, 2, &prefix_len);
+    charge_bytes(L, prefix_len);
+    lua_pushboolean(L, prefix_len <= len && memcmp(s, prefix, prefix_len) == 0);
+    return 1;
+}
+
+static int string_endswith(lua_State *L) {
+    size_t len, suffix_len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    const char *suffix = luaL_checklstring(L, 2, &suffix_len);
+    charge_bytes(L, suffix_len);
+    lua_pushboolean(L, suffix_len <= len && memcmp(s + len - suffix_len, suffix, suffix_len) == 0);
+    return 1;
+}
+
+static int string_replace(lua_State *L) {
+    // string.replace(s, old, new [, n]) -> s with the first n (default all)
+    // occurrences of old replaced by new, and the number replaced, like gsub
+    size_t len, old_len, new_len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    const char *old = luaL_checklstring(L, 2, &old_len);
+    const char *repl = luaL_checklstring(L, 3, &new_len);
+    lua_Integer max = luaL_optinteger(L, 4, LUA_MAXINTEGER);
+    luaL_argcheck(L, old_len > 0, 2, "empty string to replace");
+    charge_bytes(L, len);
+    const char *end = s + len;
+    const char *p = s;
+    const char *hit = max > 0 ? find_plain(p, len, old, old_len) : NULL;
+    if (hit == NULL) {
+        lua_settop(L, 1);
+        lua_pushinteger(L, 0);
+        return 2;
+    }
+    lua_Integer count = 0;
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    while (hit != NULL) {
+        luaL_addlstring(&b, p, (size_t)(hit - p));
+        luaL_addlstring(&b, repl, new_len);
+        p = hit + old_len;
+        hit = ++count < max ? find_plain(p, (size_t)(end - p), old, old_len) : NULL;
+    }
+    luaL_addlstring(&b, p, (size_t)(end - p));
+    charge_bytes(L, luaL_bufflen(&b));
+    luaL_pushresult(&b);
+    lua_pushinteger(L, count);
+    return 2;
+}
+
+static int string_join(lua_State *L) {
+    // string.join(sep, list) -> the items of list converted with tostring
+    // and separated by sep; unlike table.concat, items need not be strings
+    size_t sep_len;
+    const char *sep = luaL_checklstring(L, 1, &sep_len);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_Integer n = luaL_len(L, 2);
+    charge_instructions(L, (unsigned long long)(n > 0 ? n : 0));
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    for (lua_Integer i = 1; i <= n; i++) {
+        if (i > 1) {
+            luaL_addlstring(&b, sep, sep_len);
+        }
+        lua_geti(L, 2, i);
+        luaL_tolstring(L, -1, NULL);
+        lua_remove(L, -2);
+        luaL_addvalue(&b);
+    }
+    charge_bytes(L, luaL_bufflen(&b));
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static void open_string_extras(lua_State *L) {
+    static const luaL_Reg extras[] = {
+        {"split", string_split}, {"trim", string_trim}, {"startswith", string_startswith},
+        {"endswith", string_endswith}, {"replace", string_replace}, {"join", string_join},
+        {NULL, NULL}
+    };
+    lua_getglobal(L, "string");
+    luaL_setfuncs(L, extras, 0);
+    lua_pop(L, 1);
+}
+
 // Generic C-side wrapper for Python upvalue callbacks
 static int lua_callback_generic(lua_State *L) {
     // Upvalue 1 is the Python callable (wrapped in a capsule or just managed via invalid pointer logic?
@@ -201,13 +2406,26 @@ static int lua_callback_generic(lua_State *L) {
     return 1;
 }
 
+static int globals_newindex(lua_State *L) {
+    // _G.__newindex: stores the new global, noting it if it is a function
+    if (lua_isfunction(L, 3)) {
+        ((LuaVM *)lua_touserdata(L, lua_upvalueindex(1)))->globals_added = 1;
+    }
+    lua_settop(L, 3);
+    lua_rawset(L, 1);
+    return 0;
+}
+
 static int LuaVM_init(LuaVM *self, PyObject *args, PyObject *kwds) {
     unsigned long long max_mem = DEFAULT_MAX_MEMORY;
     unsigned long long instr_limit = 0;
     PyObject *callbacks_dict = NULL;
-    static char *kwlist[] = {"memory_limit", "callbacks", "instruction_limit", NULL};
+    int safe_load = 0;
+    int readonly_libs = 0;
+    static char *kwlist[] = {"memory_limit", "callbacks", "instruction_limit", "safe_load", "readonly_libs", NULL};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|KOK", kwlist, &max_mem, &callbacks_dict, &instr_limit)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|KOKpp", kwlist, &max_mem, &callbacks_dict, &instr_limit,
+                                     &safe_load, &readonly_libs)) {
         return -1;
     }
 
@@ -215,6 +2433,10 @@ static int LuaVM_init(LuaVM *self, PyObject *args, PyObject *kwds) {
     self->mc.max_memory = (size_t)max_mem;
     self->mc.instruction_limit = instr_limit;
     self->mc.instruction_count = 0;
+    self->mc.deadline = 0;
+    self->mc.hook_period = DEFAULT_HOOK_PERIOD;
+    self->mc.counting = 0;
+    self->mc.profile = NULL;
     
     self->L = lua_newstate(l_alloc, &self->mc);
 
@@ -224,6 +2446,7 @@ static int LuaVM_init(LuaVM *self, PyObject *args, PyObject *kwds) {
     }
     
     self->callbacks = NULL;
+    self->channels = NULL;
     if (callbacks_dict && PyDict_Check(callbacks_dict)) {
         self->callbacks = callbacks_dict;
         Py_INCREF(self->callbacks);
@@ -353,6 +2576,7 @@ static int LuaVM_init(LuaVM *self, PyObject *args, PyObject *kwds) {
         "match", "rep", "reverse", "sub", "upper", NULL
     };
     load_lib_filtered(L, "string", luaopen_string, string_whitelist);
+    open_string_extras(L);
     
     const char *math_whitelist[] = {
         "abs", "acos", "asin", "atan", "ceil", "cos", "deg", "exp", "floor", 
@@ -401,6 +2625,28 @@ static int LuaVM_init(LuaVM *self, PyObject *args, PyObject *kwds) {
          lua_pop(L, 1); // pop string
     }
     
+    open_template_lib(L);
+    open_collections_lib(L);
+    open_codec_lib(L);
+
+    // With readonly_libs, the standard library tables are served read-only
+    // so no script can swap a function another one keeps in a local (the
+    // optimizer's hoisting). The string metatable keeps the table itself.
+    const char *shared_libs[] = {"string", "math", "table", "utf8", NULL};
+    for (int i = 0; readonly_libs && shared_libs[i] != NULL; i++) {
+        lua_getglobal(L, shared_libs[i]);
+        make_readonly(L);
+        lua_setglobal(L, shared_libs[i]);
+    }
+
+    // Text-only load() confined to an explicit environment
+    if (safe_load) {
+        lua_newtable(L);
+        lua_pushinteger(L, 0);
+        lua_pushcclosure(L, sandbox_load, 2);
+        lua_setglobal(L, "load");
+    }
+
     // Register callbacks from dict
     if (self->callbacks) {
         PyObject *key, *value;
@@ -416,141 +2662,779 @@ static int LuaVM_init(LuaVM *self, PyObject *args, PyObject *kwds) {
         }
     }
 
-    return 0;
+    // Watch _G for functions stored under new names (scripts have no
+    // rawset or setmetatable to get around it)
+    self->functions = NULL;
+    self->globals_added = 1;
+    lua_pushglobaltable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushlightuserdata(L, self);
+    lua_pushcclosure(L, globals_newindex, 1);
+    lua_setfield(L, -2, "__newindex");
+    lua_setmetatable(L, -2);
+    lua_pop(L, 1);
+
+    return 0;
+}
+
+
+
+static PyObject *LuaVM_call(LuaVM *self, PyObject *args) {
+    if (self->L == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Lua VM is closed");
+        return NULL;
+    }
+
+    if (PyTuple_Size(args) < 1) {
+        PyErr_SetString(PyExc_TypeError, "call expects at least function name");
+        return NULL;
+    }
+
+    PyObject *name_obj = PyTuple_GetItem(args, 0);
+    if (!PyUnicode_Check(name_obj)) {
+        PyErr_SetString(PyExc_TypeError, "function name must be a string");
+        return NULL;
+    }
+    const char *func_name = PyUnicode_AsUTF8(name_obj);
+
+    lua_getglobal(self->L, func_name);
+    if (!lua_isfunction(self->L, -1)) {
+        lua_pop(self->L, 1);
+        PyErr_Format(PyExc_RuntimeError, "Global '%s' is not a function", func_name);
+        return NULL;
+    }
+
+    int nargs = (int)PyTuple_Size(args) - 1;
+    for (int i = 0; i < nargs; i++) {
+        PyObject *arg = PyTuple_GetItem(args, i + 1);
+        if (convert_python_to_lua(self->L, arg) < 0) {
+            PyErr_Format(PyExc_TypeError, "Unsupported argument type at index %d", i);
+            // Clean up stack? lua_close/pcall handles it mostly but we should proper clean
+            // Actually simpler to just verify args first?
+            // For now just error out.
+            return NULL;
+        }
+    }
+
+    // Reset instruction count and arm hooks
+    begin_execution(self);
+
+    // Call with nargs arguments and 1 return value (supported for now)
+    int status = lua_pcall(self->L, nargs, 1, 0);
+    
+    // Disable hook after call
+    end_execution(self);
+    
+    if (status != LUA_OK) {
+        const char *error_msg = lua_tostring(self->L, -1);
+        if (strcmp(error_msg, "Instruction limit exceeded") == 0) {
+             PyErr_SetString(PyExc_TimeoutError, "Instruction limit exceeded");
+        } else if (strcmp(error_msg, "Deadline exceeded") == 0) {
+             PyErr_SetString(PyExc_TimeoutError, "Deadline exceeded");
+        } else {
+             PyErr_Format(PyExc_RuntimeError, "Lua error: %s", error_msg);
+        }
+        lua_pop(self->L, 1);
+        return NULL;
+    }
+
+    PyObject *ret = convert_lua_to_python(self->L, -1);
+    lua_pop(self->L, 1);
+    return ret;
+}
+
+static PyObject *LuaVM_call_batch(LuaVM *self, PyObject *args) {
+    // Calls one global function once per argument tuple, back to back.
+    // Returns a list of (True, result) or (False, error message) pairs. The
+    // instruction limit applies to each call; a deadline or a cancellation
+    // aborts the whole batch.
+    const char *func_name;
+    PyObject *arg_lists;
+    if (!PyArg_ParseTuple(args, "sO", &func_name, &arg_lists)) {
+        return NULL;
+    }
+    if (self->L == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Lua VM is closed");
+        return NULL;
+    }
+    PyObject *calls = PySequence_Fast(arg_lists, "call_batch expects a sequence of argument tuples");
+    if (calls == NULL) {
+        return NULL;
+    }
+
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(calls);
+    PyObject *results = PyList_New(n);
+    int top = lua_gettop(self->L);
+    for (Py_ssize_t i = 0; results != NULL && i < n; i++) {
+        PyObject *call_args = PySequence_Fast(PySequence_Fast_GET_ITEM(calls, i), "call arguments must be a sequence");
+        if (call_args == NULL) {
+            Py_CLEAR(results);
+            break;
+        }
+        PyObject *outcome = NULL;
+        int nargs = (int)PySequence_Fast_GET_SIZE(call_args);
+        lua_getglobal(self->L, func_name);
+        if (!lua_isfunction(self->L, -1)) {
+            PyObject *message = PyUnicode_FromFormat("Global '%s' is not a function", func_name);
+            outcome = message ? Py_BuildValue("(ON)", Py_False, message) : NULL;
+        } else if (!lua_checkstack(self->L, nargs)) {
+            outcome = Py_BuildValue("(Os)", Py_False, "Too many arguments");
+        } else {
+            int bad = -1;
+            for (int j = 0; j < nargs && bad < 0; j++) {
+                if (convert_python_to_lua(self->L, PySequence_Fast_GET_ITEM(call_args, j)) < 0) {
+                    bad = j;
+                }
+            }
+            if (bad >= 0) {
+                PyObject *message = PyUnicode_FromFormat("Unsupported argument type at index %d", bad);
+                outcome = message ? Py_BuildValue("(ON)", Py_False, message) : NULL;
+            } else {
+                begin_execution(self);
+                int status = lua_pcall(self->L, nargs, 1, 0);
+                end_execution(self);
+                if (status == LUA_OK) {
+                    PyObject *value = convert_lua_to_python(self->L, -1);
+                    outcome = value ? Py_BuildValue("(ON)", Py_True, value) : NULL;
+                } else {
+                    const char *error_msg = lua_tostring(self->L, -1);
+                    if (error_msg == NULL) {
+                        error_msg = "(error object is not a string)";
+                    }
+                    if (strcmp(error_msg, "Deadline exceeded") == 0) {
+                        PyErr_SetString(PyExc_TimeoutError, "Deadline exceeded");
+                    } else if (strstr(error_msg, "Execution cancelled") != NULL) {
+                        PyErr_Format(PyExc_RuntimeError, "Lua error: %s", error_msg);
+                    } else if (strcmp(error_msg, "Instruction limit exceeded") == 0) {
+                        outcome = Py_BuildValue("(Os)", Py_False, error_msg);
+                    } else {
+                        PyObject *message = PyUnicode_FromFormat("Lua error: %s", error_msg);
+                        outcome = message ? Py_BuildValue("(ON)", Py_False, message) : NULL;
+                    }
+                }
+            }
+        }
+        lua_settop(self->L, top);
+        Py_DECREF(call_args);
+        if (outcome == NULL) {
+            Py_CLEAR(results);
+            break;
+        }
+        PyList_SET_ITEM(results, i, outcome);
+    }
+    Py_DECREF(calls);
+    return results;
+}
+
+static int pipeline_protected(lua_State *L) {
+    // Stack: stage names (userdata), arguments. Calls each stage on all the
+    // results of the previous one; values stay on the Lua stack throughout.
+    PyObject *stages = (PyObject *)lua_touserdata(L, 1);
+    lua_remove(L, 1);
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(stages);
+    for (Py_ssize_t i = 0; i < n; i++) {
+        const char *name = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(stages, i)); // Checked beforehand
+        if (lua_getglobal(L, name) != LUA_TFUNCTION) {
+            return luaL_error(L, "Global '%s' is not a function", name);
+        }
+        lua_insert(L, 1);
+        lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+    }
+    lua_settop(L, 1); // The first result of the last stage, or nil
+    return 1;
+}
+
+static PyObject *pipeline_stages(PyObject *stages_obj) {
+    // Returns the stage names as a fast sequence of str
+    PyObject *stages = PySequence_Fast(stages_obj, "stages must be a sequence of function names");
+    if (stages == NULL) {
+        return NULL;
+    }
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(stages);
+    if (n == 0) {
+        PyErr_SetString(PyExc_ValueError, "pipeline needs at least one stage");
+        Py_DECREF(stages);
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject *name = PySequence_Fast_GET_ITEM(stages, i);
+        if (!PyUnicode_Check(name) || PyUnicode_AsUTF8(name) == NULL) {
+            PyErr_Clear();
+            PyErr_SetString(PyExc_TypeError, "stage names must be strings");
+            Py_DECREF(stages);
+            return NULL;
+        }
+    }
+    return stages;
+}
+
+static int run_pipeline(LuaVM *self, PyObject *stages, PyObject *call_args, int *bad) {
+    // Runs the stages on call_args (a fast sequence) with one budget for the
+    // whole pipeline. Leaves the result or the error message on the stack and
+    // returns the lua_pcall status; *bad is the index of an unsupported
+    // argument, with nothing pushed.
+    int nargs = (int)PySequence_Fast_GET_SIZE(call_args);
+    if (!lua_checkstack(self->L, nargs + 2)) {
+        lua_pushstring(self->L, "Too many arguments");
+        return LUA_ERRRUN;
+    }
+    int top = lua_gettop(self->L);
+    lua_pushcfunction(self->L, pipeline_protected);
+    lua_pushlightuserdata(self->L, stages);
+    for (int i = 0; i < nargs; i++) {
+        if (convert_python_to_lua(self->L, PySequence_Fast_GET_ITEM(call_args, i)) < 0) {
+            lua_settop(self->L, top);
+            *bad = i;
+            return LUA_OK;
+        }
+    }
+    begin_execution(self);
+    int status = lua_pcall(self->L, nargs + 1, 1, 0);
+    end_execution(self);
+    return status;
+}
+
+static PyObject *LuaVM_pipeline(LuaVM *self, PyObject *args) {
+    // pipeline(stages, *args): calls stages[0](*args), then each next stage
+    // on every value the previous one returned, inside one execution. The
+    // instruction limit and deadline cover the pipeline as a whole.
+    if (self->L == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Lua VM is closed");
+        return NULL;
+    }
+    if (PyTuple_Size(args) < 1) {
+        PyErr_SetString(PyExc_TypeError, "pipeline expects a sequence of stages");
+        return NULL;
+    }
+    PyObject *stages = pipeline_stages(PyTuple_GET_ITEM(args, 0));
+    if (stages == NULL) {
+        return NULL;
+    }
+    PyObject *call_args = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+    if (call_args == NULL) {
+        Py_DECREF(stages);
+        return NULL;
+    }
+
+    int top = lua_gettop(self->L);
+    int bad = -1;
+    int status = run_pipeline(self, stages, call_args, &bad);
+    Py_DECREF(call_args);
+    Py_DECREF(stages);
+    if (bad >= 0) {
+        PyErr_Format(PyExc_TypeError, "Unsupported argument type at index %d", bad);
+        return NULL;
+    }
+    if (status != LUA_OK) {
+        const char *error_msg = lua_tostring(self->L, -1);
+        if (error_msg == NULL) {
+            error_msg = "(error object is not a string)";
+        }
+        if (strcmp(error_msg, "Instruction limit exceeded") == 0) {
+             PyErr_SetString(PyExc_TimeoutError, "Instruction limit exceeded");
+        } else if (strcmp(error_msg, "Deadline exceeded") == 0) {
+             PyErr_SetString(PyExc_TimeoutError, "Deadline exceeded");
+        } else {
+             PyErr_Format(PyExc_RuntimeError, "Lua error: %s", error_msg);
+        }
+        lua_settop(self->L, top);
+        return NULL;
+    }
+
+    PyObject *ret = convert_lua_to_python(self->L, -1);
+    lua_settop(self->L, top);
+    return ret;
+}
+
+static PyObject *LuaVM_pipeline_batch(LuaVM *self, PyObject *args) {
+    // Runs the pipeline once per argument tuple, like call_batch: a list of
+    // (True, result) or (False, error message) pairs. Each run has its own
+    // instruction budget; a deadline or a cancellation aborts the batch.
+    PyObject *stages_obj, *arg_lists;
+    if (!PyArg_ParseTuple(args, "OO", &stages_obj, &arg_lists)) {
+        return NULL;
+    }
+    if (self->L == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Lua VM is closed");
+        return NULL;
+    }
+    PyObject *stages = pipeline_stages(stages_obj);
+    if (stages == NULL) {
+        return NULL;
+    }
+    PyObject *runs = PySequence_Fast(arg_lists, "pipeline_batch expects a sequence of argument tuples");
+    if (runs == NULL) {
+        Py_DECREF(stages);
+        return NULL;
+    }
+
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(runs);
+    PyObject *results = PyList_New(n);
+    int top = lua_gettop(self->L);
+    for (Py_ssize_t i = 0; results != NULL && i < n; i++) {
+        PyObject *call_args = PySequence_Fast(PySequence_Fast_GET_ITEM(runs, i), "pipeline arguments must be a sequence");
+        if (call_args == NULL) {
+            Py_CLEAR(results);
+            break;
+        }
+        PyObject *outcome = NULL;
+        int bad = -1;
+        int status = run_pipeline(self, stages, call_args, &bad);
+        if (bad >= 0) {
+            PyObject *message = PyUnicode_FromFormat("Unsupported argument type at index %d", bad);
+            outcome = message ? Py_BuildValue("(ON)", Py_False, message) : NULL;
+        } else if (status == LUA_OK) {
+            PyObject *value = convert_lua_to_python(self->L, -1);
+            outcome = value ? Py_BuildValue("(ON)", Py_True, value) : NULL;
+        } else {
+            const char *error_msg = lua_tostring(self->L, -1);
+            if (error_msg == NULL) {
+                error_msg = "(error object is not a string)";
+            }
+            if (strcmp(error_msg, "Deadline exceeded") == 0) {
+                PyErr_SetString(PyExc_TimeoutError, "Deadline exceeded");
+            } else if (strstr(error_msg, "Execution cancelled") != NULL) {
+                PyErr_Format(PyExc_RuntimeError, "Lua error: %s", error_msg);
+            } else if (strcmp(error_msg, "Instruction limit exceeded") == 0) {
+                outcome = Py_BuildValue("(Os)", Py_False, error_msg);
+            } else {
+                PyObject *message = PyUnicode_FromFormat("Lua error: %s", error_msg);
+                outcome = message ? Py_BuildValue("(ON)", Py_False, message) : NULL;
+            }
+        }
+        lua_settop(self->L, top);
+        Py_DECREF(call_args);
+        if (outcome == NULL) {
+            Py_CLEAR(results);
+            break;
+        }
+        PyList_SET_ITEM(results, i, outcome);
+    }
+    Py_DECREF(runs);
+    Py_DECREF(stages);
+    return results;
+}
+
+static PyObject *LuaVM_execute(LuaVM *self, PyObject *args) {
+    const char *script;
+    if (!PyArg_ParseTuple(args, "s", &script)) {
+        return NULL;
+    }
+    
+    if (self->L == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Lua VM is closed");
+        return NULL;
+    }
+
+    // Reset instruction count and arm hooks
+    begin_execution(self);
+
+    int status = luaL_dostring(self->L, script);
+    
+    // Disable hook after execution
+    end_execution(self);
+
+    if (status != LUA_OK) {
+        const char *error_msg = lua_tostring(self->L, -1);
+        if (strcmp(error_msg, "Instruction limit exceeded") == 0) {
+             PyErr_SetString(PyExc_TimeoutError, "Instruction limit exceeded");
+        } else if (strcmp(error_msg, "Deadline exceeded") == 0) {
+             PyErr_SetString(PyExc_TimeoutError, "Deadline exceeded");
+        } else {
+             PyErr_Format(PyExc_RuntimeError, "Lua error: %s", error_msg);
+        }
+        lua_pop(self->L, 1); // Pop error message
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *LuaVM_function_exists(LuaVM *self, PyObject *args) {
+    const char *func_name;
+    if (!PyArg_ParseTuple(args, "s", &func_name)) {
+        return NULL;
+    }
+
+    if (self->L == NULL) {
+        Py_RETURN_FALSE;
+    }
+
+    lua_getglobal(self->L, func_name);
+    int is_func = lua_isfunction(self->L, -1);
+    lua_pop(self->L, 1);
+
+    if (is_func) {
+        Py_RETURN_TRUE;
+    } else {
+        Py_RETURN_FALSE;
+    }
+}
+
+static int functions_still_bound(LuaVM *self) {
+    // Whether every name of the last summary is still bound to a function.
+    // With no function stored under a new name meanwhile, the summary then
+    // still holds, except for an existing global changed into a function,
+    // which is why the parent only trusts the mirror's positive answers.
+    PyObject *iter = PyObject_GetIter(self->functions);
+    if (iter == NULL) {
+        PyErr_Clear();
+        return 0;
+    }
+    int bound = 1;
+    PyObject *name;
+    lua_pushglobaltable(self->L);
+    while (bound && (name = PyIter_Next(iter)) != NULL) {
+        Py_ssize_t len;
+        const char *key = PyUnicode_AsUTF8AndSize(name, &len);
+        if (key == NULL) {
+            PyErr_Clear();
+            bound = 0;
+        } else {
+            lua_pushlstring(self->L, key, (size_t)len);
+            bound = lua_rawget(self->L, -2) == LUA_TFUNCTION;
+            lua_pop(self->L, 1);
+        }
+        Py_DECREF(name);
+    }
+    lua_pop(self->L, 1);
+    Py_DECREF(iter);
+    return bound;
+}
+
+static PyObject *LuaVM_global_functions(LuaVM *self, PyObject *Py_UNUSED(ignored)) {
+    // Names of the globals currently bound to functions, as a frozenset.
+    // Raw traversal of _G: no metamethod runs, so this is safe between
+    // requests. The walk is skipped, and the previous set returned, unless a
+    // function was stored under a new name or a listed name lost its function.
+    if (self->L == NULL) {
+        return PyFrozenSet_New(NULL);
+    }
+    if (self->functions != NULL && !self->globals_added && functions_still_bound(self)) {
+        Py_INCREF(self->functions);
+        return self->functions;
+    }
+    PyObject *names = PySet_New(NULL);
+    if (names == NULL) {
+        return NULL;
+    }
+
+    lua_pushglobaltable(self->L);
+    lua_pushnil(self->L);
+    while (lua_next(self->L, -2) != 0) {
+        if (lua_type(self->L, -2) == LUA_TSTRING && lua_isfunction(self->L, -1)) {
+            size_t len;
+            const char *key = lua_tolstring(self->L, -2, &len);
+            PyObject *name = PyUnicode_DecodeUTF8(key, len, "replace");
+            if (name == NULL || PySet_Add(names, name) < 0) {
+                Py_XDECREF(name);
+                Py_DECREF(names);
+                lua_pop(self->L, 3);
+                return NULL;
+            }
+            Py_DECREF(name);
+        }
+        lua_pop(self->L, 1);
+    }
+    lua_pop(self->L, 1);
+
+    PyObject *result = PyFrozenSet_New(names);
+    Py_DECREF(names);
+    if (result != NULL) {
+        Py_INCREF(result);
+        Py_XSETREF(self->functions, result);
+        self->globals_added = 0;
+    }
+    return result;
+}
+
+static PyObject *LuaVM_stats(LuaVM *self, PyObject *Py_UNUSED(ignored)) {
+    // Resource report of the last (or current) execution
+    return Py_BuildValue("{s:n,s:n,s:n,s:K,s:K}",
+                         "memory_used", (Py_ssize_t)self->mc.total_allocated,
+                         "memory_peak", (Py_ssize_t)self->mc.peak_allocated,
+                         "memory_limit", (Py_ssize_t)self->mc.max_memory,
+                         "instructions", self->mc.instruction_count,
+                         "instruction_limit", self->mc.instruction_limit);
+}
+
+static PyObject *LuaVM_set_deadline(LuaVM *self, PyObject *args) {
+    // Absolute time.monotonic() value after which executions fail, or None.
+    // Checked with the instruction count, so it also stops runaway loops when
+    // the VM runs in the caller's process and no signal can interrupt it.
+    PyObject *deadline;
+    if (!PyArg_ParseTuple(args, "O", &deadline)) {
+        return NULL;
+    }
+    if (deadline == Py_None) {
+        self->mc.deadline = 0;
+        Py_RETURN_NONE;
+    }
+    double value = PyFloat_AsDouble(deadline);
+    if (value == -1.0 && PyErr_Occurred()) {
+        return NULL;
+    }
+    self->mc.deadline = value > 0 ? value : 1e-9;
+    Py_RETURN_NONE;
+}
+
+static PyObject *load_globals(LuaVM *self, GlobalsLoad *load) {
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    if (self->L == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Lua VM is closed");
+        return NULL;
+    }
+    if (!PyDict_Check(load->values)) {
+        PyErr_SetString(PyExc_TypeError, "Expected a dict");
+        return NULL;
+    }
+    while (PyDict_Next(load->values, &pos, &key, &value)) {
+        if (!PyUnicode_Check(key) || PyUnicode_AsUTF8(key) == NULL) {
+            PyErr_Clear();
+            PyErr_SetString(PyExc_TypeError, "Global names must be strings");
+            return NULL;
+        }
+    }
+
+    int top = lua_gettop(self->L);
+    lua_pushcfunction(self->L, load_globals_protected);
+    lua_pushlightuserdata(self->L, load);
+    int status = lua_pcall(self->L, 1, 0, 0);
+    if (status != LUA_OK) {
+        if (load->bad_type != NULL) {
+            PyErr_Format(PyExc_TypeError, "Unsupported value type '%s'", load->bad_type);
+        } else if (!PyErr_Occurred()) {
+            PyErr_Format(PyExc_RuntimeError, "Lua error: %s", lua_tostring(self->L, -1));
+        }
+        lua_settop(self->L, top);
+        return NULL;
+    }
+    if (PyErr_Occurred()) {
+        return NULL; // Integer overflow or unencodable string
+    }
+    Py_RETURN_NONE;
 }
 
+static int pin_protected(lua_State *L) {
+    GlobalsLoad *load = (GlobalsLoad *)lua_touserdata(L, 1);
+    push_python_value(L, load->values, 0, load);
+    lua_pushinteger(L, luaL_ref(L, LUA_REGISTRYINDEX));
+    return 1;
+}
 
-
-static PyObject *LuaVM_call(LuaVM *self, PyObject *args) {
+static PyObject *LuaVM_pin(LuaVM *self, PyObject *args) {
+    // Converts a value (tables included) once and returns a PinnedValue
+    // that call() pushes from the registry without converting again. Tables
+    // are read-only: every call shares them, so one call must not be able
+    // to change what the next receives.
+    GlobalsLoad load = {NULL, NULL, 1, NULL};
+    if (!PyArg_ParseTuple(args, "O", &load.values)) {
+        return NULL;
+    }
     if (self->L == NULL) {
         PyErr_SetString(PyExc_RuntimeError, "Lua VM is closed");
         return NULL;
     }
 
-    if (PyTuple_Size(args) < 1) {
-        PyErr_SetString(PyExc_TypeError, "call expects at least function name");
+    int top = lua_gettop(self->L);
+    lua_pushcfunction(self->L, pin_protected);
+    lua_pushlightuserdata(self->L, &load);
+    if (lua_pcall(self->L, 1, 1, 0) != LUA_OK) {
+        if (load.bad_type != NULL) {
+            PyErr_Format(PyExc_TypeError, "Unsupported value type '%s'", load.bad_type);
+        } else if (!PyErr_Occurred()) {
+            PyErr_Format(PyExc_RuntimeError, "Lua error: %s", lua_tostring(self->L, -1));
+        }
+        lua_settop(self->L, top);
+        return NULL;
+    }
+    int ref = (int)lua_tointeger(self->L, -1);
+    lua_settop(self->L, top);
+    if (PyErr_Occurred()) {
+        luaL_unref(self->L, LUA_REGISTRYINDEX, ref);
         return NULL;
     }
 
-    PyObject *name_obj = PyTuple_GetItem(args, 0);
-    if (!PyUnicode_Check(name_obj)) {
-        PyErr_SetString(PyExc_TypeError, "function name must be a string");
+    PinnedValue *pinned = PyObject_New(PinnedValue, &PinnedValueType);
+    if (pinned == NULL) {
+        luaL_unref(self->L, LUA_REGISTRYINDEX, ref);
         return NULL;
     }
-    const char *func_name = PyUnicode_AsUTF8(name_obj);
+    Py_INCREF(self);
+    pinned->vm = self;
+    pinned->ref = ref;
+    return (PyObject *)pinned;
+}
 
-    lua_getglobal(self->L, func_name);
-    if (!lua_isfunction(self->L, -1)) {
-        lua_pop(self->L, 1);
-        PyErr_Format(PyExc_RuntimeError, "Global '%s' is not a function", func_name);
+static PyObject *LuaVM_set_globals(LuaVM *self, PyObject *args) {
+    // Assigns every name -> value of a dict in one go; dicts, lists and
+    // tuples become tables
+    GlobalsLoad load = {NULL, NULL, 0, NULL};
+    if (!PyArg_ParseTuple(args, "O", &load.values)) {
         return NULL;
     }
+    return load_globals(self, &load);
+}
 
-    int nargs = (int)PyTuple_Size(args) - 1;
-    for (int i = 0; i < nargs; i++) {
-        PyObject *arg = PyTuple_GetItem(args, i + 1);
-        if (convert_python_to_lua(self->L, arg) < 0) {
-            PyErr_Format(PyExc_TypeError, "Unsupported argument type at index %d", i);
-            // Clean up stack? lua_close/pcall handles it mostly but we should proper clean
-            // Actually simpler to just verify args first?
-            // For now just error out.
+static PyObject *LuaVM_set_context(LuaVM *self, PyObject *args) {
+    // Installs a dict as one read-only table global (default "context"),
+    // built once and kept until replaced
+    GlobalsLoad load = {NULL, "context", 1, NULL};
+    if (!PyArg_ParseTuple(args, "O|s", &load.values, &load.name)) {
+        return NULL;
+    }
+    return load_globals(self, &load);
+}
+
+static PyObject *LuaVM_get_globals(LuaVM *self, PyObject *args) {
+    // Returns {name: value} for the given names; missing globals are None
+    PyObject *names_obj;
+    if (!PyArg_ParseTuple(args, "O", &names_obj)) {
+        return NULL;
+    }
+    if (self->L == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Lua VM is closed");
+        return NULL;
+    }
+    PyObject *names = PySequence_Fast(names_obj, "Expected a sequence of names");
+    if (names == NULL) {
+        return NULL;
+    }
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(names);
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject *name = PySequence_Fast_GET_ITEM(names, i);
+        if (!PyUnicode_Check(name) || PyUnicode_AsUTF8(name) == NULL) {
+            PyErr_Clear();
+            PyErr_SetString(PyExc_TypeError, "Global names must be strings");
+            Py_DECREF(names);
             return NULL;
         }
     }
 
-    // Reset instruction count
-    self->mc.instruction_count = 0;
-    if (self->mc.instruction_limit > 0) {
-        lua_sethook(self->L, instruction_count_hook, LUA_MASKCOUNT, 1000);
-    } else {
-        lua_sethook(self->L, NULL, 0, 0);
+    int top = lua_gettop(self->L);
+    lua_pushcfunction(self->L, fetch_globals_protected);
+    lua_pushlightuserdata(self->L, names);
+    if (lua_pcall(self->L, 1, LUA_MULTRET, 0) != LUA_OK) {
+        PyErr_Format(PyExc_RuntimeError, "Lua error: %s", lua_tostring(self->L, -1));
+        lua_settop(self->L, top);
+        Py_DECREF(names);
+        return NULL;
     }
 
-    // Call with nargs arguments and 1 return value (supported for now)
-    int status = lua_pcall(self->L, nargs, 1, 0);
-    
-    // Disable hook after call
-    lua_sethook(self->L, NULL, 0, 0);
-    
-    if (status != LUA_OK) {
-        const char *error_msg = lua_tostring(self->L, -1);
-        if (strcmp(error_msg, "Instruction limit exceeded") == 0) {
-             PyErr_SetString(PyExc_TimeoutError, "Instruction limit exceeded");
-        } else {
-             PyErr_Format(PyExc_RuntimeError, "Lua error: %s", error_msg);
+    PyObject *result = PyDict_New();
+    for (Py_ssize_t i = 0; result != NULL && i < n; i++) {
+        PyObject *value = lua_value_to_python(self->L, top + 1 + (int)i, 0);
+        if (value == NULL || PyDict_SetItem(result, PySequence_Fast_GET_ITEM(names, i), value) < 0) {
+            Py_CLEAR(result);
         }
-        lua_pop(self->L, 1);
-        return NULL;
+        Py_XDECREF(value);
     }
-
-    PyObject *ret = convert_lua_to_python(self->L, -1);
-    lua_pop(self->L, 1);
-    return ret;
+    lua_settop(self->L, top);
+    Py_DECREF(names);
+    return result;
 }
 
-static PyObject *LuaVM_execute(LuaVM *self, PyObject *args) {
-    const char *script;
-    if (!PyArg_ParseTuple(args, "s", &script)) {
+static PyObject *LuaVM_set_channels(LuaVM *self, PyObject *args) {
+    // Registers {name: channel} and the Lua `channel` table reaching them;
+    // replaces the channels of an earlier call
+    PyObject *channels;
+    if (!PyArg_ParseTuple(args, "O!", &PyDict_Type, &channels)) {
         return NULL;
     }
-    
     if (self->L == NULL) {
         PyErr_SetString(PyExc_RuntimeError, "Lua VM is closed");
         return NULL;
     }
+    Py_INCREF(channels);
+    Py_XSETREF(self->channels, channels);
 
-    // Reset instruction count
-    self->mc.instruction_count = 0;
-    if (self->mc.instruction_limit > 0) {
-        lua_sethook(self->L, instruction_count_hook, LUA_MASKCOUNT, 1000);
-    } else {
-        lua_sethook(self->L, NULL, 0, 0);
+    lua_State *L = self->L;
+    if (!lua_checkstack(L, 3)) {
+        PyErr_SetString(PyExc_MemoryError, "Lua stack exhausted");
+        return NULL;
     }
+    lua_createtable(L, 0, 2);
+    lua_pushlightuserdata(L, self); // The VM outlives its Lua state
+    lua_pushcclosure(L, lua_channel_send, 1);
+    lua_setfield(L, -2, "send");
+    lua_pushlightuserdata(L, self);
+    lua_pushcclosure(L, lua_channel_recv, 1);
+    lua_setfield(L, -2, "recv");
+    lua_setglobal(L, "channel");
+    Py_RETURN_NONE;
+}
 
-    int status = luaL_dostring(self->L, script);
-    
-    // Disable hook after execution
-    lua_sethook(self->L, NULL, 0, 0);
-
-    if (status != LUA_OK) {
-        const char *error_msg = lua_tostring(self->L, -1);
-        if (strcmp(error_msg, "Instruction limit exceeded") == 0) {
-             PyErr_SetString(PyExc_TimeoutError, "Instruction limit exceeded");
-        } else {
-             PyErr_Format(PyExc_RuntimeError, "Lua error: %s", error_msg);
-        }
-        lua_pop(self->L, 1); // Pop error message
+static PyObject *LuaVM_set_profiling(LuaVM *self, PyObject *args) {
+    // Samples the Lua stack every `interval` instructions of later
+    // executions; 0 stops profiling. Samples accumulate until take_profile().
+    int interval;
+    if (!PyArg_ParseTuple(args, "i", &interval)) {
         return NULL;
     }
-
+    if (interval < 0) {
+        PyErr_SetString(PyExc_ValueError, "interval must not be negative");
+        return NULL;
+    }
+    if (interval == 0) {
+        Py_CLEAR(self->mc.profile);
+        self->mc.hook_period = DEFAULT_HOOK_PERIOD;
+        Py_RETURN_NONE;
+    }
+    if (self->mc.profile == NULL) {
+        self->mc.profile = PyDict_New();
+        if (self->mc.profile == NULL) {
+            return NULL;
+        }
+    }
+    self->mc.hook_period = interval;
     Py_RETURN_NONE;
 }
 
-static PyObject *LuaVM_function_exists(LuaVM *self, PyObject *args) {
-    const char *func_name;
-    if (!PyArg_ParseTuple(args, "s", &func_name)) {
+static PyObject *LuaVM_set_counting(LuaVM *self, PyObject *args) {
+    // Arms the count hook for every later execution so stats() reports
+    // instructions even when nothing else needs the hook
+    int counting;
+    if (!PyArg_ParseTuple(args, "p", &counting)) {
         return NULL;
     }
+    self->mc.counting = counting;
+    Py_RETURN_NONE;
+}
 
-    if (self->L == NULL) {
-        Py_RETURN_FALSE;
+static PyObject *LuaVM_take_profile(LuaVM *self, PyObject *Py_UNUSED(ignored)) {
+    // Returns {folded stack: samples} collected so far and starts afresh,
+    // or None when not profiling
+    if (self->mc.profile == NULL) {
+        Py_RETURN_NONE;
     }
-
-    lua_getglobal(self->L, func_name);
-    int is_func = lua_isfunction(self->L, -1);
-    lua_pop(self->L, 1);
-
-    if (is_func) {
-        Py_RETURN_TRUE;
-    } else {
-        Py_RETURN_FALSE;
+    PyObject *fresh = PyDict_New();
+    if (fresh == NULL) {
+        return NULL;
     }
+    PyObject *profile = self->mc.profile;
+    self->mc.profile = fresh;
+    return profile;
 }
 
 static PyMethodDef LuaVM_methods[] = {
     {"execute", (PyCFunction)LuaVM_execute, METH_VARARGS, "Execute a Lua script"},
     {"call", (PyCFunction)LuaVM_call, METH_VARARGS, "Call a global Lua function"},
+    {"call_batch", (PyCFunction)LuaVM_call_batch, METH_VARARGS, "Call a global Lua function once per argument tuple"},
+    {"pipeline", (PyCFunction)LuaVM_pipeline, METH_VARARGS, "Call Lua functions in turn, each on the results of the previous one"},
+    {"pipeline_batch", (PyCFunction)LuaVM_pipeline_batch, METH_VARARGS, "Run a pipeline once per argument tuple"},
     {"function_exists", (PyCFunction)LuaVM_function_exists, METH_VARARGS, "Check if a global Lua function exists"},
+    {"set_globals", (PyCFunction)LuaVM_set_globals, METH_VARARGS, "Set several globals from a dict"},
+    {"get_globals", (PyCFunction)LuaVM_get_globals, METH_VARARGS, "Return several globals as a dict"},
+    {"set_context", (PyCFunction)LuaVM_set_context, METH_VARARGS, "Install a dict as a read-only global table"},
+    {"pin", (PyCFunction)LuaVM_pin, METH_VARARGS, "Convert a value once for use as a call() argument"},
+    {"global_functions", (PyCFunction)LuaVM_global_functions, METH_NOARGS, "Return the names of global functions"},
+    {"stats", (PyCFunction)LuaVM_stats, METH_NOARGS, "Return memory and instruction usage of the last execution"},
+    {"set_deadline", (PyCFunction)LuaVM_set_deadline, METH_VARARGS, "Set the monotonic time after which executions fail"},
+    {"set_channels", (PyCFunction)LuaVM_set_channels, METH_VARARGS, "Register channels reachable from Lua as channel.send/recv"},
+    {"set_profiling", (PyCFunction)LuaVM_set_profiling, METH_VARARGS, "Sample the Lua stack every N instructions (0 to stop)"},
+    {"set_counting", (PyCFunction)LuaVM_set_counting, METH_VARARGS, "Count instructions of later executions even without a limit"},
+    {"take_profile", (PyCFunction)LuaVM_take_profile, METH_NOARGS, "Return and reset the stack samples collected"},
     {NULL}
 };
 
@@ -567,6 +3451,25 @@ static PyTypeObject LuaVMType = {
     .tp_methods = LuaVM_methods,
 };
 
+static void PinnedValue_dealloc(PinnedValue *self) {
+    // Frees the registry slot; the VM outlives its pinned values
+    if (self->vm->L != NULL) {
+        luaL_unref(self->vm->L, LUA_REGISTRYINDEX, self->ref);
+    }
+    Py_DECREF(self->vm);
+    PyObject_Free(self);
+}
+
+static PyTypeObject PinnedValueType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_luaward.PinnedValue",
+    .tp_doc = "Value held in a LuaVM's registry, usable as a call() argument",
+    .tp_basicsize = sizeof(PinnedValue),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)PinnedValue_dealloc,
+};
+
 static int install_seccomp(void) {
     struct sock_filter filter[] = {
         /* Validate architecture to be x86_64 */
@@ -645,8 +3548,250 @@ static PyObject *luaward_lockdown(PyObject *self, PyObject *args) {
     Py_RETURN_NONE;
 }
 
+static PyObject *luaward_install_cancel_handler(PyObject *self, PyObject *args) {
+    int signum;
+    if (!PyArg_ParseTuple(args, "i", &signum)) {
+        return NULL;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = cancel_signal_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(signum, &sa, NULL) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static int request_signal_value(unsigned long long request_id) {
+    // Request IDs grow without bound; the signal carries them wrapped to an int
+    return (int)(unsigned int)request_id;
+}
+
+static PyObject *luaward_set_request_id(PyObject *self, PyObject *args) {
+    unsigned long long request_id;
+    if (!PyArg_ParseTuple(args, "K", &request_id)) {
+        return NULL;
+    }
+    running_request = request_signal_value(request_id);
+    cancel_requested = 0;
+    Py_RETURN_NONE;
+}
+
+static PyObject *luaward_cancel(PyObject *self, PyObject *args) {
+    int pid, signum;
+    unsigned long long request_id;
+    if (!PyArg_ParseTuple(args, "iiK", &pid, &signum, &request_id)) {
+        return NULL;
+    }
+    union sigval value;
+    value.sival_int = request_signal_value(request_id);
+    if (sigqueue(pid, signum, value) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *luaward_pidfd_open(PyObject *self, PyObject *args) {
+    int pid;
+    if (!PyArg_ParseTuple(args, "i", &pid)) {
+        return NULL;
+    }
+    // The kernel sets close-on-exec on pidfds; the fd becomes readable when the process exits
+    int fd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (fd < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+    return PyLong_FromLong(fd);
+}
+
+// Reactor core: an epoll set mapping file descriptors to caller-chosen tokens.
+// poll() waits without holding the GIL so the other Python threads keep running.
+typedef struct {
+    PyObject_HEAD
+    int epfd;
+} Poller;
+
+static PyObject *Poller_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    Poller *self = (Poller *)type->tp_alloc(type, 0);
+    if (self) {
+        self->epfd = -1;
+    }
+    return (PyObject *)self;
+}
+
+static int Poller_init(Poller *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist)) {
+        return -1;
+    }
+    if (self->epfd >= 0) {
+        close(self->epfd);
+    }
+    self->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (self->epfd < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    return 0;
+}
+
+static void Poller_dealloc(Poller *self) {
+    if (self->epfd >= 0) {
+        close(self->epfd);
+    }
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int Poller_check_open(Poller *self) {
+    if (self->epfd < 0) {
+        PyErr_SetString(PyExc_ValueError, "Poller is closed");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *Poller_register(Poller *self, PyObject *args) {
+    int fd;
+    unsigned long long token;
+    unsigned int events = EPOLLIN;
+    if (!PyArg_ParseTuple(args, "iK|I", &fd, &token, &events)) {
+        return NULL;
+    }
+    if (Poller_check_open(self) < 0) {
+        return NULL;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = token;
+    if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *Poller_unregister(Poller *self, PyObject *args) {
+    int fd;
+    if (!PyArg_ParseTuple(args, "i", &fd)) {
+        return NULL;
+    }
+    if (Poller_check_open(self) < 0) {
+        return NULL;
+    }
+    if (epoll_ctl(self->epfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *Poller_poll(Poller *self, PyObject *args) {
+    PyObject *timeout_obj = Py_None;
+    if (!PyArg_ParseTuple(args, "|O", &timeout_obj)) {
+        return NULL;
+    }
+    if (Poller_check_open(self) < 0) {
+        return NULL;
+    }
+
+    // Timeout in seconds (None blocks), rounded up so we never spin
+    int timeout_ms = -1;
+    if (timeout_obj != Py_None) {
+        double timeout = PyFloat_AsDouble(timeout_obj);
+        if (timeout == -1.0 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (timeout < 0) {
+            timeout_ms = 0;
+        } else if (timeout * 1000.0 >= (double)INT_MAX) {
+            timeout_ms = INT_MAX;
+        } else {
+            timeout_ms = (int)(timeout * 1000.0 + 0.999);
+        }
+    }
+
+    struct epoll_event events[POLLER_MAX_EVENTS];
+    int n;
+    Py_BEGIN_ALLOW_THREADS
+    n = epoll_wait(self->epfd, events, POLLER_MAX_EVENTS, timeout_ms);
+    Py_END_ALLOW_THREADS
+
+    if (n < 0) {
+        if (errno == EINTR) {
+            if (PyErr_CheckSignals() < 0) {
+                return NULL;
+            }
+            return PyList_New(0);
+        }
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+
+    PyObject *result = PyList_New(n);
+    if (!result) {
+        return NULL;
+    }
+    for (int i = 0; i < n; i++) {
+        PyObject *item = Py_BuildValue("(KI)", (unsigned long long)events[i].data.u64, (unsigned int)events[i].events);
+        if (!item) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, i, item); // Steals reference
+    }
+    return result;
+}
+
+static PyObject *Poller_close(Poller *self, PyObject *Py_UNUSED(ignored)) {
+    if (self->epfd >= 0) {
+        close(self->epfd);
+        self->epfd = -1;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *Poller_fileno(Poller *self, PyObject *Py_UNUSED(ignored)) {
+    if (Poller_check_open(self) < 0) {
+        return NULL;
+    }
+    return PyLong_FromLong(self->epfd);
+}
+
+static PyMethodDef Poller_methods[] = {
+    {"register", (PyCFunction)Poller_register, METH_VARARGS, "Watch a file descriptor, reporting it under the given token"},
+    {"unregister", (PyCFunction)Poller_unregister, METH_VARARGS, "Stop watching a file descriptor"},
+    {"poll", (PyCFunction)Poller_poll, METH_VARARGS, "Wait for events, returning a list of (token, events)"},
+    {"close", (PyCFunction)Poller_close, METH_NOARGS, "Close the epoll descriptor"},
+    {"fileno", (PyCFunction)Poller_fileno, METH_NOARGS, "Return the epoll descriptor"},
+    {NULL}
+};
+
+static PyTypeObject PollerType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_luaward.Poller",
+    .tp_doc = "epoll set mapping file descriptors to tokens",
+    .tp_basicsize = sizeof(Poller),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = Poller_new,
+    .tp_init = (initproc)Poller_init,
+    .tp_dealloc = (destructor)Poller_dealloc,
+    .tp_methods = Poller_methods,
+};
+
 static PyMethodDef module_methods[] = {
     {"lockdown", luaward_lockdown, METH_NOARGS, "Apply seccomp filter to current process"},
+    {"pidfd_open", luaward_pidfd_open, METH_VARARGS, "Open a pidfd for a process"},
+    {"install_cancel_handler", luaward_install_cancel_handler, METH_VARARGS, "Abort running Lua code when the given signal carries its request ID"},
+    {"set_request_id", luaward_set_request_id, METH_VARARGS, "Set the request ID that cancel signals must match"},
+    {"cancel", luaward_cancel, METH_VARARGS, "Queue a cancel signal for a request in another process"},
     {NULL, NULL, 0, NULL}
 };
 
@@ -662,6 +3807,11 @@ PyMODINIT_FUNC PyInit__luaward(void) {
     PyObject *m;
     if (PyType_Ready(&LuaVMType) < 0)
         return NULL;
+    if (PyType_Ready(&PollerType) < 0)
+        return NULL;
+    if (PyType_Ready(&PinnedValueType) < 0)
+        return NULL;
+    codec_init();
 
     m = PyModule_Create(&pyluamodule);
     if (m == NULL)
@@ -674,5 +3824,12 @@ PyMODINIT_FUNC PyInit__luaward(void) {
         return NULL;
     }
 
+    Py_INCREF(&PollerType);
+    if (PyModule_AddObject(m, "Poller", (PyObject *)&PollerType) < 0) {
+        Py_DECREF(&PollerType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
     return m;
 }
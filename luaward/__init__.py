@@ -1,3 +1,9 @@
 from .isolated import IsolatedLuaVM
+from .reactor import Reactor
+from .pool import LuaVMPool
+from .server import LuaServer, LuaClient
+from .argcache import CachedArg
+from .errors import WorkerDiedError, DeadlineExceededError, PoolOverloadedError
 
-__all__ = ["IsolatedLuaVM"]
+__all__ = ["IsolatedLuaVM", "Reactor", "LuaVMPool", "LuaServer", "LuaClient", "WorkerDiedError", "DeadlineExceededError",
+           "PoolOverloadedError", "CachedArg"]
@@ -0,0 +1,125 @@
+import hashlib
+import pickle
+import collections
+import threading
+
+# Pinned values kept per worker. The parent mirrors the same LRU, so it
+# knows which values it can leave out of a request.
+ARG_CACHE_SIZE = 16
+
+
+class CachedArg:
+    """
+    Wraps a large call() argument sent with many calls (a configuration
+    table, a rule set...). The worker keeps it converted, keyed by a hash of
+    its content, so only the first call using it pays for transfer and
+    conversion; later ones send the 16-byte digest.
+
+    The value may be anything set_globals() accepts, dicts and lists
+    included. It must not be modified once wrapped: create one CachedArg and
+    reuse it.
+    """
+
+    __slots__ = ('value', 'digest')
+
+    def __init__(self, value):
+        self.value = value
+        blob = pickle.dumps(value, protocol=pickle.HIGHEST_PROTOCOL)
+        self.digest = hashlib.blake2b(blob, digest_size=16).digest()
+
+    def __getstate__(self):
+        return self.value, self.digest
+
+    def __setstate__(self, state):
+        self.value, self.digest = state
+
+
+class ArgRef:
+    """A CachedArg on the wire: its digest, and its value unless the worker has it."""
+
+    __slots__ = ('digest', 'value')
+
+    def __init__(self, digest, value=None):
+        self.digest = digest
+        self.value = value
+
+    def __getstate__(self):
+        return self.digest, self.value
+
+    def __setstate__(self, state):
+        self.digest, self.value = state
+
+
+class ArgCacheMiss(Exception):
+    """The worker no longer holds a value the parent left out."""
+
+
+class ArgCacheMirror:
+    """
+    Parent-side view of a worker's ArgCache, updated in the order requests
+    are sent. It can be wrong when the worker skips a request (expired
+    deadline, conversion error); the worker then answers ARG_MISS and the
+    request is sent again with every value included.
+    """
+
+    def __init__(self, size=ARG_CACHE_SIZE):
+        self.size = size
+        self._lock = threading.Lock()
+        self._digests = collections.OrderedDict()
+
+    def encode(self, args, inline=False):
+        """
+        Returns args with each CachedArg replaced by an ArgRef, carrying the
+        value when the worker may not have it. With inline=True every value
+        is carried and the mirror is left as it is, so building a resend
+        does not mark values as sent.
+        """
+        if inline:
+            return tuple(ArgRef(arg.digest, arg.value) if isinstance(arg, CachedArg) else arg
+                         for arg in args)
+        encoded = []
+        with self._lock:
+            for arg in args:
+                if isinstance(arg, CachedArg):
+                    known = arg.digest in self._digests
+                    self._digests[arg.digest] = None
+                    self._digests.move_to_end(arg.digest)
+                    while len(self._digests) > self.size:
+                        self._digests.popitem(last=False)
+                    arg = ArgRef(arg.digest, None if known else arg.value)
+                encoded.append(arg)
+        return tuple(encoded)
+
+
+class ArgCache:
+    """Worker-side LRU of pinned values (_luaward.PinnedValue) by digest."""
+
+    def __init__(self, size=ARG_CACHE_SIZE):
+        self.size = size
+        self._pinned = collections.OrderedDict()
+
+    def resolve(self, vm, args):
+        """
+        Returns args with every ArgRef (or CachedArg, in-process) replaced by
+        the value pinned in vm, pinning it first if needed. Raises
+        ArgCacheMiss if a value left out is not cached.
+        """
+        resolved = []
+        for arg in args:
+            if isinstance(arg, (ArgRef, CachedArg)):
+                pinned = self._pinned.get(arg.digest)
+                if pinned is None:
+                    if arg.value is None:
+                        raise ArgCacheMiss("Argument cache miss")
+                    pinned = vm.pin(arg.value)
+                    self._pinned[arg.digest] = pinned
+                    while len(self._pinned) > self.size:
+                        self._pinned.popitem(last=False) # Frees its registry slot
+                else:
+                    self._pinned.move_to_end(arg.digest)
+                arg = pinned
+            resolved.append(arg)
+        return resolved
+
+    def clear(self):
+        self._pinned.clear()
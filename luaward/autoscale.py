@@ -0,0 +1,91 @@
+import logging
+
+logger = logging.getLogger("luaward.autoscale")
+
+
+def memory_available():
+    """
+    Bytes of memory available for new allocations (MemAvailable from
+    /proc/meminfo), or None when it cannot be read.
+    """
+    try:
+        with open('/proc/meminfo') as f:
+            for line in f:
+                if line.startswith('MemAvailable:'):
+                    return int(line.split()[1]) * 1024
+    except (OSError, ValueError, IndexError):
+        pass
+    return None
+
+
+def memory_pressure():
+    """
+    Share of the last 10 seconds (in percent) during which some task was
+    stalled on memory, from Linux PSI (/proc/pressure/memory). None when
+    the kernel does not provide PSI.
+    """
+    try:
+        with open('/proc/pressure/memory') as f:
+            for line in f:
+                fields = line.split()
+                if fields and fields[0] == 'some':
+                    for field in fields[1:]:
+                        name, _, value = field.partition('=')
+                        if name == 'avg10':
+                            return float(value)
+    except (OSError, ValueError):
+        pass
+    return None
+
+
+class ScalingPolicy:
+    """
+    Decides how a LuaVMPool resizes between min_size and max_size.
+
+    The pool grows by one worker per tick while requests waited longer than
+    `target_wait` seconds to be dispatched (or every worker is busy with
+    requests still queued), provided the host has room for one more VM:
+    MemAvailable above `memory_reserve` plus the VM's memory_limit, and PSI
+    memory pressure below `max_pressure`. It shrinks by one idle worker per
+    tick when that worker has been idle for `idle_timeout` seconds, or at
+    once under memory pressure.
+    """
+
+    def __init__(self, min_size, max_size, target_wait=0.05, idle_timeout=30.0,
+                 interval=1.0, max_pressure=10.0, memory_reserve=64 * 1024 * 1024):
+        if not 0 < min_size <= max_size:
+            raise ValueError("Requires 0 < min_size <= max_size")
+        self.min_size = min_size
+        self.max_size = max_size
+        self.target_wait = target_wait
+        self.idle_timeout = idle_timeout
+        self.interval = interval
+        self.max_pressure = max_pressure
+        self.memory_reserve = memory_reserve
+
+    def decide(self, size, busy, queued, wait, idle_for, memory_limit):
+        """
+        Returns +1 to add a worker, -1 to retire the longest idle one, or 0.
+
+        size: current workers; busy: workers running a request; queued:
+        requests waiting; wait: longest queue wait observed since the last
+        tick; idle_for: seconds the longest idle worker has been idle, or
+        None when none is idle; memory_limit: per-VM limit in bytes, or None.
+        """
+        pressure = memory_pressure()
+        pressured = pressure is not None and pressure >= self.max_pressure
+        if pressured and idle_for is not None and size > self.min_size:
+            logger.info(f"Memory pressure {pressure}%, retiring an idle worker")
+            return -1
+
+        saturated = queued and (wait > self.target_wait or busy == size)
+        if saturated and size < self.max_size and not pressured:
+            available = memory_available()
+            needed = self.memory_reserve + (memory_limit or 0)
+            if available is None or available >= needed:
+                return 1
+            logger.info("Not enough available memory to add a worker")
+
+        if idle_for is not None and idle_for >= self.idle_timeout and size > self.min_size:
+            return -1
+        return 0
@@ -0,0 +1,76 @@
+import hashlib
+import pickle
+import threading
+import time
+import collections
+from .argcache import CachedArg
+
+
+class ResultCache:
+    """
+    LRU cache, with optional TTL, for results of calls declared pure.
+
+    Keys are derived from the method, the SHA-256 of the script (or the
+    function name) and the pickled arguments. Only successful results are
+    stored; errors are never cached.
+    """
+
+    def __init__(self, maxsize=1024, ttl=None):
+        self.maxsize = maxsize
+        self.ttl = ttl
+        self._lock = threading.Lock()
+        self._entries = collections.OrderedDict() # key -> (expires, value)
+        self.hits = 0
+        self.misses = 0
+
+    @staticmethod
+    def key(method, args):
+        """
+        Returns the cache key for a request, or None if the arguments cannot
+        be hashed (such requests are never cached).
+        """
+        if method == 'execute':
+            target = hashlib.sha256(args[0].encode()).hexdigest()
+            rest = args[1:]
+        else:
+            target, rest = args[0], args[1:]
+            if isinstance(target, list):
+                target = tuple(target) # Pipeline stages
+        # A CachedArg is keyed by its digest rather than pickled again
+        rest = tuple(('CachedArg', arg.digest) if isinstance(arg, CachedArg) else arg for arg in rest)
+        try:
+            blob = pickle.dumps(rest, protocol=pickle.HIGHEST_PROTOCOL)
+        except (pickle.PicklingError, TypeError, AttributeError):
+            return None
+        return (method, target, hashlib.sha256(blob).digest())
+
+    def get(self, key):
+        """
+        Returns (True, value) on a fresh hit, (False, None) otherwise.
+        """
+        with self._lock:
+            entry = self._entries.get(key)
+            if entry is not None:
+                expires, value = entry
+                if expires is None or expires > time.monotonic():
+                    self._entries.move_to_end(key)
+                    self.hits += 1
+                    return True, value
+                del self._entries[key]
+            self.misses += 1
+            return False, None
+
+    def put(self, key, value):
+        expires = None if self.ttl is None else time.monotonic() + self.ttl
+        with self._lock:
+            self._entries[key] = (expires, value)
+            self._entries.move_to_end(key)
+            while len(self._entries) > self.maxsize:
+                self._entries.popitem(last=False)
+
+    def clear(self):
+        with self._lock:
+            self._entries.clear()
+
+    def __len__(self):
+        return len(self._entries)
@@ -0,0 +1,342 @@
+import sys
+import time
+import random
+import struct
+import marshal
+import hashlib
+import argparse
+import itertools
+import threading
+import collections
+import _luaward
+from .argcache import CachedArg
+
+MAGIC = b'LWCAP1\n'
+
+# Every record is a marshalled tuple preceded by its length
+_LENGTH = struct.Struct('<I')
+
+# Commands recorded subject to sample_rate, and the kind of their records
+_SAMPLED = {'CALL': 'call', 'CALL_BATCH': 'call_batch',
+            'PIPELINE': 'pipeline', 'PIPELINE_BATCH': 'pipeline_batch'}
+
+# How replay() runs each kind of request record on a LuaVM, given the
+# record's target (function, stages or context name) and arguments
+_REPLAY = {
+    'call': lambda vm, target, args: vm.call(target, *args),
+    'call_batch': lambda vm, target, args: vm.call_batch(target, args),
+    'pipeline': lambda vm, target, args: vm.pipeline(target, *args),
+    'pipeline_batch': lambda vm, target, args: vm.pipeline_batch(target, args),
+    'set_globals': lambda vm, target, args: vm.set_globals(args),
+    'set_context': lambda vm, target, args: vm.set_context(args, target),
+}
+
+
+def _plain(args):
+    return [arg.value if isinstance(arg, CachedArg) else arg for arg in args]
+
+
+def _label(kind, target):
+    # The name replay timings are grouped under
+    if kind in ('pipeline', 'pipeline_batch'):
+        target = " | ".join(target)
+    if kind in ('call', 'pipeline'):
+        return target
+    if kind == 'set_globals':
+        return kind
+    return f"{kind}:{target}"
+
+
+class CaptureLog:
+    """
+    Records requests handled by IsolatedLuaVMs created with capture=log, for
+    replay() to run again offline.
+
+    The log is a compact binary file of marshalled tuples: each VM's budgets
+    and callback names, each distinct script once (keyed by its SHA-256),
+    then every request with its arguments, timeout, the callback responses
+    it received, its outcome and duration. Requests are written as they
+    complete, which per VM is the order they ran in.
+
+    `sample_rate` is the share of calls and pipelines recorded, batches
+    included; execute, set_globals and set_context requests are always kept
+    because later calls depend on the state they define. Recording stops
+    once the file reaches `max_bytes`.
+    """
+
+    def __init__(self, path, sample_rate=1.0, max_bytes=None):
+        self.path = path
+        self.sample_rate = sample_rate
+        self.max_bytes = max_bytes
+        self.recorded = 0
+        self.dropped = 0 # Not sampled, not serializable, or past max_bytes
+        self._lock = threading.Lock()
+        self._vm_ids = itertools.count(1)
+        self._scripts = set()
+        self._file = open(path, 'wb')
+        self._file.write(MAGIC)
+        self._size = len(MAGIC)
+
+    def register_vm(self, memory_limit, instruction_limit, callback_names):
+        """Records a VM's budgets; returns the ID its requests are logged under."""
+        vm_id = next(self._vm_ids)
+        self._write([('vm', vm_id, memory_limit, instruction_limit, list(callback_names))])
+        return vm_id
+
+    def begin(self, vm_id, cmd, payload, timeout):
+        """
+        Starts recording a request, returning a CaptureEntry to finish()
+        once it completes, or None when the request is not recorded.
+        """
+        if cmd in _SAMPLED:
+            if self.sample_rate < 1.0 and random.random() >= self.sample_rate:
+                self.dropped += 1
+                return None
+            target, args = payload
+            if cmd in ('CALL', 'PIPELINE'):
+                args = _plain(args)
+            else:
+                args = [_plain(call_args) for call_args in args]
+            return CaptureEntry(self, (_SAMPLED[cmd], vm_id, target, args, timeout))
+        if cmd == 'SET_GLOBALS':
+            return CaptureEntry(self, ('set_globals', vm_id, None, dict(payload), timeout))
+        if cmd == 'SET_CONTEXT':
+            mapping, name = payload
+            return CaptureEntry(self, ('set_context', vm_id, name, dict(mapping), timeout))
+        if cmd == 'EXECUTE':
+            digest = hashlib.sha256(payload.encode()).hexdigest()
+            records = []
+            with self._lock:
+                if digest not in self._scripts:
+                    self._scripts.add(digest)
+                    records.append(('script', digest, payload))
+            self._write(records)
+            return CaptureEntry(self, ('execute', vm_id, digest, timeout))
+        return None
+
+    def _write(self, records):
+        blobs = []
+        for record in records:
+            try:
+                blob = marshal.dumps(record, 4)
+            except ValueError:
+                self.dropped += 1 # Arguments or results marshal cannot encode
+                continue
+            blobs.append(_LENGTH.pack(len(blob)) + blob)
+        if not blobs:
+            return
+        data = b''.join(blobs)
+        with self._lock:
+            if self._file.closed:
+                return
+            if self.max_bytes is not None and self._size + len(data) > self.max_bytes:
+                self.dropped += len(blobs)
+                return
+            self._file.write(data)
+            self._size += len(data)
+            self.recorded += len(blobs)
+
+    def flush(self):
+        with self._lock:
+            if not self._file.closed:
+                self._file.flush()
+
+    def close(self):
+        with self._lock:
+            self._file.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+
+class CaptureEntry:
+    """One request being recorded."""
+
+    __slots__ = ('log', 'head', 'responses', 'started')
+
+    def __init__(self, log, head):
+        self.log = log
+        self.head = head
+        self.responses = [] # Callback responses, in the order the VM got them
+        self.started = time.monotonic()
+
+    def add_response(self, response):
+        if not isinstance(response, (type(None), bool, int, float, str)):
+            response = str(response) # What the VM receives for other types
+        self.responses.append(response)
+
+    def finish(self, ok, value):
+        elapsed = time.monotonic() - self.started
+        if not ok:
+            value = f"{type(value).__name__}: {value}"
+        self.log._write([self.head + (self.responses, ok, value, elapsed)])
+
+    def finish_future(self, future):
+        if future.cancelled():
+            self.finish(False, RuntimeError("Request cancelled"))
+        elif future.exception() is not None:
+            self.finish(False, future.exception())
+        else:
+            self.finish(True, future.result())
+
+
+def read_log(path):
+    """Yields the records of a capture log."""
+    with open(path, 'rb') as f:
+        if f.read(len(MAGIC)) != MAGIC:
+            raise ValueError(f"{path} is not a luaward capture log")
+        while True:
+            header = f.read(_LENGTH.size)
+            if len(header) < _LENGTH.size:
+                return
+            blob = f.read(_LENGTH.unpack(header)[0])
+            if len(blob) < _LENGTH.unpack(header)[0]:
+                return # Truncated by a crash while writing
+            yield marshal.loads(blob)
+
+
+class ReplayReport:
+    """Outcome of replay(): timings per function or script, errors and mismatches."""
+
+    def __init__(self):
+        self.requests = 0
+        self.errors = 0
+        self.mismatches = [] # (request index, recorded outcome, replayed outcome)
+        self.elapsed = 0.0
+        self.timings = collections.defaultdict(list) # target -> seconds per request
+
+    def summary(self):
+        lines = [f"{self.requests} requests in {self.elapsed:.3f}s, "
+                 f"{self.errors} errors, {len(self.mismatches)} mismatches"]
+        for target, times in sorted(self.timings.items(), key=lambda item: -sum(item[1])):
+            times = sorted(times)
+            p95 = times[min(len(times) - 1, int(0.95 * len(times)))]
+            lines.append(f"{target}: {len(times)} calls, total {sum(times) * 1000:.1f}ms, "
+                         f"mean {sum(times) / len(times) * 1e6:.0f}us, p95 {p95 * 1e6:.0f}us")
+        return "\n".join(lines)
+
+
+class _ReplayVM:
+    # A local LuaVM with the recorded budgets whose callbacks answer with
+    # the responses recorded for the request being replayed
+    def __init__(self, memory_limit, instruction_limit, callback_names):
+        self.responses = collections.deque()
+        kwargs = {'callbacks': {name: self._stub for name in callback_names}}
+        if memory_limit:
+            kwargs['memory_limit'] = memory_limit
+        if instruction_limit:
+            kwargs['instruction_limit'] = instruction_limit
+        self.vm = _luaward.LuaVM(**kwargs)
+
+    def _stub(self, *args):
+        return self.responses.popleft() if self.responses else None
+
+
+def replay(path, pool=None, deadlines=False):
+    """
+    Runs the requests of a capture log again and returns a ReplayReport.
+
+    Without a pool, each recorded VM is recreated in this process as a
+    _luaward.LuaVM with the same memory and instruction limits, callbacks
+    return the recorded responses, and requests run back to back in log
+    order, so a replay is deterministic and its results are compared with
+    the recorded ones. Timeouts are only enforced with deadlines=True.
+
+    With a LuaVMPool, calls and pipelines are submitted all at once to
+    measure the pool under the recorded load, batches split into single
+    requests the pool may batch again; functions must be defined by the
+    pool's setup_script, execute, set_globals and set_context requests are
+    skipped and results are not compared.
+    """
+    report = ReplayReport()
+    if pool is not None:
+        return _replay_on_pool(path, pool, report)
+
+    vms = {}
+    scripts = {}
+    start = time.monotonic()
+    for record in read_log(path):
+        kind = record[0]
+        if kind == 'vm':
+            _, vm_id, memory_limit, instruction_limit, callback_names = record
+            vms[vm_id] = _ReplayVM(memory_limit, instruction_limit, callback_names)
+            continue
+        if kind == 'script':
+            scripts[record[1]] = record[2]
+            continue
+        if kind in _REPLAY:
+            _, vm_id, name, args, timeout, responses, ok, value, _ = record
+            target = _label(kind, name)
+            run = lambda vm: _REPLAY[kind](vm, name, args)
+        else:
+            _, vm_id, digest, timeout, responses, ok, value, _ = record
+            target = f"execute:{digest[:12]}"
+            script = scripts[digest]
+            run = lambda vm: vm.execute(script)
+
+        replay_vm = vms[vm_id]
+        replay_vm.responses = collections.deque(responses)
+        if deadlines and timeout is not None:
+            replay_vm.vm.set_deadline(time.monotonic() + timeout)
+        began = time.monotonic()
+        try:
+            outcome = (True, run(replay_vm.vm))
+        except Exception as e:
+            outcome = (False, f"{type(e).__name__}: {e}")
+            report.errors += 1
+        report.timings[target].append(time.monotonic() - began)
+        if deadlines:
+            replay_vm.vm.set_deadline(None)
+        if outcome[0] != ok or (ok and outcome[1] != value):
+            report.mismatches.append((report.requests, (ok, value), outcome))
+        report.requests += 1
+    report.elapsed = time.monotonic() - start
+    return report
+
+
+def _replay_on_pool(path, pool, report):
+    pending = []
+    start = time.monotonic()
+    for record in read_log(path):
+        kind = record[0]
+        if kind not in ('call', 'call_batch', 'pipeline', 'pipeline_batch'):
+            continue
+        _, _, name, args, timeout, _, _, _, _ = record
+        method = 'pipeline' if kind.startswith('pipeline') else 'call'
+        target = _label(method, name)
+        for call_args in (args if kind.endswith('_batch') else [args]):
+            began = time.monotonic()
+            future = pool.submit(method, name, *call_args, timeout=timeout)
+            future.add_done_callback(
+                lambda f, target=target, began=began: report.timings[target].append(time.monotonic() - began))
+            pending.append(future)
+    for future in pending:
+        try:
+            future.result()
+        except Exception:
+            report.errors += 1
+    report.requests = len(pending)
+    report.elapsed = time.monotonic() - start
+    return report
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description="Replay a luaward capture log")
+    parser.add_argument('log', help="Capture log written by CaptureLog")
+    parser.add_argument('--deadlines', action='store_true', help="Enforce recorded timeouts")
+    parser.add_argument('--show-mismatches', type=int, default=5, metavar='N',
+                        help="Print the first N requests whose outcome differs")
+    args = parser.parse_args(argv)
+
+    report = replay(args.log, deadlines=args.deadlines)
+    print(report.summary())
+    for index, recorded, replayed in report.mismatches[:args.show_mismatches]:
+        print(f"request {index}: recorded {recorded!r}, replayed {replayed!r}")
+    return 1 if report.mismatches else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,157 @@
+import os
+import time
+import fcntl
+import struct
+import marshal
+import tempfile
+import threading
+import contextlib
+import multiprocessing
+from multiprocessing import shared_memory
+
+# Ring header: index of the next message to read, and of the next to write.
+# Each side only stores its own index, one aligned word at a time.
+_HEADER = struct.Struct('<QQ')
+_INDEX = struct.Struct('<Q')
+_HEAD, _TAIL = 0, _INDEX.size
+_LENGTH = struct.Struct('<I')
+
+# Longest a waiter sleeps before looking at the ring again, so a wakeup lost
+# with a process killed mid-transfer costs at most this long
+_POLL = 0.05
+
+
+class Channel:
+    """
+    Bounded queue in shared memory that workers reach from Lua, so stage
+    outputs flow between sandboxes without passing through the parent:
+
+        channels = {"parsed": Channel(), "scored": Channel()}
+        pool = LuaVMPool(size=4, setup_script=STAGES, channels=channels)
+
+    Lua sees them as channel.send(name, value [, timeout]) and
+    channel.recv(name [, timeout]). The parent feeds and drains them with
+    send() and recv().
+
+    The ring holds `capacity` messages of up to `max_message` bytes.
+    Values are encoded with marshal, so they may be None, bools, numbers,
+    strings, and lists and dicts of those (Lua tables). Workers inherit
+    channels when forked, so they must exist before the workers using them
+    start; their creator closes them once no worker needs them.
+
+    A process killed in the middle of send() or recv() cannot wedge the
+    channel: the ring is guarded by a POSIX record lock, which the kernel
+    drops when its holder dies, an index only moves once its message is
+    fully copied, and the semaphores are mere doorbells that waiters
+    re-check the ring after.
+    """
+
+    def __init__(self, capacity=64, max_message=64 * 1024):
+        self.capacity = capacity
+        self.max_message = max_message
+        self._slot = _LENGTH.size + max_message
+        self._shm = shared_memory.SharedMemory(create=True, size=_HEADER.size + capacity * self._slot)
+        self._owner = os.getpid()
+        self._lock_file = tempfile.TemporaryFile()
+        self._thread_lock = threading.Lock() # Record locks are per process
+        self._thread_lock_pid = self._owner
+        # Rung once a message or a free slot appears; at most one ring is kept
+        self._filled = multiprocessing.BoundedSemaphore(1)
+        self._free = multiprocessing.BoundedSemaphore(1)
+        self._filled.acquire()
+        self._free.acquire()
+        _HEADER.pack_into(self._shm.buf, 0, 0, 0)
+
+    @contextlib.contextmanager
+    def _locked(self):
+        if self._thread_lock_pid != os.getpid():
+            # Forked, possibly while another thread held it
+            self._thread_lock = threading.Lock()
+            self._thread_lock_pid = os.getpid()
+        with self._thread_lock:
+            fcntl.lockf(self._lock_file, fcntl.LOCK_EX)
+            try:
+                buf = self._shm.buf
+                yield buf, _INDEX.unpack_from(buf, _HEAD)[0], _INDEX.unpack_from(buf, _TAIL)[0]
+            finally:
+                fcntl.lockf(self._lock_file, fcntl.LOCK_UN)
+
+    @staticmethod
+    def _wait(bell, deadline):
+        # Sleeps until rung or for one poll; False once past the deadline
+        if deadline is None:
+            bell.acquire(timeout=_POLL)
+            return True
+        remaining = deadline - time.monotonic()
+        if remaining <= 0:
+            return False
+        bell.acquire(timeout=min(remaining, _POLL))
+        return True
+
+    @staticmethod
+    def _ring(bell):
+        try:
+            bell.release()
+        except ValueError:
+            pass # Already rung
+
+    def send(self, value, timeout=None):
+        """Queues value, waiting up to timeout seconds for room; raises TimeoutError if full."""
+        data = marshal.dumps(value, 4)
+        if len(data) > self.max_message:
+            raise ValueError(f"Message of {len(data)} bytes exceeds max_message ({self.max_message})")
+        deadline = None if timeout is None else time.monotonic() + timeout
+        waited = False
+        while True:
+            with self._locked() as (buf, head, tail):
+                if tail - head < self.capacity:
+                    offset = _HEADER.size + (tail % self.capacity) * self._slot
+                    _LENGTH.pack_into(buf, offset, len(data))
+                    buf[offset + _LENGTH.size:offset + _LENGTH.size + len(data)] = data
+                    _INDEX.pack_into(buf, _TAIL, tail + 1)
+                    room = tail + 1 - head < self.capacity
+                    break
+            if not self._wait(self._free, deadline):
+                raise TimeoutError("Channel full")
+            waited = True
+        self._ring(self._filled)
+        if waited and room:
+            self._ring(self._free) # Pass the wakeup on to another waiting sender
+
+    def recv(self, timeout=None):
+        """Returns the oldest value, waiting up to timeout seconds; raises TimeoutError if empty."""
+        deadline = None if timeout is None else time.monotonic() + timeout
+        waited = False
+        while True:
+            with self._locked() as (buf, head, tail):
+                if tail > head:
+                    offset = _HEADER.size + (head % self.capacity) * self._slot
+                    length = _LENGTH.unpack_from(buf, offset)[0]
+                    data = bytes(buf[offset + _LENGTH.size:offset + _LENGTH.size + length])
+                    _INDEX.pack_into(buf, _HEAD, head + 1)
+                    more = tail > head + 1
+                    break
+            if not self._wait(self._filled, deadline):
+                raise TimeoutError("Channel empty")
+            waited = True
+        self._ring(self._free)
+        if waited and more:
+            self._ring(self._filled) # Pass the wakeup on to another waiting receiver
+        return marshal.loads(data)
+
+    def __len__(self):
+        with self._locked() as (_, head, tail):
+            return tail - head
+
+    def close(self):
+        """Detaches from the shared memory, freeing it in the process that created it."""
+        self._shm.close()
+        self._lock_file.close()
+        if os.getpid() == self._owner:
+            self._shm.unlink()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
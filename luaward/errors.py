@@ -0,0 +1,26 @@
+class WorkerDiedError(SystemError):
+    """
+    The worker process exited while requests were pending, e.g. killed by
+    RLIMIT_CPU (SIGXCPU), a seccomp violation (SIGSYS) or the OOM killer
+    (SIGKILL).
+
+    Attributes:
+        exitcode: Process exit code, negative when killed by a signal.
+        signal: Number of the signal that killed the worker, or None.
+        stats: Last resource report received from the worker, plus the
+            CPU time it consumed when the kernel still reports it.
+    """
+
+    def __init__(self, message, exitcode=None, signal=None, stats=None):
+        super().__init__(message)
+        self.exitcode = exitcode
+        self.signal = signal
+        self.stats = stats or {}
+
+
+class DeadlineExceededError(TimeoutError):
+    """The request did not complete before its deadline."""
+
+
+class PoolOverloadedError(RuntimeError):
+    """The pool rejected the request because its queue is full."""
@@ -6,49 +6,160 @@ import contextlib
 import os
 import ctypes
 import resource
+import asyncio
+import inspect
+import itertools
+import collections
+import threading
+import signal
+import time
+import logging
+import concurrent.futures
+import multiprocessing.connection
 import _luaward
+from .errors import WorkerDiedError, DeadlineExceededError
+from .argcache import CachedArg, ArgCache, ArgCacheMirror, ArgCacheMiss
+from .slowlog import slow_report
+
+# Signal queued (with the request ID as value) to abort a running request
+CANCEL_SIGNAL = signal.SIGUSR1
+
+# Worker command for each public method, and how its arguments are sent
+_COMMANDS = {
+    'execute': ('EXECUTE', lambda script: script),
+    'call': ('CALL', lambda func_name, *args: (func_name, args)),
+    'call_batch': ('CALL_BATCH', lambda func_name, arg_lists: (func_name, [tuple(a) for a in arg_lists])),
+    'pipeline': ('PIPELINE', lambda stages, *args: (list(stages), args)),
+    'pipeline_batch': ('PIPELINE_BATCH', lambda stages, arg_lists: (list(stages), [tuple(a) for a in arg_lists])),
+    'function_exists': ('FUNCTION_EXISTS', lambda func_name: func_name),
+    'set_globals': ('SET_GLOBALS', lambda mapping: mapping),
+    'get_globals': ('GET_GLOBALS', lambda names: list(names)),
+    'set_context': ('SET_CONTEXT', lambda mapping, name='context': (mapping, name)),
+}
+
+# Commands whose executions the slow log watches
+_MEASURED = ('EXECUTE', 'CALL', 'CALL_BATCH', 'PIPELINE', 'PIPELINE_BATCH')
+
+# Execution modes; LUAWARD_ISOLATION sets the default
+ISOLATION_MODES = ('process', 'inprocess')
+
+logger = logging.getLogger("luaward.isolated")
+
+
+def _isolation_mode(isolation):
+    mode = isolation or os.environ.get('LUAWARD_ISOLATION') or 'process'
+    if mode not in ISOLATION_MODES:
+        raise ValueError(f"Unknown isolation mode: {mode!r}")
+    return mode
+
 
 class IsolatedLuaVM:
+    def __new__(cls, *args, isolation=None, **kwargs):
+        # isolation='inprocess' (or LUAWARD_ISOLATION=inprocess) selects the
+        # in-process implementation without changing the calling code
+        if cls is IsolatedLuaVM and _isolation_mode(isolation) == 'inprocess':
+            cls = InProcessLuaVM
+        return super().__new__(cls)
+
     def __init__(self, memory_limit=None, callbacks=None, instruction_limit=None, 
                  uid=None, gid=None, full_isolation=False,
-                 cpu_limit=None):
-        self.cmd_queue = multiprocessing.Queue()
-        self.result_queue = multiprocessing.Queue()
+                 cpu_limit=None, callback_executor=None, reactor=None,
+                 default_timeout=None, cancel_grace=1.0, isolation=None, capture=None,
+                 slow_log=None, channels=None, safe_load=False, optimizer=None):
+        self.isolation = 'process'
+        self._send_lock = threading.Lock()
+        self._pending_lock = threading.Lock()
+        self._pending = {}
+        self._request_ids = itertools.count(1)
+        self._crashed = None
+        self._death = None
+
+        # Deadlines: requests taking longer than their timeout are cancelled,
+        # and the worker is killed if it does not stop within cancel_grace.
+        self.default_timeout = default_timeout
+        self.cancel_grace = cancel_grace
+        self.last_stats = None
+        # Names of the worker's global functions, as reported with its last
+        # result; lets function_exists() skip the round trip
+        self._functions = None
+        self._arg_mirror = ArgCacheMirror() # CachedArg values the worker holds
+        self.on_death = None # Called with this VM once its worker has died
+        self._idle_waiters = []
+        self._exit_lock = threading.Lock()
         
         # Store callbacks locally to execute them on request
         self.callbacks = callbacks or {}
         callback_names = list(self.callbacks.keys())
 
+        # Where callbacks run: None (inline), a concurrent.futures.Executor
+        # or an asyncio event loop. Sharing one executor between many VMs lets
+        # their callbacks run concurrently.
+        self.callback_executor = callback_executor
+
+        # Optional CaptureLog recording requests for offline replay, and
+        # SlowLog of requests crossing its thresholds
+        self.capture = capture
+        self.slow_log = slow_log
+        # {name: Channel} the worker's Lua code reaches as channel.send/recv
+        self.channels = channels or {}
+        # Text-only load() confined to an explicit environment
+        self.safe_load = safe_load
+        # Optional Optimizer rewriting executed scripts before they are sent.
+        # Hoisting keeps library functions in locals, so the worker serves
+        # the library tables read-only for them to stay current.
+        self.optimizer = optimizer
+        self.readonly_libs = optimizer is not None and optimizer.hoist
+        if capture is not None:
+            self._capture_id = capture.register_vm(memory_limit, instruction_limit, callback_names)
+
         # Limits and credentials
         self.uid = uid
         self.gid = gid
         self.full_isolation = full_isolation
         self.cpu_limit = cpu_limit # CPU time in seconds
 
+        self._start_worker(memory_limit, callback_names, instruction_limit)
+
+        # Optional reactor: one thread reading many workers' transports
+        self.reactor = None
+        if reactor is not None:
+            reactor.register(self)
+
+    def _start_worker(self, memory_limit, callback_names, instruction_limit):
+        # Duplex transport to the worker. Every request carries an ID so
+        # responses can be matched to their futures by whoever reads it.
+        self._conn, worker_conn = multiprocessing.Pipe()
         self.process = multiprocessing.Process(
             target=self._worker_loop,
-            args=(self.cmd_queue, self.result_queue, memory_limit, 
+            args=(worker_conn, memory_limit, 
                   callback_names, instruction_limit, 
-                  self.uid, self.gid, self.full_isolation, self.cpu_limit)
+                  self.uid, self.gid, self.full_isolation, self.cpu_limit, self.channels,
+                  self.safe_load, self.readonly_libs)
         )
         self.process.start()
+        worker_conn.close()
 
-    def _worker_loop(self, cmd_q, res_q, mem_limit, callback_names, instruction_limit, 
-                     uid, gid, full_isolation, cpu_limit):
+    def _worker_loop(self, conn, mem_limit, callback_names, instruction_limit, 
+                     uid, gid, full_isolation, cpu_limit, channels=None, safe_load=False,
+                     readonly_libs=False):
         self._setup_logging()
         self.logger.info("Worker started")
         
         self._setup_isolation(full_isolation, cpu_limit, uid, gid)
-        proxies = self._create_proxies(callback_names, cmd_q, res_q)
+        _luaward.install_cancel_handler(CANCEL_SIGNAL)
+        # Requests that arrived while a callback was waiting for its result
+        self._deferred = collections.deque()
+        proxies = self._create_proxies(callback_names, conn)
         
         try:
-            vm = self._init_vm(mem_limit, instruction_limit, proxies)
+            vm = self._init_vm(mem_limit, instruction_limit, proxies, channels, safe_load, readonly_libs)
         except Exception as e:
             self.logger.critical(f"VM Init failed: {e}")
-            res_q.put(('CRITICAL', f"Init failed: {e}"))
+            conn.send(('CRITICAL', None, f"Init failed: {e}", None))
             return
 
-        self._command_loop(vm, cmd_q, res_q)
+        self._arg_cache = ArgCache()
+        self._command_loop(vm, conn)
 
     def _setup_logging(self):
         import logging
@@ -101,22 +212,30 @@ class IsolatedLuaVM:
                 self.logger.critical(f"Lockdown failed: {e}")
                 raise # This will be caught by the caller or crash the worker, which is intended if lockdown fails
 
-    def _create_proxies(self, callback_names, cmd_q, res_q):
+    def _create_proxies(self, callback_names, conn):
         proxies = {}
+        callback_ids = itertools.count(1)
         for name in callback_names:
             def make_proxy(func_name):
                 def proxy(*args):
-                    self.logger.debug(f"Proxy calling callback: {func_name}")
-                    res_q.put(('CALLBACK', (func_name, args)))
-                    # Wait for response
+                    callback_id = next(callback_ids)
+                    self.logger.debug(f"Proxy calling callback: {func_name} (id {callback_id})")
+                    conn.send(('CALLBACK', callback_id, (func_name, args), None))
+                    # Wait for the response carrying our callback ID
                     while True:
                         try:
-                            cmd, payload = cmd_q.get()
+                            cmd, result_id, payload, opts = conn.recv()
                             if cmd == 'CALLBACK_RESULT':
-                                return payload
+                                if result_id == callback_id:
+                                    return payload
+                                self.logger.warning(f"Dropping stale callback result (id {result_id})")
                             elif cmd == 'STOP':
                                 self.logger.error("Worker stopped during callback wait")
                                 raise SystemExit("Worker stopped during callback")
+                            else:
+                                # Another request, sent while this one runs:
+                                # the command loop takes it up afterwards
+                                self._deferred.append((cmd, result_id, payload, opts))
                         except Exception as e:
                             self.logger.error(f"Error in proxy loop: {e}")
                             raise
@@ -124,7 +243,8 @@ class IsolatedLuaVM:
             proxies[name] = make_proxy(name)
         return proxies
 
-    def _init_vm(self, mem_limit, instruction_limit, proxies):
+    def _init_vm(self, mem_limit, instruction_limit, proxies, channels=None, safe_load=False,
+                 readonly_libs=False):
         self.logger.info("Initializing LuaVM")
         kwargs = {'callbacks': proxies}
         if mem_limit:
@@ -133,99 +253,797 @@ class IsolatedLuaVM:
         if instruction_limit:
             self.logger.info(f"Instruction limit: {instruction_limit}")
             kwargs['instruction_limit'] = instruction_limit
+        if safe_load:
+            self.logger.info("Sandboxed load() enabled")
+            kwargs['safe_load'] = True
+        if readonly_libs:
+            self.logger.info("Library tables read-only")
+            kwargs['readonly_libs'] = True
             
-        return _luaward.LuaVM(**kwargs)
+        vm = _luaward.LuaVM(**kwargs)
+        if channels:
+            self.logger.info(f"Channels: {', '.join(channels)}")
+            vm.set_channels(channels)
+        return vm
 
-    def _command_loop(self, vm, cmd_q, res_q):
+    def _command_loop(self, vm, conn):
         self.logger.info("Entering command loop")
+        reported = None # Global function names the parent last heard of
+        profiling = 0 # Stack sampling interval requested by the slow log
+        counting = False # Whether the slow log needs instruction counts
         while True:
             try:
-                cmd, payload = cmd_q.get()
+                if self._deferred:
+                    cmd, req_id, payload, opts = self._deferred.popleft()
+                else:
+                    cmd, req_id, payload, opts = conn.recv()
                 if cmd == 'STOP':
                     self.logger.info("Received STOP command")
                     break
-                elif cmd == 'EXECUTE':
-                    try:
-                        self.logger.debug("Executing script")
-                        vm.execute(payload)
-                        res_q.put(('SUCCESS', None))
-                    except Exception as e:
-                        self.logger.error(f"Execution error: {e}")
-                        res_q.put(('ERROR', str(e)))
-                elif cmd == 'CALL':
-                    func_name, args = payload
-                    try:
-                        self.logger.debug(f"Calling function: {func_name}")
-                        res = vm.call(func_name, *args)
-                        res_q.put(('SUCCESS', res))
-                    except Exception as e:
-                        self.logger.error(f"Call error: {e}")
-                        res_q.put(('ERROR', str(e)))
-                elif cmd == 'FUNCTION_EXISTS':
-                    func_name = payload
-                    try:
-                        exists = vm.function_exists(func_name)
-                        res_q.put(('SUCCESS', exists))
-                    except Exception as e:
-                        self.logger.error(f"Function exists check error: {e}")
-                        res_q.put(('ERROR', str(e)))
                 elif cmd == 'CALLBACK_RESULT':
                     self.logger.warning("Received unexpected CALLBACK_RESULT in main loop")
-                    pass 
-            except SystemExit:
-                self.logger.info("SystemExit in command loop")
+                    continue
+                deadline = (opts or {}).get('deadline')
+                if deadline is not None and time.time() >= deadline:
+                    # Expired while queued; the parent has already given up on it
+                    conn.send(('ERROR', req_id, "Deadline exceeded before start", None))
+                    continue
+                _luaward.set_request_id(req_id)
+                slow = (opts or {}).get('slow')
+                if slow is not None and slow['profile'] != profiling:
+                    profiling = slow['profile']
+                    vm.set_profiling(profiling)
+                if slow is not None and (slow['instructions'] is not None) != counting:
+                    counting = slow['instructions'] is not None
+                    vm.set_counting(counting)
+                started = time.monotonic()
+                try:
+                    status, res = 'SUCCESS', self._run_command(vm, cmd, payload)
+                except ArgCacheMiss as e:
+                    status, res = 'ARG_MISS', str(e) # The parent resends with the values
+                except Exception as e:
+                    self.logger.error(f"{cmd} error: {e}")
+                    status, res = 'ERROR', str(e)
+                meta = {'stats': vm.stats()}
+                if slow is not None:
+                    report = slow_report(slow, time.monotonic() - started, meta['stats'],
+                                         vm.take_profile() if profiling else None)
+                    if report is not None:
+                        meta['slow'] = report
+                functions = vm.global_functions()
+                if functions != reported:
+                    # Sent only when a request (re)defined or removed a function
+                    meta['functions'] = reported = functions
+                conn.send((status, req_id, res, meta))
+            except (SystemExit, EOFError):
+                self.logger.info("Command loop terminated")
                 break
             except Exception as e:
                 self.logger.critical(f"Critical error in command loop: {e}")
-                res_q.put(('CRITICAL', str(e)))
+                conn.send(('CRITICAL', None, str(e), None))
                 break
 
-    def _wait_for_result(self, send_callback=None):
-        # send_callback arg is deprecated/removed in favor of self.callbacks
-        while True:
-            status, payload = self.result_queue.get()
-            if status == 'SUCCESS':
-                return payload
-            elif status == 'ERROR':
-                raise RuntimeError(payload)
-            elif status == 'CRITICAL':
-                raise SystemError(f"Worker crashed: {payload}")
-            elif status == 'CALLBACK':
-                # payload is (func_name, args)
-                func_name, args = payload
-                if func_name in self.callbacks:
+    def _run_command(self, vm, cmd, payload):
+        if cmd == 'EXECUTE':
+            self.logger.debug("Executing script")
+            return vm.execute(payload)
+        elif cmd == 'CALL':
+            func_name, args = payload
+            self.logger.debug(f"Calling function: {func_name}")
+            return vm.call(func_name, *self._arg_cache.resolve(vm, args))
+        elif cmd == 'CALL_BATCH':
+            func_name, arg_lists = payload
+            self.logger.debug(f"Calling function {func_name} {len(arg_lists)} times")
+            return vm.call_batch(func_name, [self._arg_cache.resolve(vm, args) for args in arg_lists])
+        elif cmd == 'PIPELINE':
+            stages, args = payload
+            self.logger.debug(f"Running pipeline: {' | '.join(stages)}")
+            return vm.pipeline(stages, *self._arg_cache.resolve(vm, args))
+        elif cmd == 'PIPELINE_BATCH':
+            stages, arg_lists = payload
+            self.logger.debug(f"Running pipeline {' | '.join(stages)} {len(arg_lists)} times")
+            return vm.pipeline_batch(stages, [self._arg_cache.resolve(vm, args) for args in arg_lists])
+        elif cmd == 'FUNCTION_EXISTS':
+            return vm.function_exists(payload)
+        elif cmd == 'SET_GLOBALS':
+            return vm.set_globals(payload)
+        elif cmd == 'GET_GLOBALS':
+            return vm.get_globals(payload)
+        elif cmd == 'SET_CONTEXT':
+            return vm.set_context(*payload)
+        raise ValueError(f"Unknown command: {cmd}")
+
+    def _submit(self, cmd, payload, timeout=None):
+        """
+        Sends a request to the worker and returns a future for its result.
+        The future is completed by whoever reads the transport: the reactor
+        if one is attached, otherwise the thread in _wait_for_result.
+        """
+        future = concurrent.futures.Future()
+        if self._crashed is not None:
+            future.set_exception(self._death or WorkerDiedError(f"Worker crashed: {self._crashed}"))
+            return future
+        if cmd == 'FUNCTION_EXISTS':
+            exists = self._mirrored_function_exists(payload)
+            if exists is not None:
+                future.request_id = future.deadline = future.timer = None
+                future.set_result(exists)
+                return future
+
+        if cmd == 'EXECUTE' and self.optimizer is not None:
+            payload = self.optimizer.optimize(payload)
+        req_id = next(self._request_ids)
+        future.request_id = req_id
+        future.deadline = None
+        future.timer = None
+        future.capture = None
+        if self.capture is not None:
+            future.capture = self.capture.begin(self._capture_id, cmd, payload, timeout or self.default_timeout)
+            if future.capture is not None:
+                future.add_done_callback(future.capture.finish_future)
+        opts = None
+        if timeout is None:
+            timeout = self.default_timeout
+        if timeout is not None:
+            # The worker gets a wall-clock deadline so it can skip requests
+            # that expired while queued behind others
+            future.deadline = time.monotonic() + timeout
+            opts = {'deadline': time.time() + timeout}
+        future.measured = None
+        if self.slow_log is not None and cmd in _MEASURED:
+            # The worker measures the request and reports it if slow
+            future.measured = (cmd, payload)
+            opts = dict(opts or {}, slow=self.slow_log.thresholds)
+        future.resend = None
+        if cmd in ('CALL', 'PIPELINE') and any(isinstance(arg, CachedArg) for arg in payload[1]):
+            # Values the worker already holds are sent as digests; on a miss
+            # the request goes again with every value included
+            target, args = payload
+            payload = (target, self._arg_mirror.encode(args))
+            future.resend = (cmd, (target, self._arg_mirror.encode(args, inline=True)), opts)
+        elif cmd in ('CALL_BATCH', 'PIPELINE_BATCH') and any(
+                isinstance(arg, CachedArg) for args in payload[1] for arg in args):
+            # Likewise per argument list; a value repeated across the batch
+            # travels at most once, pickle shares it between the lists
+            target, arg_lists = payload
+            payload = (target, [self._arg_mirror.encode(args) for args in arg_lists])
+            future.resend = (cmd, (target, [self._arg_mirror.encode(args, inline=True)
+                                            for args in arg_lists]), opts)
+
+        with self._pending_lock:
+            self._pending[req_id] = future
+        if timeout is not None and self.reactor is not None:
+            future.timer = self.reactor.call_later(timeout, lambda: self._expire(req_id))
+        try:
+            self._send((cmd, req_id, payload, opts))
+        except (OSError, ValueError):
+            # Broken transport: the worker is gone, report how it died
+            self._on_exit()
+        return future
+
+    def _send(self, message):
+        with self._send_lock:
+            self._conn.send(message)
+
+    def _wait_for_result(self, future):
+        if self.reactor is None:
+            # No reactor: this thread reads the transport itself, watching
+            # the process sentinel so a dead worker is noticed at once
+            while not future.done():
+                timeout = None
+                if future.deadline is not None:
+                    timeout = future.deadline - time.monotonic()
+                    if timeout <= 0:
+                        self._expire(future.request_id)
+                        self._await_cancel(future.request_id)
+                        break
+                ready = multiprocessing.connection.wait([self._conn, self.process.sentinel], timeout)
+                if self._conn in ready:
                     try:
-                        # Execute callback with unpacked args
-                        response = self.callbacks[func_name](*args)
-                        self.cmd_queue.put(('CALLBACK_RESULT', response))
-                    except Exception as e:
-                        self.cmd_queue.put(('CALLBACK_RESULT', f"Error in callback {func_name}: {e}"))
-                else:
-                     self.cmd_queue.put(('CALLBACK_RESULT', f"Callback '{func_name}' not found"))
-            else:
-                 raise ValueError(f"Unknown status: {status}")
+                        self._handle_message(self._conn.recv())
+                        continue
+                    except (EOFError, OSError):
+                        pass
+                elif not ready:
+                    continue
+                self._on_exit()
+        return future.result()
+
+    def _await_cancel(self, req_id):
+        # Give the worker cancel_grace seconds to abort, then kill it
+        limit = time.monotonic() + self.cancel_grace
+        while self._is_pending(req_id):
+            timeout = limit - time.monotonic()
+            if timeout <= 0 or not multiprocessing.connection.wait([self._conn], timeout):
+                self._kill(f"request {req_id} ignored cancellation")
+                self._on_exit()
+                return
+            try:
+                self._handle_message(self._conn.recv())
+            except (EOFError, OSError):
+                self._on_exit()
+                return
+
+    def _expire(self, req_id):
+        with self._pending_lock:
+            future = self._pending.get(req_id)
+            running = future is not None and next(iter(self._pending)) == req_id
+        if future is None:
+            return
+        _settle(future, exc=DeadlineExceededError(f"Request {req_id} exceeded its deadline"))
+        if running:
+            self.cancel_request(req_id)
+
+    def cancel_request(self, req_id):
+        """
+        Aborts the request if it is the one the worker is running. The worker
+        is killed if it is still busy with it after cancel_grace seconds.
+        """
+        if req_id is None:
+            return # Never sent, or answered from the parent-side mirror
+        try:
+            self._signal_cancel(req_id)
+        except OSError:
+            self._kill(f"cannot signal worker for request {req_id}")
+            return
+        if self.reactor is not None:
+            def check():
+                if self._is_pending(req_id):
+                    self._kill(f"request {req_id} ignored cancellation")
+            self.reactor.call_later(self.cancel_grace, check)
 
-    def execute(self, script):
+    def _signal_cancel(self, req_id):
+        _luaward.cancel(self.process.pid, CANCEL_SIGNAL, req_id)
+
+    def _kill(self, reason):
+        self._crashed = self._crashed or reason
+        try:
+            self.process.kill()
+        except (OSError, AttributeError):
+            pass
+
+    def _handle_message(self, message):
+        status, msg_id, payload, meta = message
+        if meta and 'stats' in meta:
+            self.last_stats = meta['stats']
+        if meta and 'functions' in meta:
+            self._functions = meta['functions']
+        if meta and 'slow' in meta and self.slow_log is not None:
+            with self._pending_lock:
+                future = self._pending.get(msg_id)
+            if future is not None and future.measured is not None:
+                self.slow_log.record(*future.measured, meta['slow'])
+        if status == 'SUCCESS':
+            future = self._pop_pending(msg_id)
+            if future is not None:
+                _settle(future, result=payload)
+        elif status == 'ERROR':
+            future = self._pop_pending(msg_id)
+            if future is not None:
+                _settle(future, exc=RuntimeError(payload))
+        elif status == 'CRITICAL':
+            self._crashed = payload
+            self._fail_pending(WorkerDiedError(f"Worker crashed: {payload}", stats=self.last_stats))
+        elif status == 'ARG_MISS':
+            with self._pending_lock:
+                future = self._pending.get(msg_id)
+            if future is not None and future.resend is not None:
+                cmd, payload, opts = future.resend
+                future.resend = None
+                try:
+                    self._send((cmd, msg_id, payload, opts))
+                except (OSError, ValueError):
+                    pass # Worker is gone; its death fails the request
+        elif status == 'CALLBACK':
+            # payload is (func_name, args)
+            self._dispatch_callback(msg_id, *payload)
+        else:
+             raise ValueError(f"Unknown status: {status}")
+
+    def _pop_pending(self, req_id):
+        with self._pending_lock:
+            future = self._pending.pop(req_id, None)
+            waiters = []
+            if not self._pending:
+                waiters, self._idle_waiters = self._idle_waiters, []
+        if future is not None and future.timer is not None:
+            future.timer.cancel()
+        for callback in waiters:
+            callback()
+        return future
+
+    def notify_when_idle(self, callback):
+        """
+        Calls callback() once the worker has answered every request sent so
+        far, including ones whose futures already failed on their deadline.
+        """
+        with self._pending_lock:
+            if self._pending:
+                self._idle_waiters.append(callback)
+                return
+        callback()
+
+    def _mirrored_function_exists(self, func_name):
+        # True, or None when the worker must be asked: nothing reported yet,
+        # a request still in flight may define or remove functions, or the
+        # name is not listed. The worker only rescans its globals when a
+        # function gets a new name, so the list can miss an existing global
+        # that was turned into a function.
+        with self._pending_lock:
+            if self._functions is None or self._pending or func_name not in self._functions:
+                return None
+            return True
+
+    def _is_pending(self, req_id):
+        with self._pending_lock:
+            return req_id in self._pending
+
+    def _fail_pending(self, exc):
+        with self._pending_lock:
+            pending = list(self._pending.values())
+            self._pending.clear()
+        for future in pending:
+            if future.timer is not None:
+                future.timer.cancel()
+            _settle(future, exc=exc)
+
+    @property
+    def alive(self):
+        return self._death is None and self._crashed is None and self.process.is_alive()
+
+    @property
+    def pid(self):
+        return self.process.pid
+
+    # Reactor hooks: the reactor polls these descriptors and calls back
+    # from its own thread.
+
+    def transport_fileno(self):
+        return self._conn.fileno()
+
+    def _on_readable(self):
+        try:
+            while self._conn.poll():
+                self._handle_message(self._conn.recv())
+        except (EOFError, OSError):
+            # Worker closed its end; the exit descriptor reports the death
+            self.reactor.detach_transport(self)
+
+    def _on_exit(self):
+        with self._exit_lock:
+            if self._death is None:
+                self._collect_death()
+        if self._death is not None:
+            self._fail_pending(self._death)
+        if self.on_death is not None:
+            on_death, self.on_death = self.on_death, None
+            on_death(self)
+
+    def _collect_death(self):
+        # Drain results the worker sent before exiting, then fail the rest
+        try:
+            while self._conn.poll():
+                self._handle_message(self._conn.recv())
+        except (EOFError, OSError):
+            pass
+        if self.reactor is not None:
+            self.reactor.unregister(self)
+        stats = dict(self.last_stats or {})
+        stats.update(self._exit_stats())
+        self.process.join()
+
+        exitcode = self.process.exitcode
+        signum = -exitcode if exitcode is not None and exitcode < 0 else None
+        if signum is not None:
+            reason = f"killed by {_signal_name(signum)}"
+        else:
+            reason = f"exit code {exitcode}"
+        if self._crashed:
+            reason = f"{self._crashed}, {reason}"
+        self._crashed = reason
+        self._death = WorkerDiedError(f"Worker died: {reason}", exitcode=exitcode, signal=signum, stats=stats)
+
+    def _exit_stats(self):
+        return _exit_stats(self.process.pid)
+
+    def _dispatch_callback(self, callback_id, func_name, args):
+        """
+        Runs a callback requested by the worker and routes its response back
+        by callback ID. With an executor the result is sent from the executor
+        once ready, so this thread keeps handling worker messages meanwhile.
+        """
+        func = self.callbacks.get(func_name)
+        if func is None:
+            self._send_callback_result(callback_id, f"Callback '{func_name}' not found")
+            return
+
+        executor = self.callback_executor
+        if executor is None:
+            try:
+                # Execute callback with unpacked args
+                response = func(*args)
+            except Exception as e:
+                response = f"Error in callback {func_name}: {e}"
+            self._send_callback_result(callback_id, response)
+            return
+
+        if isinstance(executor, asyncio.AbstractEventLoop):
+            future = asyncio.run_coroutine_threadsafe(_invoke_async(func, args), executor)
+        else:
+            future = executor.submit(func, *args)
+
+        def on_done(fut):
+            try:
+                response = fut.result()
+            except Exception as e:
+                response = f"Error in callback {func_name}: {e}"
+            self._send_callback_result(callback_id, response)
+        future.add_done_callback(on_done)
+
+    def _send_callback_result(self, callback_id, response):
+        if self.capture is not None:
+            # The worker runs one request at a time: the oldest pending one
+            with self._pending_lock:
+                running = next(iter(self._pending.values()), None)
+            if running is not None and running.capture is not None:
+                running.capture.add_response(response)
+        try:
+            self._send(('CALLBACK_RESULT', callback_id, response, None))
+        except (OSError, ValueError):
+            pass # Worker is gone; its death is reported to the waiters
+
+    def execute(self, script, timeout=None):
         """
         Executes script.
         """
-        self.cmd_queue.put(('EXECUTE', script))
-        return self._wait_for_result()
+        return self._wait_for_result(self._submit('EXECUTE', script, timeout))
 
-    def call(self, func_name, *args):
+    def call(self, func_name, *args, timeout=None):
         """
         Calls a global Lua function with arguments.
         """
-        self.cmd_queue.put(('CALL', (func_name, args)))
-        return self._wait_for_result()
+        return self._wait_for_result(self._submit('CALL', (func_name, args), timeout))
+
+    def call_batch(self, func_name, arg_lists, timeout=None):
+        """
+        Calls a global Lua function once per argument tuple in one round
+        trip. Returns a list of (True, result) or (False, error message)
+        pairs; a deadline or cancellation fails the whole batch.
+        """
+        return self._wait_for_result(self._submit(
+            'CALL_BATCH', (func_name, [tuple(args) for args in arg_lists]), timeout))
+
+    def pipeline(self, stages, *args, timeout=None):
+        """
+        Calls the global functions named in stages in turn inside the
+        worker: the first with args, each next one with every value the
+        previous one returned. Returns the first value of the last stage.
+        The instruction limit covers the pipeline as a whole.
+        """
+        return self._wait_for_result(self._submit('PIPELINE', (list(stages), args), timeout))
 
-    def function_exists(self, func_name):
+    def pipeline_batch(self, stages, arg_lists, timeout=None):
+        """
+        Runs the pipeline once per argument tuple in one round trip, each
+        run with its own instruction budget. Returns (True, result) or
+        (False, error message) pairs, like call_batch.
+        """
+        return self._wait_for_result(self._submit(
+            'PIPELINE_BATCH', (list(stages), [tuple(args) for args in arg_lists]), timeout))
+
+    def function_exists(self, func_name, timeout=None):
         """
         Checks if a global Lua function exists.
         """
-        self.cmd_queue.put(('FUNCTION_EXISTS', func_name))
-        return self._wait_for_result()
+        return self._wait_for_result(self._submit('FUNCTION_EXISTS', func_name, timeout))
+
+    def set_globals(self, mapping, timeout=None):
+        """
+        Assigns several globals in one round trip. Values may be None, bool,
+        int, float, str, or dicts/lists/tuples of those (converted to tables).
+        """
+        self._wait_for_result(self._submit('SET_GLOBALS', mapping, timeout))
+
+    def get_globals(self, names, timeout=None):
+        """
+        Returns {name: value} for several globals in one round trip. Tables
+        come back as lists (sequences) or dicts; missing globals are None.
+        """
+        return self._wait_for_result(self._submit('GET_GLOBALS', list(names), timeout))
+
+    def set_context(self, mapping, name='context', timeout=None):
+        """
+        Installs mapping as the read-only global table `name`. The worker
+        keeps it for every later request until it is replaced, so a context
+        shared by many calls is sent and built once.
+        """
+        self._wait_for_result(self._submit('SET_CONTEXT', (mapping, name), timeout))
+
+    def submit(self, method, *args, timeout=None):
+        """
+        Starts execute/call/function_exists, returning a concurrent.futures.Future.
+        Needs a reactor.
+        """
+        self._require_reactor()
+        cmd, build = _COMMANDS[method]
+        return self._submit(cmd, build(*args), timeout)
+
+    def execute_async(self, script, timeout=None):
+        """
+        Executes script, returning a concurrent.futures.Future. Needs a reactor.
+        """
+        return self.submit('execute', script, timeout=timeout)
+
+    def call_async(self, func_name, *args, timeout=None):
+        """
+        Calls a global Lua function, returning a Future. Needs a reactor.
+        """
+        return self.submit('call', func_name, *args, timeout=timeout)
+
+    def function_exists_async(self, func_name, timeout=None):
+        """
+        Checks if a global Lua function exists, returning a Future. Needs a reactor.
+        """
+        return self.submit('function_exists', func_name, timeout=timeout)
+
+    def _require_reactor(self):
+        if self.reactor is None:
+            raise RuntimeError("Asynchronous calls need a reactor (pass reactor=...)")
 
     def close(self):
-        self.cmd_queue.put(('STOP', None))
+        self.on_death = None
+        try:
+            self._send(('STOP', None, None, None))
+        except (OSError, ValueError):
+            pass
         self.process.join()
+        if self.reactor is not None:
+            self.reactor.unregister(self)
+        self._fail_pending(WorkerDiedError("Worker closed"))
+        self._conn.close()
+
+
+def run_worker(conn, memory_limit=None, callback_names=(), instruction_limit=None,
+               uid=None, gid=None, full_isolation=False, cpu_limit=None, safe_load=False,
+               readonly_libs=False):
+    """
+    Runs the worker side of the protocol on conn in the calling process, for
+    workers not started by an IsolatedLuaVM (see luaward.remote).
+    """
+    worker = object.__new__(IsolatedLuaVM) # Worker methods need no parent state
+    worker._worker_loop(conn, memory_limit, list(callback_names), instruction_limit,
+                        uid, gid, full_isolation, cpu_limit, safe_load=safe_load,
+                        readonly_libs=readonly_libs)
+
+
+class InProcessLuaVM(IsolatedLuaVM):
+    """
+    IsolatedLuaVM with isolation='inprocess': the _luaward.LuaVM runs in the
+    calling process, without IPC. Memory and instruction limits, deadlines
+    and callback semantics are those of the process mode; crash containment,
+    cpu_limit, privilege dropping and seccomp are not available, so this mode
+    is only for trusted scripts.
+
+    Requests are serialized. Synchronous methods run on the calling thread;
+    submitted requests run on a thread of the VM's own, so a long script or
+    a blocking callback never holds up the reactor the VM is attached to.
+    """
+
+    def __init__(self, memory_limit=None, callbacks=None, instruction_limit=None,
+                 uid=None, gid=None, full_isolation=False,
+                 cpu_limit=None, callback_executor=None, reactor=None,
+                 default_timeout=None, cancel_grace=1.0, isolation=None, capture=None,
+                 slow_log=None, channels=None, safe_load=False, optimizer=None):
+        ignored = [name for name, value in (('uid', uid), ('gid', gid), ('cpu_limit', cpu_limit),
+                                            ('full_isolation', full_isolation)) if value]
+        if ignored:
+            logger.warning(f"In-process VM ignores {', '.join(ignored)}")
+        self.isolation = 'inprocess'
+        self.callbacks = callbacks or {}
+        self.callback_executor = callback_executor
+        self.default_timeout = default_timeout
+        self.cancel_grace = cancel_grace
+        self.last_stats = None
+        self.on_death = None # Never called: there is no worker to lose
+        self.process = None
+        self.reactor = reactor
+        self.logger = logger
+        self._lock = threading.Lock()
+        self._pending_lock = threading.Lock()
+        self._pending = {}
+        self._idle_waiters = []
+        self._arg_cache = ArgCache()
+        self.capture = capture
+        self.slow_log = slow_log
+        self.channels = channels or {}
+        self.safe_load = safe_load
+        self.optimizer = optimizer
+        self.readonly_libs = optimizer is not None and optimizer.hoist
+        self._capturing = None # CaptureEntry of the running request
+        self._profiling = 0 # Stack sampling interval set on the VM
+        self._counting = False # Whether the VM counts instructions for the slow log
+        self._runner = None # Executor running submitted requests, started on first use
+        if capture is not None:
+            self._capture_id = capture.register_vm(memory_limit, instruction_limit, list(self.callbacks))
+
+        proxies = {name: self._wrap_callback(name, func) for name, func in self.callbacks.items()}
+        self._vm = self._init_vm(memory_limit, instruction_limit, proxies, self.channels, safe_load,
+                                 self.readonly_libs)
+
+    def _wrap_callback(self, func_name, func):
+        # Same contract as the process mode: errors become the callback's
+        # string result, and callbacks run on the callback_executor if any
+        def callback(*args):
+            try:
+                executor = self.callback_executor
+                if executor is None:
+                    result = func(*args)
+                elif isinstance(executor, asyncio.AbstractEventLoop):
+                    result = asyncio.run_coroutine_threadsafe(_invoke_async(func, args), executor).result()
+                else:
+                    result = executor.submit(func, *args).result()
+            except Exception as e:
+                result = f"Error in callback {func_name}: {e}"
+            if self._capturing is not None:
+                self._capturing.add_response(result)
+            return result
+        return callback
+
+    def _run(self, cmd, payload, deadline):
+        if cmd == 'EXECUTE' and self.optimizer is not None:
+            payload = self.optimizer.optimize(payload)
+        with self._lock:
+            if self._vm is None:
+                raise RuntimeError("Lua VM is closed")
+            if deadline is not None and time.monotonic() >= deadline:
+                raise DeadlineExceededError("Deadline exceeded before start")
+            self._vm.set_deadline(deadline)
+            if self.capture is not None:
+                timeout = None if deadline is None else deadline - time.monotonic()
+                self._capturing = self.capture.begin(self._capture_id, cmd, payload, timeout)
+            slow = self.slow_log.thresholds if self.slow_log is not None and cmd in _MEASURED else None
+            if slow is not None and slow['profile'] != self._profiling:
+                self._profiling = slow['profile']
+                self._vm.set_profiling(self._profiling)
+            if slow is not None and (slow['instructions'] is not None) != self._counting:
+                self._counting = slow['instructions'] is not None
+                self._vm.set_counting(self._counting)
+            started = time.monotonic()
+            try:
+                result = self._run_command(self._vm, cmd, payload)
+            except Exception as e:
+                # Judged by the clock, not the message: a deadline hit in a
+                # nested frame or a channel wait carries a position prefix.
+                # The process mode reports every other error as RuntimeError.
+                if deadline is not None and time.monotonic() >= deadline:
+                    error = DeadlineExceededError("Request exceeded its deadline")
+                else:
+                    error = RuntimeError(str(e))
+            else:
+                error = None
+            finally:
+                self._vm.set_deadline(None)
+                self.last_stats = self._vm.stats()
+            if slow is not None:
+                report = slow_report(slow, time.monotonic() - started, self.last_stats,
+                                     self._vm.take_profile() if self._profiling else None)
+                if report is not None:
+                    self.slow_log.record(cmd, payload, report)
+            if self._capturing is not None:
+                self._capturing.finish(error is None, error if error else result)
+                self._capturing = None
+            if error is not None:
+                raise error
+            return result
+
+    def _deadline(self, timeout):
+        if timeout is None:
+            timeout = self.default_timeout
+        return None if timeout is None else time.monotonic() + timeout
+
+    def execute(self, script, timeout=None):
+        return self._run('EXECUTE', script, self._deadline(timeout))
+
+    def call(self, func_name, *args, timeout=None):
+        return self._run('CALL', (func_name, args), self._deadline(timeout))
+
+    def call_batch(self, func_name, arg_lists, timeout=None):
+        return self._run('CALL_BATCH', (func_name, [tuple(args) for args in arg_lists]),
+                         self._deadline(timeout))
+
+    def pipeline(self, stages, *args, timeout=None):
+        return self._run('PIPELINE', (list(stages), args), self._deadline(timeout))
+
+    def pipeline_batch(self, stages, arg_lists, timeout=None):
+        return self._run('PIPELINE_BATCH', (list(stages), [tuple(args) for args in arg_lists]),
+                         self._deadline(timeout))
+
+    def function_exists(self, func_name, timeout=None):
+        return self._run('FUNCTION_EXISTS', func_name, self._deadline(timeout))
+
+    def set_globals(self, mapping, timeout=None):
+        self._run('SET_GLOBALS', mapping, self._deadline(timeout))
+
+    def get_globals(self, names, timeout=None):
+        return self._run('GET_GLOBALS', list(names), self._deadline(timeout))
+
+    def set_context(self, mapping, name='context', timeout=None):
+        self._run('SET_CONTEXT', (mapping, name), self._deadline(timeout))
+
+    def submit(self, method, *args, timeout=None):
+        self._require_reactor()
+        cmd, build = _COMMANDS[method]
+        payload, deadline = build(*args), self._deadline(timeout)
+        future = concurrent.futures.Future()
+
+        def run():
+            if not future.set_running_or_notify_cancel():
+                return
+            try:
+                _settle(future, result=self._run(cmd, payload, deadline))
+            except Exception as e:
+                _settle(future, exc=e)
+        with self._pending_lock:
+            if self._runner is None:
+                self._runner = concurrent.futures.ThreadPoolExecutor(
+                    max_workers=1, thread_name_prefix="luaward-inprocess")
+            self._runner.submit(run)
+        return future
+
+    def cancel_request(self, req_id):
+        pass # Deadlines are enforced inside the VM
+
+    @property
+    def alive(self):
+        return self._vm is not None
+
+    @property
+    def pid(self):
+        return os.getpid()
+
+    def close(self):
+        with self._pending_lock:
+            runner, self._runner = self._runner, None
+        if runner is not None:
+            runner.shutdown(wait=False) # Requests still queued fail on the closed VM
+        with self._lock:
+            self._arg_cache.clear()
+            self._vm = None
+
+
+async def _invoke_async(func, args):
+    # Coroutine callbacks are awaited on the loop, plain ones are called on it.
+    result = func(*args)
+    if inspect.isawaitable(result):
+        result = await result
+    return result
+
+
+def _settle(future, result=None, exc=None):
+    # Futures can be settled concurrently (response vs deadline vs death);
+    # the first outcome wins and later ones are dropped.
+    try:
+        if exc is not None:
+            future.set_exception(exc)
+        else:
+            future.set_result(result)
+    except concurrent.futures.InvalidStateError:
+        pass
+
+
+def _signal_name(signum):
+    try:
+        return signal.Signals(signum).name
+    except ValueError:
+        return f"signal {signum}"
+
+
+def _exit_stats(pid):
+    # CPU time of an exited but not yet reaped worker, read from /proc
+    try:
+        with open(f"/proc/{pid}/stat") as f:
+            fields = f.read().rsplit(')', 1)[1].split()
+        ticks = os.sysconf('SC_CLK_TCK')
+        return {'cpu_user': int(fields[11]) / ticks, 'cpu_system': int(fields[12]) / ticks}
+    except (OSError, ValueError, IndexError):
+        return {}
@@ -0,0 +1,555 @@
+import re
+import math
+import threading
+import collections
+
+# Library fields the sandbox provides (see the whitelists and extras in luaward.c)
+LIBRARIES = {
+    'string': ('byte', 'char', 'find', 'format', 'gmatch', 'gsub', 'len', 'lower',
+               'match', 'rep', 'reverse', 'sub', 'upper',
+               'split', 'trim', 'startswith', 'endswith', 'replace', 'join'),
+    'math': ('abs', 'acos', 'asin', 'atan', 'ceil', 'cos', 'deg', 'exp', 'floor',
+             'fmod', 'huge', 'log', 'max', 'min', 'modf', 'pi', 'rad', 'random',
+             'randomseed', 'sin', 'sqrt', 'tan', 'tointeger', 'type', 'ult'),
+    'table': ('concat', 'insert', 'move', 'pack', 'remove', 'sort', 'unpack', 'new', 'clear'),
+    'utf8': ('char', 'codes', 'codepoint', 'len', 'offset'),
+}
+
+# Names through which a script can reach globals without naming them
+DYNAMIC_NAMES = ('_ENV', '_G', 'load')
+
+# Hoisted locals share the main chunk's local slots with the script
+MAX_LOCALS = 200
+MAX_HOISTED = 40
+# Hidden locals a for loop keeps besides its variables
+FOR_STATE = 4
+HOIST_PREFIX = '__lw_'
+
+KEYWORDS = frozenset((
+    'and', 'break', 'do', 'else', 'elseif', 'end', 'false', 'for', 'function', 'goto', 'if',
+    'in', 'local', 'nil', 'not', 'or', 'repeat', 'return', 'then', 'true', 'until', 'while'))
+
+# Binary operators: precedence, right associative
+BINARY = {
+    'or': (1, False), 'and': (2, False),
+    '<': (3, False), '>': (3, False), '<=': (3, False), '>=': (3, False), '~=': (3, False), '==': (3, False),
+    '|': (4, False), '~': (5, False), '&': (6, False), '<<': (7, False), '>>': (7, False),
+    '..': (9, True), '+': (10, False), '-': (10, False),
+    '*': (11, False), '/': (11, False), '//': (11, False), '%': (11, False),
+    '^': (14, True),
+}
+UNARY_PRECEDENCE = 12
+FOLDED = ('+', '-', '*', '/', '//', '%', '^')
+
+_TOKEN = re.compile(r'''
+    (?P<space>\s+)
+  | (?P<long>--\[=*\[|\[=*\[)
+  | (?P<comment>--[^\n\r]*)
+  | (?P<name>[A-Za-z_][A-Za-z0-9_]*)
+  | (?P<number>0[xX](?:[0-9a-fA-F]*\.?[0-9a-fA-F]*)(?:[pP][+-]?[0-9]+)?
+              |(?:[0-9]+\.?[0-9]*|\.[0-9]+)(?:[eE][+-]?[0-9]+)?)
+  | (?P<quote>["'])
+  | (?P<op>\.\.\.|\.\.|==|~=|<=|>=|<<|>>|//|::|[-+*/%^#&~|<>=(){}\[\];:,.])
+''', re.VERBOSE)
+_NEWLINE = re.compile(r'\r\n|\n\r|\n|\r')
+_WORD = re.compile(r'[A-Za-z0-9_.]')
+
+
+class _Untokenizable(Exception):
+    pass
+
+
+class _Token:
+    __slots__ = ('kind', 'text', 'start', 'end', 'value', 'replaced')
+
+    def __init__(self, kind, text, start, end, value=None, replaced=False):
+        self.kind = kind # name, keyword, number, string or op
+        self.text = text
+        self.start = start
+        self.end = end
+        self.value = value # Number tokens: their Lua value
+        self.replaced = replaced
+
+
+class Optimizer:
+    """
+    Source-to-source pass applied to scripts before they are compiled, so
+    hot code pays fewer _ENV lookups. Pass it to IsolatedLuaVM (or a pool)
+    as optimizer=; execute() scripts then go through optimize().
+
+    *   Reads of sandbox library fields (`string.format`, `math.floor`...)
+        are hoisted into locals declared at the top of the chunk, as many
+        as the main chunk has local slots to spare.
+    *   Names given in `constants` are replaced by their value wherever the
+        script reads them as globals. Values may be None, bools, numbers
+        (finite, 64-bit integers) and strings.
+    *   Arithmetic on number literals is folded, following Lua's integer and
+        float rules.
+
+    A name is left alone if the script declares or assigns it anywhere, and
+    nothing is hoisted or inlined in scripts that mention _ENV, _G or load.
+    VMs given a hoisting optimizer serve the library tables read-only, so
+    the functions kept in hoisted locals, and in the closures capturing
+    them, are the ones the libraries hold; base functions live in writable
+    globals and are never hoisted. Line numbers in error messages are unchanged.
+    Results are cached by source, up to `cache_size` scripts.
+    """
+
+    def __init__(self, constants=None, hoist=True, fold=True, cache_size=256):
+        self.constants = {name: _literal(value) for name, value in (constants or {}).items()}
+        self.hoist = hoist
+        self.fold = fold
+        self.cache_size = cache_size
+        self._cache = collections.OrderedDict()
+        self._lock = threading.Lock()
+
+    def optimize(self, source):
+        with self._lock:
+            if source in self._cache:
+                self._cache.move_to_end(source)
+                return self._cache[source]
+        try:
+            result = self._optimize(source)
+        except _Untokenizable:
+            result = source # Lua reports the syntax error
+        with self._lock:
+            self._cache[source] = result
+            if len(self._cache) > self.cache_size:
+                self._cache.popitem(last=False)
+        return result
+
+    def _optimize(self, source):
+        tokens = _tokenize(source)
+        roles, names = _scan(tokens)
+        dynamic = any(name in names for name in DYNAMIC_NAMES)
+
+        if self.constants and not dynamic:
+            for name, literal in self.constants.items():
+                uses = names.get(name, ())
+                if all(roles[i] == 'read' and not _postfix(tokens, i + 1) for i in uses):
+                    kind, text, value = literal
+                    for i in uses:
+                        tokens[i] = _Token(kind, text, tokens[i].start, tokens[i].end, value, replaced=True)
+        if self.fold:
+            tokens = _fold(tokens)
+        prologue = ''
+        if self.hoist and not dynamic and not any(name.startswith(HOIST_PREFIX) for name in names):
+            tokens, prologue = _hoist(tokens, *_scan(tokens))
+        return prologue + _render(source, tokens)
+
+
+def optimize(source, constants=None):
+    """Optimizes one script; see Optimizer."""
+    return Optimizer(constants, cache_size=0).optimize(source)
+
+
+def _literal(value):
+    # (kind, text, value) of the token replacing a constant
+    if value is None or isinstance(value, bool):
+        return ('keyword', {None: 'nil', True: 'true', False: 'false'}[value], None)
+    if isinstance(value, int):
+        if not -2**63 < value < 2**63:
+            raise ValueError(f"Constant {value} does not fit a Lua integer")
+        return ('number', str(value) if value >= 0 else f"({value})", value)
+    if isinstance(value, float):
+        if not math.isfinite(value):
+            raise ValueError(f"Constant {value} has no Lua literal")
+        return ('number', repr(value) if value >= 0 else f"({value!r})", value)
+    if isinstance(value, str):
+        value = value.encode()
+    if isinstance(value, bytes):
+        text = ''.join(chr(b) if 32 <= b < 127 and b not in b'"\\' else f"\\{b:03d}" for b in value)
+        return ('string', f'"{text}"', None)
+    raise TypeError(f"Cannot inline a constant of type {type(value).__name__}")
+
+
+def _tokenize(source):
+    tokens = []
+    pos = 0
+    while pos < len(source):
+        m = _TOKEN.match(source, pos)
+        if m is None:
+            raise _Untokenizable(pos)
+        kind = m.lastgroup
+        if kind == 'long':
+            level = m.group().count('=')
+            close = source.find(']' + '=' * level + ']', m.end())
+            if close < 0:
+                raise _Untokenizable(pos)
+            end = close + level + 2
+            if not m.group().startswith('--'):
+                tokens.append(_Token('string', source[pos:end], pos, end))
+            pos = end
+            continue
+        if kind == 'quote':
+            end = _string_end(source, m.end(), m.group())
+            tokens.append(_Token('string', source[pos:end], pos, end))
+            pos = end
+            continue
+        text = m.group()
+        if kind == 'number':
+            if _WORD.match(source, m.end()) and source[m.end()] != '.' or source.startswith('..', m.end()):
+                raise _Untokenizable(pos) # Malformed number
+            tokens.append(_Token('number', text, pos, m.end(), _number(text)))
+        elif kind == 'name':
+            tokens.append(_Token('keyword' if text in KEYWORDS else 'name', text, pos, m.end()))
+        elif kind == 'op':
+            tokens.append(_Token('op', text, pos, m.end()))
+        pos = m.end()
+    return tokens
+
+
+def _string_end(source, pos, quote):
+    while pos < len(source):
+        c = source[pos]
+        if c == quote:
+            return pos + 1
+        if c == '\\':
+            pos += 2
+            continue
+        if c in '\r\n':
+            break
+        pos += 1
+    raise _Untokenizable(pos)
+
+
+def _number(text):
+    # The value Lua gives a numeral, or None for those not folded
+    lower = text.lower()
+    if lower.startswith('0x'):
+        if '.' in lower or 'p' in lower:
+            return None
+        return _wrap(int(lower, 16))
+    if '.' in lower or 'e' in lower:
+        return float(text)
+    value = int(text)
+    return value if value < 2**63 else float(text)
+
+
+def _wrap(value):
+    return (value + 2**63) % 2**64 - 2**63
+
+
+def _is_op(tokens, k, *texts):
+    return 0 <= k < len(tokens) and tokens[k].kind == 'op' and tokens[k].text in texts
+
+
+def _operand_end(tok):
+    # Whether tok can end an operand, making a following - or ~ binary
+    if tok.kind in ('name', 'number', 'string'):
+        return True
+    if tok.kind == 'keyword':
+        return tok.text in ('true', 'false', 'nil', 'end')
+    return tok.text in (')', ']', '}', '...')
+
+
+def _postfix(tokens, k):
+    # Whether tokens[k] continues the preceding operand (index, call, method)
+    if k >= len(tokens):
+        return False
+    return tokens[k].kind == 'string' or _is_op(tokens, k, '.', ':', '[', '(', '{')
+
+
+def _declared(tokens):
+    # Indices of names declared by local, for, function, goto and labels
+    decl = set()
+    n = len(tokens)
+    is_name = lambda k: k < n and tokens[k].kind == 'name'
+    for j, tok in enumerate(tokens):
+        if tok.text == 'local' and tok.kind == 'keyword':
+            k = j + 1
+            while is_name(k):
+                decl.add(k)
+                k += 1
+                if _is_op(tokens, k, '<'):
+                    k += 3 # <const> or <close>
+                if not _is_op(tokens, k, ','):
+                    break
+                k += 1
+        elif tok.text == 'for' and tok.kind == 'keyword':
+            k = j + 1
+            while is_name(k):
+                decl.add(k)
+                if not _is_op(tokens, k + 1, ','):
+                    break
+                k += 2
+        elif tok.text == 'function' and tok.kind == 'keyword':
+            k = j + 1
+            if is_name(k):
+                decl.add(k)
+                k += 1
+                while _is_op(tokens, k, '.', ':') and is_name(k + 1):
+                    k += 2
+            if _is_op(tokens, k, '('):
+                k += 1
+                while is_name(k) or _is_op(tokens, k, ',', '...'):
+                    if is_name(k):
+                        decl.add(k)
+                    k += 1
+        elif tok.text == 'goto' and tok.kind == 'keyword' and is_name(j + 1):
+            decl.add(j + 1)
+        elif _is_op(tokens, j, '::') and is_name(j + 1) and _is_op(tokens, j + 2, '::'):
+            decl.add(j + 1)
+    return decl
+
+
+def _assigned(tokens, i):
+    # Whether the operand ending at tokens[i] is an assignment target:
+    # followed by = or by a list of variables leading to =
+    if _is_op(tokens, i + 1, '='):
+        return True
+    if not _is_op(tokens, i + 1, ','):
+        return False
+    depth = 0
+    for tok in tokens[i + 1:]:
+        if tok.kind == 'op' and tok.text in ('(', '[', '{'):
+            depth += 1
+        elif tok.kind == 'op' and tok.text in (')', ']', '}'):
+            if depth == 0:
+                return False
+            depth -= 1
+        elif depth:
+            continue
+        elif tok.kind == 'op' and tok.text == '=':
+            return True
+        elif tok.kind not in ('name', 'string') and tok.text not in (',', '.', ':'):
+            return False
+    return False
+
+
+def _roles(tokens):
+    # Role of each name token: field (after . or :), key (in a table
+    # constructor), decl, write or read. Other tokens get None.
+    roles = [None] * len(tokens)
+    decl = _declared(tokens)
+    stack = [] # Open brackets and blocks
+    for i, tok in enumerate(tokens):
+        if tok.kind == 'op' and tok.text in ('(', '[', '{'):
+            stack.append(tok.text)
+        elif tok.kind == 'op' and tok.text in (')', ']', '}'):
+            if stack:
+                stack.pop()
+        elif tok.kind == 'keyword' and tok.text in ('function', 'do', 'if', 'repeat'):
+            stack.append(tok.text)
+        elif tok.kind == 'keyword' and tok.text in ('end', 'until'):
+            if stack:
+                stack.pop()
+        elif tok.kind == 'name':
+            if _is_op(tokens, i - 1, '.', ':'):
+                roles[i] = 'field'
+            elif i in decl:
+                roles[i] = 'decl'
+            elif (stack and stack[-1] == '{' and _is_op(tokens, i - 1, '{', ',', ';')
+                  and _is_op(tokens, i + 1, '=')):
+                roles[i] = 'key'
+            elif _assigned(tokens, i):
+                roles[i] = 'write'
+            else:
+                roles[i] = 'read'
+    return roles
+
+
+def _scan(tokens):
+    # Roles, and indices of the names used as variables by name
+    roles = _roles(tokens)
+    names = collections.defaultdict(list)
+    for i, tok in enumerate(tokens):
+        if tok.kind == 'name' and roles[i] not in ('field', 'key'):
+            names[tok.text].append(i)
+    return roles, names
+
+
+def _operator(tokens, k):
+    # (precedence, right associative) of the operator at tokens[k], or None
+    if not 0 <= k < len(tokens) or tokens[k].kind not in ('op', 'keyword'):
+        return None
+    text = tokens[k].text
+    if text in ('not', '#') or (text in ('-', '~') and not (k > 0 and _operand_end(tokens[k - 1]))):
+        return (UNARY_PRECEDENCE, True)
+    return BINARY.get(text)
+
+
+def _arith(op, a, b):
+    # Lua 5.4 arithmetic on two numbers; None where folding is not exact
+    if isinstance(a, int) and isinstance(b, int) and op in ('+', '-', '*', '//', '%'):
+        if op in ('//', '%') and b == 0:
+            return None # Runtime error in Lua
+        if op == '+':
+            return _wrap(a + b)
+        if op == '-':
+            return _wrap(a - b)
+        if op == '*':
+            return _wrap(a * b)
+        return _wrap(a // b if op == '//' else a % b)
+    a, b = float(a), float(b)
+    try:
+        if op == '+':
+            result = a + b
+        elif op == '-':
+            result = a - b
+        elif op == '*':
+            result = a * b
+        elif op == '/':
+            result = a / b
+        elif op == '//':
+            result = float(math.floor(a / b))
+        elif op == '%':
+            result = math.fmod(a, b)
+            if (b < 0 if result > 0 else result < 0 and b != result):
+                result += b
+        else:
+            result = a * a if b == 2 else math.pow(a, b)
+    except (ZeroDivisionError, ValueError, OverflowError):
+        return None
+    return result if math.isfinite(result) else None
+
+
+def _number_text(value):
+    if isinstance(value, int):
+        return None if value == -2**63 else str(value)
+    return repr(value)
+
+
+def _fold(tokens):
+    changed = True
+    while changed:
+        changed = False
+        i = 0
+        while i < len(tokens):
+            tok = tokens[i]
+            # (number): drop the parentheses unless they make a call or the
+            # sign would change what a following operator applies to
+            if (_is_op(tokens, i, '(') and i + 2 < len(tokens) and tokens[i + 1].value is not None
+                    and _is_op(tokens, i + 2, ')') and not tokens[i + 1].text.startswith(('-', '('))
+                    and not (i > 0 and _operand_end(tokens[i - 1])) and not _postfix(tokens, i + 3)):
+                inner = tokens[i + 1]
+                tokens[i:i + 3] = [_Token('number', inner.text, tok.start, tokens[i + 2].end,
+                                          inner.value, replaced=True)]
+                changed = True
+                continue
+            if (tok.value is not None and i + 2 < len(tokens) and _is_op(tokens, i + 1, *FOLDED)
+                    and tokens[i + 2].value is not None):
+                op = tokens[i + 1].text
+                prec, right = BINARY[op]
+                before, after = _operator(tokens, i - 1), _operator(tokens, i + 3)
+                fits = ((before is None or before[0] < prec or (before[0] == prec and right))
+                        and (after is None or after[0] < prec or (after[0] == prec and not right))
+                        and not _postfix(tokens, i + 3))
+                result = _arith(op, tok.value, tokens[i + 2].value) if fits else None
+                text = None if result is None else _number_text(result)
+                if text is not None:
+                    tokens[i:i + 3] = [_Token('number', text, tok.start, tokens[i + 2].end,
+                                              result, replaced=True)]
+                    changed = True
+                    continue
+            i += 1
+    return tokens
+
+
+def _main_locals(tokens):
+    # Most locals the main chunk has active at once, for loops' hidden
+    # state included
+    active = peak = 0
+    stack = [] # (opening keyword, locals active before it)
+    pending = 0 # Variables of a for loop, active from its do
+    for j, tok in enumerate(tokens):
+        if tok.kind != 'keyword':
+            continue
+        text = tok.text
+        if text in ('function', 'do', 'if', 'repeat'):
+            stack.append((text, active))
+            if text == 'do':
+                active += pending
+                pending = 0
+        elif text in ('end', 'until'):
+            if stack:
+                active = stack.pop()[1]
+        elif text in ('else', 'elseif'):
+            if stack:
+                active = stack[-1][1]
+        elif any(kind == 'function' for kind, _ in stack):
+            continue
+        elif text == 'local':
+            k = j + 1
+            if k < len(tokens) and tokens[k].text == 'function':
+                active += 1
+            while k < len(tokens) and tokens[k].kind == 'name':
+                active += 1
+                k += 4 if _is_op(tokens, k + 1, '<') else 1 # <const> or <close>
+                if not _is_op(tokens, k, ','):
+                    break
+                k += 1
+        elif text == 'for':
+            k = j + 1
+            pending = FOR_STATE
+            while k < len(tokens) and tokens[k].kind == 'name':
+                pending += 1
+                if not _is_op(tokens, k + 1, ','):
+                    break
+                k += 2
+        peak = max(peak, active)
+    return peak
+
+
+def _hoist(tokens, roles, names):
+    # Picks the library fields safe to hoist, most used first, as many as
+    # the main chunk has local slots for, and replaces their reads with locals
+    room = min(MAX_HOISTED, MAX_LOCALS - _main_locals(tokens))
+    if room <= 0:
+        return tokens, ''
+    uses = collections.Counter()
+    for lib, fields in LIBRARIES.items():
+        indices = names.get(lib, ())
+        if not all(roles[i] == 'read' and _is_op(tokens, i + 1, '.') and i + 2 < len(tokens)
+                   and tokens[i + 2].text in fields and not _assigned(tokens, i + 2) for i in indices):
+            continue
+        for i in indices:
+            uses[(lib, tokens[i + 2].text)] += 1
+    hoisted = {key: HOIST_PREFIX + '_'.join(key) for key, count in uses.most_common(room)}
+    if not hoisted:
+        return tokens, ''
+
+    result = []
+    i = 0
+    while i < len(tokens):
+        tok = tokens[i]
+        key = None
+        if tok.kind == 'name' and roles[i] == 'read' and tok.text in LIBRARIES and i + 2 < len(tokens):
+            key = (tok.text, tokens[i + 2].text)
+        if key in hoisted:
+            result.append(_Token('name', hoisted[key], tok.start, tokens[i + 2].end, replaced=True))
+            i += 3
+            continue
+        result.append(tok)
+        i += 1
+    names = ', '.join(hoisted.values())
+    values = ', '.join('.'.join(key) for key in hoisted)
+    return result, f"local {names} = {values}; "
+
+
+def _render(source, tokens):
+    # Rebuilds the source around replaced tokens, keeping the newlines they
+    # covered so line numbers do not move
+    out = []
+    last = ''
+    pos = 0
+    for tok in tokens:
+        if not tok.replaced:
+            continue
+        gap = source[pos:tok.start]
+        if gap:
+            out.append(gap)
+            last = gap[-1]
+        text = tok.text
+        if (_WORD.match(last) and _WORD.match(text[0])) or (last == '-' and text[0] == '-'):
+            text = ' ' + text
+        newlines = len(_NEWLINE.findall(source, tok.start, tok.end))
+        if newlines:
+            text += '\n' * newlines
+        elif _WORD.match(text[-1]) and _WORD.match(source, tok.end):
+            text += ' '
+        out.append(text)
+        last = text[-1]
+        pos = tok.end
+    out.append(source[pos:])
+    return ''.join(out)
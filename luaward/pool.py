@@ -0,0 +1,898 @@
+import threading
+import time
+import heapq
+import hashlib
+import itertools
+import logging
+import collections
+import concurrent.futures
+from .isolated import IsolatedLuaVM, _settle
+from .remote import RemoteLuaVM
+from .reactor import Reactor
+from .cache import ResultCache
+from .routing import HashRing
+from .errors import WorkerDiedError, DeadlineExceededError, PoolOverloadedError
+
+logger = logging.getLogger("luaward.pool")
+
+# Priority classes, most urgent first
+PRIORITIES = {'interactive': 0, 'normal': 1, 'batch': 2}
+
+# Weight of the latest sample in the service time estimate
+SERVICE_TIME_ALPHA = 0.2
+
+# Delay before reconnecting to an unreachable host, doubled up to the maximum
+RECONNECT_DELAY = 1.0
+MAX_RECONNECT_DELAY = 60.0
+
+# Hedging: execution times kept per function, samples needed before its
+# quantile is trusted, and hedges that may be saved up while none is needed
+HEDGE_SAMPLES = 200
+HEDGE_MIN_SAMPLES = 20
+HEDGE_BURST = 5.0
+
+
+class _Request:
+    __slots__ = ('method', 'args', 'future', 'deadline', 'timer', 'queue',
+                 'priority', 'sort_key', 'submitted', 'started', 'members',
+                 'hedge', 'attempts')
+
+    _seq = itertools.count()
+
+    def __init__(self, method, args, deadline, priority):
+        self.method = method
+        self.args = args
+        self.future = concurrent.futures.Future()
+        self.deadline = deadline # time.monotonic() based, or None
+        self.timer = None
+        self.queue = None # Queue holding the request until dispatch
+        self.priority = priority
+        # Class first, then earliest deadline, then arrival order
+        self.sort_key = (priority, float('inf') if deadline is None else deadline,
+                         next(self._seq))
+        self.submitted = time.monotonic()
+        self.started = None
+        self.members = None # For a call_batch request, the call requests it carries
+        self.hedge = False # May be duplicated on a second worker
+        self.attempts = [] # (vm, vm future, start time) of each dispatch
+
+    def calls(self):
+        # How many calls the request stands for, in queue counts and timings
+        return len(self.members) if self.members else 1
+
+
+class _Latencies:
+    """Recent execution times of one function, for its hedging delay."""
+
+    def __init__(self):
+        self._samples = collections.deque(maxlen=HEDGE_SAMPLES)
+        self._sorted = None
+
+    def add(self, elapsed):
+        self._samples.append(elapsed)
+        self._sorted = None
+
+    def quantile(self, q):
+        if len(self._samples) < HEDGE_MIN_SAMPLES:
+            return None
+        if self._sorted is None:
+            self._sorted = sorted(self._samples)
+        return self._sorted[min(len(self._sorted) - 1, int(q * len(self._sorted)))]
+
+
+class _RequestQueue:
+    """
+    Heap of queued requests in scheduling order. Removal is lazy: a removed
+    request stays in the heap with its `queue` cleared and is skipped later.
+    """
+
+    def __init__(self):
+        self._heap = []
+        self._live = 0
+
+    def push(self, request):
+        request.queue = self
+        heapq.heappush(self._heap, (request.sort_key, request))
+        self._live += 1
+
+    def remove(self, request):
+        if request.queue is not self:
+            return False
+        request.queue = None
+        self._live -= 1
+        return True
+
+    def peek(self):
+        while self._heap and self._heap[0][1].queue is not self:
+            heapq.heappop(self._heap)
+        return self._heap[0][1] if self._heap else None
+
+    def pop(self):
+        request = self.peek()
+        if request is not None:
+            heapq.heappop(self._heap)
+            self.remove(request)
+        return request
+
+    def __len__(self):
+        return self._live
+
+    def __iter__(self):
+        return iter([r for _, r in self._heap if r.queue is self])
+
+
+class LuaVMPool:
+    """
+    A set of IsolatedLuaVM workers served by one reactor.
+
+    Requests are queued and handed to the next idle worker. `setup_script`
+    runs on every worker before it takes requests, so functions defined there
+    can be called on any of them. A worker that dies (RLIMIT_CPU, seccomp,
+    OOM killer, or a kill after ignoring a deadline) fails its request with
+    WorkerDiedError and is replaced.
+
+    Requests submitted with pure=True are deterministic by declaration:
+    identical ones in flight at the same time share a single execution, and
+    with a `result_cache` their results are reused until evicted or expired.
+
+    Routing: every worker occupies a slot on a consistent hash ring. Requests
+    with an affinity key (a tenant ID, an explicit key, or with affinity=True
+    the script hash of execute requests) queue on the slot the key hashes to,
+    so each worker compiles and caches a stable subset of scripts. When that
+    worker already has `spill_threshold` requests running or queued, the
+    request spills to the least-loaded worker instead. Sticky tenants always
+    go to the slot they were first bound to, because their state lives there.
+
+    Scheduling: queued requests are served by priority class ('interactive',
+    'normal', 'batch'), earliest deadline first within a class. Each class
+    holds at most `max_queue` requests; beyond that, or when the estimated
+    wait already exceeds a request's deadline, submit() rejects it at once.
+    With a `memory_budget`, the pool never runs more workers than the budget
+    divided by the per-VM `memory_limit`.
+
+    Autoscaling: with an `autoscale` ScalingPolicy the pool resizes itself
+    between the policy's min_size and max_size, checked every `interval`
+    seconds on the reactor thread. Only idle workers are retired. `spares`
+    workers are kept started and set up outside the pool so that growing
+    does not wait for a fork and the setup script.
+
+    Remote hosts: each RemoteHost in `hosts` contributes `workers` slots
+    served by RemoteLuaVM workers started by that host's agent. They take
+    requests like local workers. When a host becomes unreachable its slots
+    leave the hash ring, and the pool reconnects with exponential backoff.
+    `size`, autoscaling, spares and the memory budget concern local workers.
+
+    Micro-batching: with a `batch_window` (seconds), unrouted call requests
+    are held that long so that concurrent calls to the same function at the
+    same priority travel as one message, of at most `max_batch` calls, and
+    run back to back on one worker. A batch runs under its members' earliest
+    deadline.
+
+    Hedging: with a `hedge_quantile` (0.95 for p95), a pure call still
+    running after that quantile of its function's recent execution times is
+    sent again to an idle worker, or to the next one freed once the queues
+    are empty. The first success wins and the other copy is cancelled. At most `max_hedge_ratio` of pure calls are hedged.
+    """
+
+    def __init__(self, size=4, setup_script=None, reactor=None, default_timeout=None,
+                 result_cache=None, affinity=False, spill_threshold=2, max_queue=None,
+                 memory_budget=None, autoscale=None, spares=0, hosts=None,
+                 batch_window=None, max_batch=32, hedge_quantile=None, max_hedge_ratio=0.05,
+                 **vm_options):
+        self.max_workers = None
+        if memory_budget is not None:
+            memory_limit = vm_options.get('memory_limit')
+            if not memory_limit:
+                raise ValueError("memory_budget requires a per-VM memory_limit")
+            self.max_workers = memory_budget // memory_limit
+            if self.max_workers < 1:
+                raise ValueError("memory_budget is smaller than one VM's memory_limit")
+            if size > self.max_workers:
+                logger.warning(f"memory_budget allows {self.max_workers} workers, not {size}")
+                size = self.max_workers
+        if autoscale is not None:
+            size = min(max(size, autoscale.min_size), autoscale.max_size)
+        self.size = size
+        self.autoscale = autoscale
+        self.spares = spares
+        self.hosts = list(hosts or ())
+        self.memory_budget = memory_budget
+        self.max_queue = max_queue
+        self.setup_script = setup_script
+        self.default_timeout = default_timeout
+        self.result_cache = result_cache
+        self.affinity = affinity
+        self.spill_threshold = spill_threshold
+        self.batch_window = batch_window
+        self.max_batch = max_batch
+        self.hedge_quantile = hedge_quantile
+        self.max_hedge_ratio = max_hedge_ratio
+        self.hedged = 0 # Requests sent to a second worker
+        self.vm_options = vm_options
+        self._inflight = {} # cache key -> Future of the request doing the work
+
+        self._owns_reactor = reactor is None
+        self.reactor = reactor or Reactor()
+        self._lock = threading.Lock()
+        self._workers = {} # slot -> vm; a replacement worker keeps its slot
+        self._idle = {} # slot -> vm, in release order
+        self._queue = _RequestQueue() # requests any worker may take
+        self._local = {} # slot -> _RequestQueue of requests routed to that worker
+        self._queued = collections.Counter() # priority -> queued requests
+        self._service_time = None # moving average of execution time, seconds
+        self._sticky = {} # sticky tenant -> slot
+        self._ring = HashRing()
+        self._slots = itertools.count()
+        self._placement = {} # slot -> RemoteHost, for remote slots
+        self._vacant = set() # slots off the ring until a worker takes them
+        self._idle_since = {} # slot -> time.monotonic() of its last release
+        self._spare_vms = [] # set-up workers outside the pool
+        self._warming = set() # spares still starting
+        self._max_wait = 0.0 # longest queue wait since the last scaling tick
+        self._scale_timer = None
+        self._batches = {} # (func_name, priority) -> call requests held for batch_window
+        self._latencies = {} # func_name -> _Latencies of pure calls
+        self._hedge_budget = 1.0 # Hedges allowed now; grows by max_hedge_ratio per pure call
+        self._hedges = collections.deque() # Requests due a hedge, waiting for an idle worker
+        self._closed = False
+
+        for _ in range(size):
+            self._spawn(wait=True)
+        for host in self.hosts:
+            for _ in range(host.workers):
+                self._spawn(wait=True, host=host)
+        self._fill_spares()
+        if autoscale is not None:
+            self._scale_timer = self.reactor.call_later(autoscale.interval, self._autoscale)
+
+    def _spawn(self, wait=False, slot=None, spare=False, host=None, retry_delay=RECONNECT_DELAY):
+        if not spare:
+            with self._lock:
+                if slot is None:
+                    slot = next(self._slots)
+                    self._vacant.add(slot)
+                    if host is not None:
+                        self._placement[slot] = host
+                host = self._placement.get(slot)
+        try:
+            vm = self._new_worker(host)
+        except OSError as e:
+            if host is None:
+                raise
+            self._reconnect_later(slot, f"{host}: {e}", retry_delay)
+            return
+        vm.on_death = self._on_worker_death
+        with self._lock:
+            if self._closed:
+                vm.on_death = None
+            elif spare:
+                vm.pool_slot = None
+                self._warming.add(vm)
+            else:
+                if slot in self._vacant:
+                    self._vacant.discard(slot)
+                    self._ring.add(slot)
+                vm.pool_slot = slot
+                self._workers[slot] = vm
+        if vm.on_death is None:
+            vm.close() # Pool closed while the worker started
+            return
+
+        if self.setup_script is None:
+            self._ready(vm)
+            return
+        future = vm.execute_async(self.setup_script)
+        if wait:
+            try:
+                future.result()
+            except Exception:
+                self.close()
+                raise
+            self._ready(vm)
+        else:
+            future.add_done_callback(lambda f: self._on_setup_done(vm, f))
+
+    def _new_worker(self, host):
+        if host is None:
+            return IsolatedLuaVM(reactor=self.reactor, **self.vm_options)
+        return RemoteLuaVM(host.address, authkey=host.authkey, reactor=self.reactor,
+                           **self.vm_options)
+
+    def _reconnect_later(self, slot, reason, delay):
+        # The slot leaves the ring until its host answers again
+        with self._lock:
+            if self._closed:
+                return
+            if slot not in self._vacant:
+                self._vacate(slot)
+                self._vacant.add(slot)
+        logger.warning(f"Cannot start remote worker on {reason}; retrying in {delay:.0f}s")
+        next_delay = min(delay * 2, MAX_RECONNECT_DELAY)
+        self.reactor.call_later(delay, lambda: self._spawn_in_background(slot, next_delay))
+
+    def _spawn_in_background(self, slot, retry_delay=RECONNECT_DELAY):
+        # Connecting to a remote host may block; keep it off the reactor thread
+        threading.Thread(target=self._spawn, kwargs={'slot': slot, 'retry_delay': retry_delay},
+                         name="luaward-reconnect", daemon=True).start()
+
+    def _on_setup_done(self, vm, future):
+        if future.exception() is not None:
+            logger.error(f"Worker setup failed: {future.exception()}")
+            self._retire(vm)
+            return
+        self._ready(vm)
+
+    def _ready(self, vm):
+        # A freshly set-up worker joins the idle set, or the spares
+        if vm.pool_slot is not None:
+            self._release(vm)
+            return
+        with self._lock:
+            self._warming.discard(vm)
+            if not self._closed:
+                self._spare_vms.append(vm)
+                return
+        vm.close()
+
+    def _release(self, vm):
+        with self._lock:
+            if self._closed or self._workers.get(vm.pool_slot) is not vm:
+                return
+            self._idle[vm.pool_slot] = vm
+            self._idle_since[vm.pool_slot] = time.monotonic()
+        self._dispatch()
+
+    def _fill_spares(self):
+        with self._lock:
+            missing = self.spares - len(self._spare_vms) - len(self._warming)
+            if self.max_workers is not None:
+                room = self.max_workers - self._local_workers() - len(self._spare_vms) - len(self._warming)
+                missing = min(missing, room)
+            if self._closed:
+                return
+        for _ in range(missing):
+            self._spawn(spare=True)
+
+    def _local_workers(self):
+        return sum(1 for slot in self._workers if slot not in self._placement)
+
+    def _autoscale(self):
+        # Scaling tick, on the reactor thread
+        now = time.monotonic()
+        with self._lock:
+            if self._closed:
+                return
+            queued = [r for q in (self._queue, *self._local.values()) for r in q]
+            wait = max([self._max_wait] + [now - r.submitted for r in queued])
+            self._max_wait = 0.0
+            idle_for = None
+            if self._idle:
+                idle_for = now - min(self._idle_since[slot] for slot in self._idle)
+            size = len(self._workers)
+            busy = size - len(self._idle)
+        try:
+            decision = self.autoscale.decide(size, busy, len(queued), wait, idle_for,
+                                             self.vm_options.get('memory_limit'))
+            if decision > 0:
+                self._grow()
+            elif decision < 0:
+                self._shrink()
+        finally:
+            self._scale_timer = self.reactor.call_later(self.autoscale.interval, self._autoscale)
+
+    def _grow(self):
+        with self._lock:
+            vm = self._spare_vms.pop() if self._spare_vms else None
+            if vm is not None:
+                slot = next(self._slots)
+                self._ring.add(slot)
+                vm.pool_slot = slot
+                self._workers[slot] = vm
+            elif self.max_workers is not None and self._local_workers() + len(self._warming) >= self.max_workers:
+                return # Memory budget exhausted
+        if vm is None:
+            self._spawn()
+        else:
+            logger.info(f"Added spare worker {vm.pid} to the pool")
+            self._release(vm)
+        self._fill_spares()
+
+    def _shrink(self):
+        # Retires the worker idle for longest, sparing sticky tenants' state
+        with self._lock:
+            pinned = set(self._sticky.values())
+            candidates = [slot for slot in self._idle if slot not in pinned]
+            if not candidates:
+                return
+            slot = min(candidates, key=self._idle_since.__getitem__)
+            vm = self._idle[slot]
+        logger.info(f"Retiring idle worker {vm.pid}")
+        self._retire(vm)
+
+    def _retire(self, vm):
+        # Removes the worker and its slot
+        with self._lock:
+            slot = vm.pool_slot
+            if vm in self._spare_vms:
+                self._spare_vms.remove(vm)
+            self._warming.discard(vm)
+            if self._workers.get(slot) is vm:
+                del self._workers[slot]
+                self._vacate(slot)
+                self._placement.pop(slot, None)
+        vm.close()
+        self._dispatch()
+
+    def _vacate(self, slot):
+        # Takes a slot off the ring; work routed to it is requeued (lock held)
+        self._idle.pop(slot, None)
+        self._idle_since.pop(slot, None)
+        self._ring.remove(slot)
+        local = self._local.pop(slot, None)
+        for request in local or ():
+            local.remove(request)
+            self._queue.push(request)
+        self._sticky = {k: s for k, s in self._sticky.items() if s != slot}
+
+    def _on_worker_death(self, vm):
+        # Called on the reactor thread as soon as the worker's pidfd fires.
+        # The replacement takes over the slot, so routing does not change.
+        logger.warning(f"Worker {vm.pid} died, replacing it")
+        if vm.pool_slot is None:
+            self._retire(vm)
+            self._fill_spares()
+            return
+        with self._lock:
+            if self._closed or self._workers.get(vm.pool_slot) is not vm:
+                return
+            self._idle.pop(vm.pool_slot, None)
+            remote = vm.pool_slot in self._placement
+            if remote:
+                # The host may be gone: route around the slot until it is back
+                del self._workers[vm.pool_slot]
+                self._vacate(vm.pool_slot)
+                self._vacant.add(vm.pool_slot)
+        vm.close()
+        if remote:
+            self._spawn_in_background(vm.pool_slot)
+        else:
+            self._spawn(slot=vm.pool_slot)
+
+    def submit(self, method, *args, timeout=None, pure=False, tenant=None,
+               affinity_key=None, sticky=False, priority='normal'):
+        """
+        Queues execute/call/function_exists on the next idle worker.
+        Returns a concurrent.futures.Future; cancelling it while the request
+        is queued removes the request.
+
+        tenant or affinity_key route the request through the hash ring;
+        sticky=True pins a tenant to one worker for the pool's lifetime.
+        priority is a class name from PRIORITIES. Raises PoolOverloadedError
+        when the class queue is full and DeadlineExceededError when the
+        deadline cannot be met.
+        """
+        if priority not in PRIORITIES:
+            raise ValueError(f"Unknown priority {priority!r}; expected one of {', '.join(PRIORITIES)}")
+        priority = PRIORITIES[priority]
+        route = affinity_key if affinity_key is not None else tenant
+        if route is None and self.affinity and method == 'execute':
+            route = hashlib.sha256(args[0].encode()).hexdigest()
+        routing = (route, sticky and tenant is not None)
+        if pure:
+            key = ResultCache.key(method, args)
+            if key is not None:
+                return self._submit_pure(key, method, args, timeout, routing, priority)
+        return self._submit(method, args, timeout, routing, priority)
+
+    def _submit_pure(self, key, method, args, timeout, routing, priority):
+        if self.result_cache is not None:
+            hit, value = self.result_cache.get(key)
+            if hit:
+                future = concurrent.futures.Future()
+                future.set_result(value)
+                return future
+
+        with self._lock:
+            leader = self._inflight.get(key)
+            if leader is None:
+                leader = concurrent.futures.Future()
+                self._inflight[key] = leader
+                owner = True
+            else:
+                owner = False
+
+        if owner:
+            try:
+                # Sticky tenants keep state on one worker, so only others may hedge
+                work = self._submit(method, args, timeout, routing, priority, hedge=not routing[1])
+            except Exception as e:
+                # Rejected: waiters that joined meanwhile share the rejection
+                with self._lock:
+                    self._inflight.pop(key, None)
+                _settle(leader, exc=e)
+                raise
+            work.add_done_callback(lambda f: self._on_pure_done(key, leader, f))
+
+        # Each caller gets its own future so cancelling or timing out one
+        # waiter does not affect the others sharing the execution
+        future = concurrent.futures.Future()
+        if timeout is None:
+            timeout = self.default_timeout
+        if owner or timeout is None:
+            leader.add_done_callback(lambda f: _copy_outcome(f, future))
+            return future
+        # A waiter's deadline holds even while the reactor is busy running
+        # the owner's callbacks inline: an outcome arriving after it is
+        # replaced by the deadline error, and the timer settles it earlier
+        # whenever the reactor is free
+        deadline = time.monotonic() + timeout
+        expire = lambda: _settle(future, exc=DeadlineExceededError("Coalesced request exceeded its deadline"))
+        leader.add_done_callback(
+            lambda f: expire() if time.monotonic() >= deadline else _copy_outcome(f, future))
+        self.reactor.call_later(timeout, expire)
+        return future
+
+    def _on_pure_done(self, key, leader, work):
+        with self._lock:
+            self._inflight.pop(key, None)
+        if (self.result_cache is not None and not work.cancelled()
+                and work.exception() is None):
+            self.result_cache.put(key, work.result())
+        _copy_outcome(work, leader)
+
+    def _submit(self, method, args, timeout, routing=(None, False), priority=PRIORITIES['normal'],
+                hedge=False):
+        if timeout is None:
+            timeout = self.default_timeout
+        deadline = None if timeout is None else time.monotonic() + timeout
+        request = _Request(method, args, deadline, priority)
+        request.hedge = hedge and method == 'call' and self.hedge_quantile is not None
+        if method == 'call' and routing[0] is None and self.batch_window is not None:
+            return self._hold_for_batch(request)
+        with self._lock:
+            if self._closed:
+                raise RuntimeError("Pool is closed")
+            self._admit(request)
+            self._enqueue(request, self._route(*routing))
+        self._arm(request)
+        self._dispatch()
+        return request.future
+
+    def _enqueue(self, request, slot=None):
+        if slot is None:
+            self._queue.push(request)
+        else:
+            self._local.setdefault(slot, _RequestQueue()).push(request)
+        self._queued[request.priority] += request.calls()
+
+    def _arm(self, request):
+        # Expires the request at its deadline and drops it if cancelled while queued
+        if request.deadline is not None:
+            request.timer = self.reactor.call_later(
+                request.deadline - time.monotonic(), lambda: self._expire_queued(request))
+        request.future.add_done_callback(lambda f: self._cancel_queued(request, f))
+
+    def _hold_for_batch(self, request):
+        # Held calls count as queued and expire like queued ones
+        key = (request.args[0], request.priority)
+        with self._lock:
+            if self._closed:
+                raise RuntimeError("Pool is closed")
+            self._admit(request)
+            held = self._batches.get(key)
+            first = held is None
+            if first:
+                held = self._batches[key] = _RequestQueue()
+            held.push(request)
+            self._queued[request.priority] += 1
+            full = len(held) >= self.max_batch
+        self._arm(request)
+        if full:
+            self._flush_batch(key, held)
+        elif first:
+            self.reactor.call_later(self.batch_window, lambda: self._flush_batch(key, held))
+        return request.future
+
+    def _flush_batch(self, key, held):
+        # Queues held calls: alone as a plain call, or together as one call_batch
+        with self._lock:
+            if self._batches.get(key) is not held:
+                return # Already flushed when it filled up
+            del self._batches[key]
+            members = sorted(held, key=lambda m: m.sort_key)
+            for member in members:
+                self._dequeue(member)
+        for member in members:
+            if member.timer is not None:
+                member.timer.cancel() # The batch carries the earliest deadline
+        members = [m for m in members if not m.future.done()]
+        if not members:
+            return
+        if len(members) == 1:
+            request = members[0]
+        else:
+            deadlines = [m.deadline for m in members if m.deadline is not None]
+            request = _Request('call_batch', (key[0], [m.args[1:] for m in members]),
+                               min(deadlines, default=None), key[1])
+            request.members = members
+            request.future.add_done_callback(lambda f: self._split_batch(request, f))
+        with self._lock:
+            if self._closed:
+                request.future.cancel()
+                return
+            self._enqueue(request)
+        self._arm(request)
+        self._dispatch()
+
+    def _split_batch(self, batch, future):
+        # Settles each member with its own outcome from the batch result
+        if future.cancelled():
+            for member in batch.members:
+                if not member.future.cancel():
+                    _settle(member.future, exc=concurrent.futures.CancelledError("Batch cancelled"))
+        elif future.exception() is not None:
+            for member in batch.members:
+                _settle(member.future, exc=future.exception())
+        else:
+            for member, (ok, value) in zip(batch.members, future.result()):
+                if ok:
+                    _settle(member.future, result=value)
+                else:
+                    _settle(member.future, exc=RuntimeError(value))
+
+    def _admit(self, request):
+        # Rejects up front what the queues cannot hold or serve in time
+        if self.max_queue is not None and self._queued[request.priority] >= self.max_queue:
+            raise PoolOverloadedError("Request queue is full")
+        if request.deadline is None or self._service_time is None:
+            return
+        ahead = sum(n for p, n in self._queued.items() if p <= request.priority)
+        if ahead < len(self._idle):
+            return
+        # Requests served at least as early drain over all workers
+        rounds = ahead // max(1, len(self._workers)) + 1
+        if time.monotonic() + rounds * self._service_time > request.deadline:
+            raise DeadlineExceededError("Request cannot complete before its deadline")
+
+    def _route(self, key, sticky):
+        # Returns the slot a request must queue on, or None for any worker
+        if key is None or not self._workers:
+            return None
+        if sticky:
+            slot = self._sticky.get(key)
+            if slot in self._workers:
+                return slot
+        slot = self._ring.lookup(key)
+        if self._load(slot) >= self.spill_threshold:
+            # Preferred worker saturated: spill to the least-loaded one
+            slot = min(self._workers, key=self._load)
+        if sticky:
+            self._sticky[key] = slot
+        return slot
+
+    def _load(self, slot):
+        busy = 0 if slot in self._idle else 1
+        return busy + len(self._local.get(slot, ()))
+
+    def _dequeue(self, request):
+        # Takes a request out of its queue; False once it was dispatched
+        if request.queue is None or not request.queue.remove(request):
+            return False
+        self._queued[request.priority] -= request.calls()
+        return True
+
+    def _expire_queued(self, request):
+        with self._lock:
+            if not self._dequeue(request):
+                return # Already dispatched; the worker enforces the deadline
+        _settle(request.future, exc=DeadlineExceededError("Request expired while queued"))
+
+    def _cancel_queued(self, request, future):
+        if not future.cancelled():
+            return
+        with self._lock:
+            self._dequeue(request)
+        if request.timer is not None:
+            request.timer.cancel()
+
+    def _next_assignment(self):
+        # An idle worker takes whichever comes first in scheduling order:
+        # the head of its own queue or the head of the shared queue
+        shared = self._queue.peek()
+        for slot, vm in self._idle.items():
+            local = self._local.get(slot)
+            request = local.peek() if local is not None else None
+            if request is None or (shared is not None and shared.sort_key < request.sort_key):
+                request = shared
+            if request is not None:
+                del self._idle[slot]
+                self._dequeue(request)
+                return vm, request
+        return None
+
+    def _dispatch(self):
+        while True:
+            with self._lock:
+                if self._closed:
+                    return
+                assignment = self._next_assignment()
+                hedge = self._next_hedge() if assignment is None else None
+                if assignment is None and hedge is None:
+                    return
+            if hedge is not None:
+                self._run_hedge(*hedge)
+                continue
+            vm, request = assignment
+            if request.timer is not None:
+                request.timer.cancel()
+            if not request.future.set_running_or_notify_cancel():
+                self._release(vm)
+                continue
+            if request.members is not None:
+                # Calls cancelled while the batch was queued are left out
+                request.members = [m for m in request.members if m.future.set_running_or_notify_cancel()]
+                if not request.members:
+                    _settle(request.future, result=[])
+                    self._release(vm)
+                    continue
+                request.args = (request.args[0], [m.args[1:] for m in request.members])
+            timeout = None
+            if request.deadline is not None:
+                timeout = request.deadline - time.monotonic()
+                if timeout <= 0:
+                    _settle(request.future, exc=DeadlineExceededError("Request expired while queued"))
+                    self._release(vm)
+                    continue
+            request.started = time.monotonic()
+            with self._lock:
+                self._max_wait = max(self._max_wait, request.started - request.submitted)
+                if request.hedge:
+                    self._hedge_budget = min(HEDGE_BURST, self._hedge_budget + self.max_hedge_ratio)
+            self._attempt(vm, request, timeout)
+            if request.hedge:
+                self._arm_hedge(request)
+
+    def _attempt(self, vm, request, timeout):
+        started = time.monotonic()
+        future = vm.submit(request.method, *request.args, timeout=timeout)
+        request.attempts.append((vm, future, started))
+        future.add_done_callback(lambda f: self._on_done(vm, request, f))
+
+    def _arm_hedge(self, request):
+        with self._lock:
+            latencies = self._latencies.get(request.args[0])
+            delay = latencies.quantile(self.hedge_quantile) if latencies is not None else None
+        if delay is not None:
+            request.timer = self.reactor.call_later(delay, lambda: self._hedge(request))
+
+    def _hedge(self, request):
+        # Still running after the usual time: run a copy on an idle worker,
+        # or on the next one freed while no queued request needs it
+        with self._lock:
+            if self._closed or request.future.done():
+                return
+            self._hedges.append(request)
+        self._dispatch()
+
+    def _next_hedge(self):
+        # (idle worker, request) for the oldest hedge still wanted, or None
+        while self._hedges:
+            request = self._hedges[0]
+            if request.future.done() or self._hedge_budget < 1:
+                self._hedges.popleft()
+                continue
+            slot = next((slot for slot in self._idle if not self._local.get(slot)), None)
+            if slot is None:
+                return None
+            self._hedges.popleft()
+            self._hedge_budget -= 1
+            self.hedged += 1
+            return self._idle.pop(slot), request
+        return None
+
+    def _run_hedge(self, vm, request):
+        timeout = None
+        if request.deadline is not None:
+            timeout = request.deadline - time.monotonic()
+            if timeout <= 0:
+                self._release(vm)
+                return
+        logger.debug(f"Hedging {request.args[0]} on worker {vm.pid}")
+        self._attempt(vm, request, timeout)
+
+    def _on_done(self, vm, request, future):
+        exc = future.exception()
+        started = next(t for v, f, t in request.attempts if f is future)
+        pending = [(v, f) for v, f, _ in request.attempts if not f.done()]
+        # First success wins; an error stands once no other attempt is left
+        if not request.future.done() and (exc is None or not pending):
+            if not isinstance(exc, (WorkerDiedError, DeadlineExceededError)):
+                elapsed = time.monotonic() - started
+                self._record_service_time(elapsed / request.calls())
+                if request.hedge:
+                    with self._lock:
+                        self._latencies.setdefault(request.args[0], _Latencies()).add(elapsed)
+            _settle(request.future, result=None if exc else future.result(), exc=exc)
+            if request.timer is not None:
+                request.timer.cancel()
+            for other_vm, other in pending:
+                other_vm.cancel_request(getattr(other, 'request_id', None))
+        if isinstance(exc, WorkerDiedError) or not vm.alive:
+            return # on_death replaces the worker
+        # After a deadline the worker may still be aborting the request
+        vm.notify_when_idle(lambda: self._release(vm))
+
+    def _record_service_time(self, elapsed):
+        with self._lock:
+            if self._service_time is None:
+                self._service_time = elapsed
+            else:
+                self._service_time += SERVICE_TIME_ALPHA * (elapsed - self._service_time)
+
+    def execute(self, script, **options):
+        """
+        Executes script on one worker. Use setup_script for state every
+        worker needs. Accepts the keyword options of submit().
+        """
+        return self.submit('execute', script, **options).result()
+
+    def call(self, func_name, *args, **options):
+        """
+        Calls a global Lua function on the next idle worker. Accepts the
+        keyword options of submit().
+        """
+        return self.submit('call', func_name, *args, **options).result()
+
+    def pipeline(self, stages, *args, **options):
+        """
+        Runs the functions named in stages in turn on one worker, each on
+        the results of the previous one. Accepts the keyword options of
+        submit().
+        """
+        return self.submit('pipeline', stages, *args, **options).result()
+
+    def function_exists(self, func_name, **options):
+        return self.submit('function_exists', func_name, **options).result()
+
+    def close(self):
+        with self._lock:
+            if self._closed:
+                return
+            self._closed = True
+            if self._scale_timer is not None:
+                self._scale_timer.cancel()
+            workers = list(self._workers.values()) + self._spare_vms
+            queued = list(self._queue)
+            for queue in self._local.values():
+                queued.extend(queue)
+            for members in self._batches.values():
+                queued.extend(members)
+            self._batches.clear()
+            self._workers.clear()
+            self._spare_vms = []
+            self._idle.clear()
+            self._queue = _RequestQueue()
+            self._local.clear()
+            self._queued.clear()
+            self._hedges.clear()
+        for request in queued:
+            request.future.cancel()
+        for vm in workers:
+            vm.close()
+        if self._owns_reactor:
+            self.reactor.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+
+def _copy_outcome(source, target):
+    if source.cancelled():
+        target.cancel()
+    elif source.exception() is not None:
+        _settle(target, exc=source.exception())
+    else:
+        _settle(target, result=source.result())
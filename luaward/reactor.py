@@ -0,0 +1,197 @@
+import os
+import time
+import heapq
+import threading
+import itertools
+import logging
+import multiprocessing
+import _luaward
+
+logger = logging.getLogger("luaward.reactor")
+
+
+class Reactor:
+    """
+    Single parent thread multiplexing many workers.
+
+    Every registered worker contributes two descriptors to one epoll set
+    (the `_luaward.Poller` C core): its transport, which carries results and
+    callback requests, and its pidfd, which becomes readable when the worker
+    process exits. Handlers run on the reactor thread, so callbacks should be
+    given a `callback_executor` if they can block. Timers scheduled with
+    call_later() (request deadlines, cancel grace periods) fire on the same
+    thread.
+    """
+
+    def __init__(self, name="luaward-reactor"):
+        self._poller = _luaward.Poller()
+        self._lock = threading.Lock()
+        self._tokens = itertools.count(1)
+        self._handlers = {} # token -> (fd, handler)
+        self._registrations = {} # id(vm) -> {'transport': token, 'exit': token}
+        self._timers = [] # heap of (when, seq, Timer)
+        self._closed = False
+
+        # Self-pipe used to interrupt poll() on close
+        self._wake_r, self._wake_w = os.pipe()
+        os.set_blocking(self._wake_r, False)
+        self.add_reader(self._wake_r, self._drain_wakeup)
+
+        self._thread = threading.Thread(target=self._run, name=name, daemon=True)
+        self._thread.start()
+
+    def add_reader(self, fd, handler):
+        """
+        Calls handler() on the reactor thread whenever fd is readable.
+        Returns a token for remove_reader().
+        """
+        token = next(self._tokens)
+        with self._lock:
+            self._handlers[token] = (fd, handler)
+        self._poller.register(fd, token)
+        return token
+
+    def remove_reader(self, token):
+        with self._lock:
+            entry = self._handlers.pop(token, None)
+        if entry is None:
+            return
+        try:
+            self._poller.unregister(entry[0])
+        except OSError:
+            pass # Descriptor already closed
+
+    def call_later(self, delay, callback):
+        """
+        Calls callback() on the reactor thread after delay seconds.
+        Returns a Timer whose cancel() prevents the call.
+        """
+        timer = Timer(time.monotonic() + delay, callback)
+        with self._lock:
+            heapq.heappush(self._timers, (timer.when, next(self._tokens), timer))
+            earliest = self._timers[0][2] is timer
+        if earliest and threading.current_thread() is not self._thread:
+            self._wakeup()
+        return timer
+
+    def register(self, vm):
+        """
+        Attaches an IsolatedLuaVM: its futures are completed, its callbacks
+        dispatched and its death detected from this reactor's thread.
+        """
+        vm.reactor = self
+        exit_fd = _exit_fd(vm.process)
+        vm._exit_fd = exit_fd
+        tokens = {
+            'transport': self.add_reader(vm.transport_fileno(), vm._on_readable),
+            'exit': self.add_reader(exit_fd, vm._on_exit),
+        }
+        with self._lock:
+            self._registrations[id(vm)] = tokens
+
+    def detach_transport(self, vm):
+        """
+        Stops watching a closed transport. The worker's death is then
+        reported through its exit descriptor.
+        """
+        with self._lock:
+            token = self._registrations.get(id(vm), {}).pop('transport', None)
+        if token is not None:
+            self.remove_reader(token)
+
+    def unregister(self, vm):
+        with self._lock:
+            tokens = self._registrations.pop(id(vm), {})
+            exit_fd, vm._exit_fd = getattr(vm, '_exit_fd', None), None
+        for token in tokens.values():
+            self.remove_reader(token)
+        if exit_fd is not None and exit_fd != vm.process.sentinel:
+            os.close(exit_fd)
+
+    def _run(self):
+        while not self._closed:
+            try:
+                events = self._poller.poll(self._next_timeout())
+            except OSError as e:
+                if self._closed:
+                    break
+                logger.error(f"Reactor poll failed: {e}")
+                continue
+            for token, _ in events:
+                with self._lock:
+                    entry = self._handlers.get(token)
+                if entry is None:
+                    continue
+                try:
+                    entry[1]()
+                except Exception as e:
+                    logger.exception(f"Reactor handler failed: {e}")
+            self._run_timers()
+
+    def _next_timeout(self):
+        with self._lock:
+            if not self._timers:
+                return None
+            return max(0.0, self._timers[0][0] - time.monotonic())
+
+    def _run_timers(self):
+        now = time.monotonic()
+        while True:
+            with self._lock:
+                if not self._timers or self._timers[0][0] > now:
+                    return
+                _, _, timer = heapq.heappop(self._timers)
+            if timer.cancelled:
+                continue
+            try:
+                timer.callback()
+            except Exception as e:
+                logger.exception(f"Reactor timer failed: {e}")
+
+    def _drain_wakeup(self):
+        try:
+            while os.read(self._wake_r, 4096):
+                pass
+        except BlockingIOError:
+            pass
+
+    def _wakeup(self):
+        try:
+            os.write(self._wake_w, b'\0')
+        except OSError:
+            pass
+
+    def close(self):
+        if self._closed:
+            return
+        self._closed = True
+        self._wakeup()
+        if threading.current_thread() is not self._thread:
+            self._thread.join()
+        self._poller.close()
+        os.close(self._wake_r)
+        os.close(self._wake_w)
+
+
+class Timer:
+    __slots__ = ('when', 'callback', 'cancelled')
+
+    def __init__(self, when, callback):
+        self.when = when
+        self.callback = callback
+        self.cancelled = False
+
+    def cancel(self):
+        self.cancelled = True
+
+
+def _exit_fd(process):
+    # A pidfd where the kernel supports it, otherwise the multiprocessing
+    # sentinel, which also becomes readable when the process exits. Remote
+    # workers only have the sentinel their host monitor provides.
+    if not isinstance(process, multiprocessing.process.BaseProcess):
+        return process.sentinel
+    try:
+        return _luaward.pidfd_open(process.pid)
+    except OSError:
+        return process.sentinel
@@ -0,0 +1,428 @@
+import os
+import sys
+import time
+import socket
+import struct
+import logging
+import secrets
+import argparse
+import threading
+import multiprocessing
+import multiprocessing.connection
+import _luaward
+from .isolated import IsolatedLuaVM, CANCEL_SIGNAL, run_worker, _exit_stats
+
+logger = logging.getLogger("luaward.remote")
+
+# Agent workers are forked from a clean fork server rather than from the
+# agent, so they inherit only their own connection: not the listener, nor
+# other clients' connections.
+_WORKER_CONTEXT = multiprocessing.get_context('forkserver')
+
+# The fork server reaps workers, usually before the agent can read their
+# final CPU times; the agent samples them this often (seconds) instead
+STATS_INTERVAL = 1.0
+
+
+class HostAgent:
+    """
+    Starts workers on this host for remote RemoteLuaVM clients.
+
+    The agent listens on a TCP address (host, port) or a UNIX socket path;
+    multiprocessing.connection frames every message with its length. A
+    client opens two connections per worker:
+
+    *   A data connection sending ('SPAWN', None, options, None). The agent
+        answers ('READY', None, (token, pid), None) and forks a worker that
+        takes the connection over and speaks the usual worker protocol on it,
+        callbacks included.
+    *   A control connection sending ('CONTROL', None, token, None), on which
+        the agent answers PING with PONG, relays CANCEL as the cancel signal,
+        performs KILL, and reports ('EXIT', None, (exitcode, stats), None)
+        when the worker ends. Closing it kills the worker. The CPU times in
+        stats are sampled every STATS_INTERVAL seconds, so they may miss the
+        worker's last moments.
+
+    Isolation (uid, gid, full_isolation) is the agent's configuration; clients
+    only choose memory, instruction and CPU limits, each capped by the
+    agent's own when it sets one, and whether scripts get the sandboxed
+    load().
+
+    Peers are sent pickled messages, so anyone who can connect can run code
+    as the agent: an authkey is required unless the address is a UNIX socket.
+    """
+
+    def __init__(self, address, authkey=None, uid=None, gid=None, full_isolation=False,
+                 cpu_limit=None, max_workers=None, memory_limit=None, instruction_limit=None):
+        if authkey is None and multiprocessing.connection.address_type(address) != 'AF_UNIX':
+            raise ValueError("A host agent on a network address requires an authkey")
+        self.uid = uid
+        self.gid = gid
+        self.full_isolation = full_isolation
+        self.cpu_limit = cpu_limit
+        self.memory_limit = memory_limit
+        self.instruction_limit = instruction_limit
+        self.max_workers = max_workers
+        self._lock = threading.Lock()
+        self._workers = {} # token -> multiprocessing.Process
+        self._closed = False
+        self._listener = multiprocessing.connection.Listener(address, authkey=authkey)
+        self.address = self._listener.address
+        self._authkey = authkey
+        self._accept_thread = None
+
+    def start(self):
+        """Accepts clients on a background thread and returns."""
+        self._accept_thread = threading.Thread(
+            target=self.serve_forever, name="luaward-agent", daemon=True)
+        self._accept_thread.start()
+        return self
+
+    def serve_forever(self):
+        logger.info(f"Host agent listening on {self.address}")
+        while not self._closed:
+            try:
+                conn = self._listener.accept()
+            except multiprocessing.AuthenticationError as e:
+                logger.warning(f"Rejected client: {e}")
+                continue
+            except OSError:
+                if self._closed:
+                    break
+                raise
+            if self._closed:
+                conn.close()
+                break
+            threading.Thread(target=self._serve_connection, args=(conn,), daemon=True).start()
+
+    def _serve_connection(self, conn):
+        try:
+            cmd, _, payload, _ = conn.recv()
+        except (EOFError, OSError):
+            conn.close()
+            return
+        if cmd == 'SPAWN':
+            self._spawn(conn, payload or {})
+        elif cmd == 'CONTROL':
+            self._control_loop(conn, payload)
+        elif cmd == 'PING':
+            conn.send(('PONG', None, None, None))
+            conn.close()
+        else:
+            conn.send(('ERROR', None, f"Unknown command: {cmd}", None))
+            conn.close()
+
+    def _spawn(self, conn, options):
+        with self._lock:
+            if self.max_workers is not None and len(self._workers) >= self.max_workers:
+                conn.send(('ERROR', None, "Host is at its worker limit", None))
+                conn.close()
+                return
+            token = secrets.token_hex(16)
+            process = _WORKER_CONTEXT.Process(target=run_worker, args=(
+                conn, _lower(options.get('memory_limit'), self.memory_limit),
+                options.get('callback_names', ()),
+                _lower(options.get('instruction_limit'), self.instruction_limit),
+                self.uid, self.gid, self.full_isolation,
+                _lower(options.get('cpu_limit'), self.cpu_limit), bool(options.get('safe_load')),
+                bool(options.get('readonly_libs'))))
+            process.start()
+            self._workers[token] = process
+        conn.send(('READY', None, (token, process.pid), None))
+        conn.close() # The worker holds its own copy
+
+    def _control_loop(self, conn, token):
+        with self._lock:
+            process = self._workers.get(token)
+        if process is None:
+            conn.send(('EXIT', None, (None, {}), None))
+            conn.close()
+            return
+        stats = {}
+        try:
+            while True:
+                stats = _exit_stats(process.pid) or stats
+                ready = multiprocessing.connection.wait([conn, process.sentinel], STATS_INTERVAL)
+                if process.sentinel in ready:
+                    break
+                try:
+                    cmd, req_id, _, _ = conn.recv()
+                except (EOFError, OSError):
+                    process.kill() # Client gone: nobody can use the worker
+                    break
+                if cmd == 'PING':
+                    conn.send(('PONG', None, None, None))
+                elif cmd == 'CANCEL':
+                    try:
+                        _luaward.cancel(process.pid, CANCEL_SIGNAL, req_id)
+                    except OSError:
+                        pass
+                elif cmd == 'KILL':
+                    process.kill()
+            stats = _exit_stats(process.pid) or stats # Fresher if not reaped yet
+            process.join()
+            try:
+                conn.send(('EXIT', None, (process.exitcode, stats), None))
+            except (OSError, ValueError):
+                pass
+        finally:
+            with self._lock:
+                self._workers.pop(token, None)
+            conn.close()
+
+    def close(self):
+        if self._closed:
+            return
+        self._closed = True
+        try:
+            multiprocessing.connection.Client(self.address, authkey=self._authkey).close()
+        except (OSError, multiprocessing.AuthenticationError):
+            pass
+        if self._accept_thread is not None and threading.current_thread() is not self._accept_thread:
+            self._accept_thread.join()
+        self._listener.close()
+        with self._lock:
+            workers = list(self._workers.values())
+        for process in workers:
+            process.kill()
+            process.join()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+
+class RemoteHost:
+    """A host agent address and how many pool workers it should run."""
+
+    def __init__(self, address, workers=1, authkey=None):
+        self.address = address
+        self.workers = workers
+        self.authkey = authkey
+
+    def __repr__(self):
+        return f"RemoteHost({self.address!r}, workers={self.workers})"
+
+
+class RemoteLuaVM(IsolatedLuaVM):
+    """
+    An IsolatedLuaVM whose worker runs on another host, started by a
+    HostAgent. Requests, callbacks, deadlines and cancellation behave as for
+    a local worker. The agent is pinged every `health_interval` seconds; a
+    worker whose agent does not answer within `health_timeout` is treated
+    as dead (WorkerDiedError), like a local worker that exited.
+
+    Deadlines are sent as wall-clock times, so hosts need synchronized clocks.
+    uid, gid and full_isolation are set on the agent, not here.
+    """
+
+    def __init__(self, address, authkey=None, health_interval=1.0, health_timeout=5.0,
+                 connect_timeout=5.0, **options):
+        if options.get('channels'):
+            raise ValueError("Channels live in shared memory and cannot reach remote workers")
+        self.address = address
+        self.authkey = authkey
+        self.connect_timeout = connect_timeout
+        self.health_interval = health_interval
+        self.health_timeout = health_timeout
+        super().__init__(**options)
+
+    def _start_worker(self, memory_limit, callback_names, instruction_limit):
+        self._conn = _connect(self.address, self.authkey, self.connect_timeout)
+        self._conn.send(('SPAWN', None, {
+            'memory_limit': memory_limit,
+            'callback_names': callback_names,
+            'instruction_limit': instruction_limit,
+            'cpu_limit': self.cpu_limit,
+            'safe_load': self.safe_load,
+            'readonly_libs': self.readonly_libs,
+        }, None))
+        try:
+            status, _, payload, _ = self._conn.recv()
+        except (EOFError, OSError) as e:
+            self._conn.close()
+            raise ConnectionError(f"Host agent {self.address} did not answer: {e}")
+        if status != 'READY':
+            self._conn.close()
+            raise ConnectionError(f"Host agent {self.address} refused the worker: {payload}")
+        _set_timeout(self._conn, None)
+        token, pid = payload
+        control = _connect(self.address, self.authkey, self.connect_timeout)
+        _set_timeout(control, None)
+        self.process = _RemoteProcess(control, token, pid,
+                                      self.health_interval, self.health_timeout)
+
+    def _signal_cancel(self, req_id):
+        self.process.cancel(req_id)
+
+    def _exit_stats(self):
+        self.process.join(self.health_timeout)
+        if self.process.error is not None:
+            self._crashed = self._crashed or self.process.error
+        return self.process.stats
+
+    def close(self):
+        super().close()
+        self.process.close()
+
+
+class _RemoteProcess:
+    """
+    Stand-in for multiprocessing.Process backed by a control connection to
+    the host agent. A monitor thread pings the agent and waits for the exit
+    report; `sentinel` becomes readable once the worker is known to be dead
+    or its host unreachable, so reactors and waiters treat it like a local
+    process sentinel.
+    """
+
+    def __init__(self, control, token, pid, health_interval, health_timeout):
+        self.pid = pid
+        self.exitcode = None
+        self.stats = {}
+        self.error = None # Why the worker is presumed dead without an exit report
+        self.health_interval = health_interval
+        self.health_timeout = health_timeout
+        self._control = control
+        self._control.send(('CONTROL', None, token, None))
+        self._send_lock = threading.Lock()
+        self._dead = threading.Event()
+        self.sentinel, self._wake = os.pipe()
+        self._monitor = threading.Thread(target=self._run, name=f"luaward-remote-{pid}", daemon=True)
+        self._monitor.start()
+
+    def _run(self):
+        last_reply = time.monotonic()
+        try:
+            while True:
+                if not self._control.poll(self.health_interval):
+                    if time.monotonic() - last_reply > self.health_timeout:
+                        self.error = "host agent stopped answering health checks"
+                        break
+                    self._send(('PING', None, None, None))
+                    continue
+                status, _, payload, _ = self._control.recv()
+                last_reply = time.monotonic()
+                if status == 'EXIT':
+                    self.exitcode, self.stats = payload
+                    break
+        except (EOFError, OSError):
+            self.error = "connection to the host agent lost"
+        if self.error is not None:
+            logger.warning(f"Remote worker {self.pid}: {self.error}")
+        self._dead.set()
+        os.write(self._wake, b'\0')
+
+    def _send(self, message):
+        with self._send_lock:
+            self._control.send(message)
+
+    def cancel(self, req_id):
+        self._send(('CANCEL', req_id, None, None))
+
+    def kill(self):
+        try:
+            self._send(('KILL', None, None, None))
+        except (OSError, ValueError):
+            pass # Agent unreachable: the monitor reports the worker lost
+
+    def is_alive(self):
+        return not self._dead.is_set()
+
+    def join(self, timeout=None):
+        self._dead.wait(timeout)
+
+    def close(self):
+        self._control.close()
+        self._monitor.join(self.health_timeout)
+        os.close(self.sentinel)
+        os.close(self._wake)
+
+
+def _connect(address, authkey, timeout):
+    # multiprocessing.connection.Client without unbounded waits: the socket
+    # gets kernel send/receive timeouts for connecting and the handshake
+    family = socket.AF_INET if isinstance(address, tuple) else socket.AF_UNIX
+    sock = socket.socket(family, socket.SOCK_STREAM)
+    try:
+        _set_socket_timeout(sock, timeout)
+        sock.connect(address)
+    except OSError:
+        sock.close()
+        raise
+    conn = multiprocessing.connection.Connection(sock.detach())
+    if authkey is not None:
+        try:
+            multiprocessing.connection.answer_challenge(conn, authkey)
+            multiprocessing.connection.deliver_challenge(conn, authkey)
+        except (EOFError, OSError, multiprocessing.AuthenticationError):
+            conn.close()
+            raise
+    return conn
+
+
+def _set_timeout(conn, timeout):
+    sock = socket.socket(fileno=conn.fileno())
+    try:
+        _set_socket_timeout(sock, timeout)
+    finally:
+        sock.detach()
+
+
+def _set_socket_timeout(sock, timeout):
+    # SO_RCVTIMEO/SO_SNDTIMEO keep the descriptor blocking, as Connection needs
+    seconds = int(timeout or 0)
+    value = struct.pack('ll', seconds, int(((timeout or 0) - seconds) * 1e6))
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVTIMEO, value)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_SNDTIMEO, value)
+
+
+def _lower(a, b):
+    # The stricter of two optional limits
+    if a is None:
+        return b
+    if b is None:
+        return a
+    return min(a, b)
+
+
+def _parse_address(value):
+    # host:port for TCP, anything else is a UNIX socket path
+    host, sep, port = value.rpartition(':')
+    if sep and port.isdigit():
+        return (host, int(port))
+    return value
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description="luaward host agent for remote workers")
+    parser.add_argument('--listen', required=True, help="host:port or UNIX socket path")
+    parser.add_argument('--authkey-env', required=True, help="Environment variable holding the auth key")
+    parser.add_argument('--uid', type=int, help="Drop workers to this UID")
+    parser.add_argument('--gid', type=int, help="Drop workers to this GID")
+    parser.add_argument('--full-isolation', action='store_true', help="Network namespace and seccomp lockdown")
+    parser.add_argument('--cpu-limit', type=int, help="Maximum CPU seconds per worker")
+    parser.add_argument('--max-workers', type=int, help="Maximum concurrent workers")
+    parser.add_argument('--memory-limit', type=int, help="Maximum memory limit per VM, in bytes")
+    parser.add_argument('--instruction-limit', type=int, help="Maximum instructions per request")
+    args = parser.parse_args(argv)
+
+    logging.basicConfig(level=logging.INFO)
+    agent = HostAgent(
+        _parse_address(args.listen), authkey=os.environ[args.authkey_env].encode(),
+        uid=args.uid, gid=args.gid, full_isolation=args.full_isolation,
+        cpu_limit=args.cpu_limit, max_workers=args.max_workers,
+        memory_limit=args.memory_limit, instruction_limit=args.instruction_limit,
+    )
+    try:
+        agent.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        agent.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
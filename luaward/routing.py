@@ -0,0 +1,41 @@
+import bisect
+import hashlib
+
+
+class HashRing:
+    """
+    Consistent hash ring over worker slots.
+
+    Each slot owns `replicas` points on the ring, so adding or removing a
+    slot only moves the keys that hashed next to its points.
+    """
+
+    def __init__(self, replicas=64):
+        self.replicas = replicas
+        self._points = [] # sorted hashes
+        self._owners = [] # slot owning the point at the same index
+
+    @staticmethod
+    def _hash(value):
+        return int.from_bytes(hashlib.blake2b(str(value).encode(), digest_size=8).digest(), 'big')
+
+    def add(self, slot):
+        for i in range(self.replicas):
+            point = self._hash(f"{slot}#{i}")
+            index = bisect.bisect(self._points, point)
+            self._points.insert(index, point)
+            self._owners.insert(index, slot)
+
+    def remove(self, slot):
+        keep = [(p, o) for p, o in zip(self._points, self._owners) if o != slot]
+        self._points = [p for p, _ in keep]
+        self._owners = [o for _, o in keep]
+
+    def lookup(self, key):
+        if not self._points:
+            return None
+        index = bisect.bisect(self._points, self._hash(key)) % len(self._points)
+        return self._owners[index]
+
+    def __len__(self):
+        return len(self._points) // self.replicas
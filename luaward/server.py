@@ -0,0 +1,409 @@
+import os
+import sys
+import queue
+import socket
+import logging
+import argparse
+import importlib
+import itertools
+import threading
+import concurrent.futures
+import multiprocessing.connection
+from .pool import LuaVMPool
+from .isolated import _COMMANDS, _settle
+from .errors import WorkerDiedError, DeadlineExceededError, PoolOverloadedError
+
+logger = logging.getLogger("luaward.server")
+
+# Pool method and argument unpacking for each protocol command
+_METHODS = {
+    'EXECUTE': ('execute', lambda script: (script,)),
+    'CALL': ('call', lambda payload: (payload[0], *payload[1])),
+    'FUNCTION_EXISTS': ('function_exists', lambda func_name: (func_name,)),
+}
+
+# Request options a client may pass through to LuaVMPool.submit()
+_SUBMIT_OPTIONS = ('timeout', 'pure', 'tenant', 'affinity_key', 'sticky', 'priority')
+
+# Errors re-raised with their type on the client side
+_ERRORS = {cls.__name__: cls for cls in (
+    WorkerDiedError, DeadlineExceededError, PoolOverloadedError,
+    concurrent.futures.CancelledError, RuntimeError,
+)}
+
+
+class LuaServer:
+    """
+    Serves one LuaVMPool to local processes over a UNIX socket.
+
+    Clients (LuaClient) speak the worker protocol: requests are
+    (cmd, req_id, payload, opts) tuples and responses
+    (status, req_id, payload, meta) tuples. Many application processes can
+    then share one set of warm workers and their compile caches instead of
+    each starting its own pool. Every connection is read and written by
+    threads of its own, so a client that stalls mid-message or stops
+    reading holds up only itself, never the pool's reactor thread.
+
+    The socket is created with mode 0600, so only the owning user can
+    connect; `authkey` additionally requires the multiprocessing HMAC
+    handshake. Callbacks are those the pool was configured with: Lua code
+    cannot call back into client processes.
+    """
+
+    def __init__(self, address, authkey=None, pool=None, mode=0o600, **pool_options):
+        self.address = address
+        self._authkey = authkey
+        self._owns_pool = pool is None
+        self.pool = pool or LuaVMPool(**pool_options)
+        self._lock = threading.Lock()
+        self._clients = set() # _ClientConnection
+        self._closed = False
+
+        _remove_stale_socket(address)
+        old_umask = os.umask(0o177) # No window where others can connect
+        try:
+            self._listener = multiprocessing.connection.Listener(
+                address, family='AF_UNIX', authkey=authkey)
+        finally:
+            os.umask(old_umask)
+        os.chmod(address, mode)
+        self._accept_thread = None
+
+    def start(self):
+        """Accepts clients on a background thread and returns."""
+        self._accept_thread = threading.Thread(
+            target=self.serve_forever, name="luaward-server", daemon=True)
+        self._accept_thread.start()
+        return self
+
+    def serve_forever(self):
+        logger.info(f"Serving on {self.address}")
+        while not self._closed:
+            try:
+                conn = self._listener.accept()
+            except multiprocessing.AuthenticationError as e:
+                logger.warning(f"Rejected client: {e}")
+                continue
+            except OSError:
+                if self._closed:
+                    break
+                raise
+            if self._closed:
+                conn.close()
+                break
+            self._add_client(conn)
+
+    def _add_client(self, conn):
+        client = _ClientConnection(conn)
+        with self._lock:
+            self._clients.add(client)
+        threading.Thread(target=self._read_client, args=(client,),
+                         name="luaward-server-client", daemon=True).start()
+
+    def _read_client(self, client):
+        # Client reader thread; it closes the connection once done with it
+        try:
+            while self._handle_request(client, client.conn.recv()):
+                pass
+        except (EOFError, OSError):
+            pass
+        self._drop_client(client)
+        client.finish()
+
+    def _handle_request(self, client, message):
+        # Returns False once the client has said goodbye
+        cmd, req_id, payload, opts = message
+        if cmd == 'STOP':
+            return False
+        try:
+            method, unpack = _METHODS[cmd]
+            options = {k: v for k, v in (opts or {}).items() if k in _SUBMIT_OPTIONS}
+            future = self.pool.submit(method, *unpack(payload), **options)
+        except Exception as e:
+            client.reply(req_id, exc=e)
+            return True
+        client.track(req_id, future)
+        future.add_done_callback(lambda f: self._on_done(client, req_id, f))
+        return True
+
+    def _on_done(self, client, req_id, future):
+        client.untrack(req_id)
+        if future.cancelled():
+            client.reply(req_id, exc=concurrent.futures.CancelledError("Request cancelled"))
+        elif future.exception() is not None:
+            client.reply(req_id, exc=future.exception())
+        else:
+            client.reply(req_id, result=future.result())
+
+    def _drop_client(self, client):
+        with self._lock:
+            if client not in self._clients:
+                return
+            self._clients.discard(client)
+        client.close()
+
+    def close(self):
+        if self._closed:
+            return
+        self._closed = True
+        # Unblock accept() with a throwaway connection
+        try:
+            multiprocessing.connection.Client(
+                self.address, family='AF_UNIX', authkey=self._authkey).close()
+        except (OSError, multiprocessing.AuthenticationError):
+            pass
+        if self._accept_thread is not None and threading.current_thread() is not self._accept_thread:
+            self._accept_thread.join()
+        self._listener.close()
+        with self._lock:
+            clients = list(self._clients)
+        for client in clients:
+            self._drop_client(client)
+        if self._owns_pool:
+            self.pool.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+
+class _ClientConnection:
+    """
+    One client's socket. Replies are queued for a writer thread, so the
+    threads settling pool futures never block on a slow client.
+    """
+
+    def __init__(self, conn):
+        self.conn = conn
+        self._lock = threading.Lock()
+        self._futures = {} # req_id -> pool Future, to cancel on disconnect
+        self._outbox = queue.SimpleQueue() # Replies to send; None ends the writer
+        self._closed = False
+        self._writer = threading.Thread(target=self._write_loop, name="luaward-server-reply",
+                                        daemon=True)
+        self._writer.start()
+
+    def track(self, req_id, future):
+        with self._lock:
+            if not self._closed:
+                self._futures[req_id] = future
+                return
+        future.cancel() # Disconnected while submitting
+
+    def untrack(self, req_id):
+        with self._lock:
+            self._futures.pop(req_id, None)
+
+    def reply(self, req_id, result=None, exc=None):
+        if exc is None:
+            message = ('SUCCESS', req_id, result, None)
+        else:
+            message = ('ERROR', req_id, str(exc), {'error': type(exc).__name__})
+        with self._lock:
+            if not self._closed:
+                self._outbox.put(message)
+
+    def _write_loop(self):
+        while True:
+            message = self._outbox.get()
+            if message is None:
+                return
+            try:
+                self.conn.send(message)
+            except (OSError, ValueError):
+                return # Client gone; its reader notices the EOF
+
+    def close(self):
+        with self._lock:
+            if self._closed:
+                return
+            self._closed = True
+            futures = list(self._futures.values())
+            self._futures.clear()
+        self._outbox.put(None)
+        # Nobody is waiting any more: drop work that has not started
+        for future in futures:
+            future.cancel()
+        # Wakes the reader and writer if they are blocked on the socket
+        try:
+            with socket.fromfd(self.conn.fileno(), socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+                sock.shutdown(socket.SHUT_RDWR)
+        except OSError:
+            pass
+
+    def finish(self):
+        # Reader thread, after close(): the writer is done with the socket
+        self._writer.join()
+        self.conn.close()
+
+
+class LuaClient:
+    """
+    Connection to a LuaServer, usable where an IsolatedLuaVM is: execute(),
+    call(), function_exists(), their *_async variants, submit() and close().
+    Requests may also carry the LuaVMPool options (pure, tenant, priority...).
+    """
+
+    def __init__(self, address, authkey=None, default_timeout=None, callbacks=None):
+        if callbacks:
+            raise ValueError("Callbacks are configured on the server")
+        self.address = address
+        self.default_timeout = default_timeout
+        self.last_stats = None
+        self._conn = multiprocessing.connection.Client(address, family='AF_UNIX', authkey=authkey)
+        self._send_lock = threading.Lock()
+        self._pending_lock = threading.Lock()
+        self._pending = {} # req_id -> Future
+        self._request_ids = itertools.count(1)
+        self._closed = False
+        self._reader = threading.Thread(target=self._read_loop, name="luaward-client", daemon=True)
+        self._reader.start()
+
+    def _read_loop(self):
+        try:
+            while True:
+                status, req_id, payload, meta = self._conn.recv()
+                with self._pending_lock:
+                    future = self._pending.pop(req_id, None)
+                if future is None:
+                    continue
+                if status == 'SUCCESS':
+                    _settle(future, result=payload)
+                else:
+                    error = _ERRORS.get((meta or {}).get('error'), RuntimeError)
+                    _settle(future, exc=error(payload))
+        except (EOFError, OSError):
+            pass
+        with self._pending_lock:
+            pending = list(self._pending.values())
+            self._pending.clear()
+        for future in pending:
+            _settle(future, exc=ConnectionError("Connection to the luaward server closed"))
+
+    def submit(self, method, *args, timeout=None, **options):
+        """
+        Sends execute/call/function_exists to the server, returning a
+        concurrent.futures.Future. options are passed to LuaVMPool.submit().
+        """
+        cmd, build = _COMMANDS[method]
+        if timeout is None:
+            timeout = self.default_timeout
+        if timeout is not None:
+            options['timeout'] = timeout
+        req_id = next(self._request_ids)
+        future = concurrent.futures.Future()
+        with self._pending_lock:
+            if self._closed:
+                raise RuntimeError("Client is closed")
+            self._pending[req_id] = future
+        try:
+            with self._send_lock:
+                self._conn.send((cmd, req_id, build(*args), options))
+        except (OSError, ValueError) as e:
+            with self._pending_lock:
+                self._pending.pop(req_id, None)
+            raise ConnectionError(f"Cannot reach the luaward server: {e}")
+        return future
+
+    def execute(self, script, timeout=None, **options):
+        return self.submit('execute', script, timeout=timeout, **options).result()
+
+    def call(self, func_name, *args, timeout=None, **options):
+        return self.submit('call', func_name, *args, timeout=timeout, **options).result()
+
+    def function_exists(self, func_name, timeout=None, **options):
+        return self.submit('function_exists', func_name, timeout=timeout, **options).result()
+
+    def execute_async(self, script, timeout=None, **options):
+        return self.submit('execute', script, timeout=timeout, **options)
+
+    def call_async(self, func_name, *args, timeout=None, **options):
+        return self.submit('call', func_name, *args, timeout=timeout, **options)
+
+    def function_exists_async(self, func_name, timeout=None, **options):
+        return self.submit('function_exists', func_name, timeout=timeout, **options)
+
+    @property
+    def alive(self):
+        return not self._closed and self._reader.is_alive()
+
+    def close(self):
+        with self._pending_lock:
+            if self._closed:
+                return
+            self._closed = True
+        try:
+            with self._send_lock:
+                self._conn.send(('STOP', None, None, None))
+        except (OSError, ValueError):
+            pass
+        # The server answers STOP by closing its end, which ends the reader
+        self._reader.join(timeout=5)
+        self._conn.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+
+def _remove_stale_socket(address):
+    # A socket file left by a crashed server blocks bind(); a live one is kept
+    if not os.path.exists(address):
+        return
+    probe = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        probe.connect(address)
+    except ConnectionRefusedError:
+        os.unlink(address)
+        return
+    finally:
+        probe.close()
+    raise OSError(f"A luaward server is already listening on {address}")
+
+
+def _load_callbacks(spec):
+    # "package.module:name" naming a dict of callbacks
+    module_name, _, attr = spec.partition(':')
+    return getattr(importlib.import_module(module_name), attr or 'callbacks')
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description="Shared luaward worker pool server")
+    parser.add_argument('--socket', required=True, help="UNIX socket path")
+    parser.add_argument('--size', type=int, default=4, help="Number of workers")
+    parser.add_argument('--setup', help="Lua file run on every worker at start")
+    parser.add_argument('--memory-limit', type=int, help="Per-VM memory limit in bytes")
+    parser.add_argument('--instruction-limit', type=int, help="Per-request instruction limit")
+    parser.add_argument('--callbacks', help="module:name of a dict of Python callbacks")
+    parser.add_argument('--authkey-env', help="Environment variable holding the auth key")
+    args = parser.parse_args(argv)
+
+    logging.basicConfig(level=logging.INFO)
+    setup_script = None
+    if args.setup:
+        with open(args.setup) as f:
+            setup_script = f.read()
+    authkey = None
+    if args.authkey_env:
+        authkey = os.environ[args.authkey_env].encode()
+
+    server = LuaServer(
+        args.socket, authkey=authkey, size=args.size, setup_script=setup_script,
+        memory_limit=args.memory_limit, instruction_limit=args.instruction_limit,
+        callbacks=_load_callbacks(args.callbacks) if args.callbacks else None,
+    )
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
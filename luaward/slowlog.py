@@ -0,0 +1,105 @@
+import os
+import json
+import time
+import hashlib
+import threading
+
+# Characters of arguments kept in a slow log entry
+ARGS_SUMMARY_LENGTH = 200
+
+
+class SlowLog:
+    """
+    Logs requests that cross a threshold on wall time (seconds),
+    instructions or peak memory (bytes), with their script hash or function
+    name, an argument summary and the resource report. Pass it to
+    IsolatedLuaVM (or a pool) as slow_log=.
+
+    With profile=True the worker samples the Lua stack every
+    `profile_interval` instructions of every request, and entries carry the
+    samples of the slow execution as {folded stack: count}, the format
+    flame graph tools read. Only slow requests ship their samples.
+
+    Entries are JSON lines. Once `path` holds half of `max_bytes` it is
+    moved to `path + '.1'`, replacing the previous one, so the log never
+    takes more than max_bytes on disk.
+    """
+
+    def __init__(self, path, wall_time=None, instructions=None, memory=None,
+                 profile=False, profile_interval=1000, max_bytes=16 * 1024 * 1024):
+        if wall_time is None and instructions is None and memory is None:
+            raise ValueError("SlowLog needs at least one threshold")
+        self.path = path
+        self.max_bytes = max_bytes
+        # Sent with each request so the worker can tell a slow one itself
+        self.thresholds = {
+            'wall_time': wall_time,
+            'instructions': instructions,
+            'memory': memory,
+            'profile': profile_interval if profile else 0,
+        }
+        self.logged = 0
+        self._lock = threading.Lock()
+        self._file = open(path, 'a')
+
+    def record(self, cmd, payload, report):
+        """Writes the entry of a request; report is what slow_report() returned."""
+        entry = {'time': time.time(), 'pid': os.getpid()}
+        entry.update(_summarize(cmd, payload))
+        entry.update(report)
+        line = json.dumps(entry, default=str) + "\n"
+        with self._lock:
+            if self._file.closed:
+                return
+            if self._file.tell() + len(line) > self.max_bytes // 2:
+                self._rotate()
+            self._file.write(line)
+            self._file.flush()
+            self.logged += 1
+
+    def _rotate(self):
+        self._file.close()
+        os.replace(self.path, self.path + '.1')
+        self._file = open(self.path, 'a')
+
+    def close(self):
+        with self._lock:
+            self._file.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+
+def slow_report(thresholds, wall_time, stats, profile=None):
+    """
+    Returns the slow log report of a request, or None when it crossed no
+    threshold. Runs in the worker, which measured the request.
+    """
+    crossed = []
+    if thresholds['wall_time'] is not None and wall_time >= thresholds['wall_time']:
+        crossed.append('wall_time')
+    if thresholds['instructions'] is not None and stats.get('instructions', 0) >= thresholds['instructions']:
+        crossed.append('instructions')
+    if thresholds['memory'] is not None and stats.get('memory_peak', 0) >= thresholds['memory']:
+        crossed.append('memory')
+    if not crossed:
+        return None
+    report = {'crossed': crossed, 'wall_time': wall_time, 'stats': stats}
+    if profile:
+        report['profile'] = profile
+    return report
+
+
+def _summarize(cmd, payload):
+    if cmd == 'EXECUTE':
+        first_line = payload.strip().split("\n", 1)[0]
+        return {'kind': 'execute', 'script': hashlib.sha256(payload.encode()).hexdigest(),
+                'excerpt': first_line[:80]}
+    func_name, args = payload[0], payload[1]
+    summary = repr(args)
+    if len(summary) > ARGS_SUMMARY_LENGTH:
+        summary = summary[:ARGS_SUMMARY_LENGTH] + "..."
+    return {'kind': cmd.lower(), 'function': func_name, 'args': summary}
@@ -1,5 +1,8 @@
 import unittest
-from luaward import IsolatedLuaVM
+import threading
+from unittest import mock
+from concurrent.futures import ThreadPoolExecutor
+from luaward import IsolatedLuaVM, CachedArg
 
 class TestBasicFunctionality(unittest.TestCase):
     def setUp(self):
@@ -62,9 +65,138 @@ class TestBasicFunctionality(unittest.TestCase):
         self.assertFalse(self.vm.function_exists("non_existent_func"))
         self.assertFalse(self.vm.function_exists("my_var")) # It's a number, not a function
 
+    def test_function_exists_mirror(self):
+        """Test function_exists answered from the names reported with results"""
+        self.vm.execute("function mirrored() end")
+        with mock.patch.object(self.vm, '_send', side_effect=AssertionError("round trip")):
+            self.assertTrue(self.vm.function_exists("mirrored"))
+        self.assertFalse(self.vm.function_exists("absent"))
+
+        self.vm.execute("mirrored = nil")
+        self.assertFalse(self.vm.function_exists("mirrored"))
+        # Existing globals turned into functions, which the worker does not rescan for
+        self.vm.execute("handler = 1")
+        self.vm.execute("handler = function() end")
+        self.assertTrue(self.vm.function_exists("handler"))
+        self.vm.execute("function mirrored() end")
+        with mock.patch.object(self.vm, '_send', side_effect=AssertionError("round trip")):
+            self.assertTrue(self.vm.function_exists("mirrored"))
+
+    def test_bulk_globals(self):
+        """Test setting and reading several globals in one round trip"""
+        self.vm.set_globals({"limit": 3, "name": "req", "tags": ["a", "b"], "opts": {"debug": True}})
+        self.vm.execute("""
+        total = limit + #tags
+        label = name .. ":" .. tags[2]
+        debug = opts.debug
+        """)
+        values = self.vm.get_globals(["total", "label", "debug", "tags", "opts", "missing"])
+        self.assertEqual(values, {
+            "total": 5, "label": "req:b", "debug": True,
+            "tags": ["a", "b"], "opts": {"debug": True}, "missing": None,
+        })
+
+        with self.assertRaises(RuntimeError):
+            self.vm.set_globals({"bad": object()})
+
+    def test_context(self):
+        """Test the read-only context table"""
+        self.vm.set_context({"user": "alice", "roles": ["admin", "dev"]})
+        self.vm.execute("""
+        function describe()
+            local roles = {}
+            for _, role in ipairs(context.roles) do roles[#roles + 1] = role end
+            return context.user .. ":" .. table.concat(roles, ",") .. ":" .. #context.roles
+        end
+        """)
+        self.assertEqual(self.vm.call("describe"), "alice:admin,dev:2")
+        self.assertEqual(self.vm.call("describe"), "alice:admin,dev:2")
+
+        for script in ('context.user = "eve"', 'context.roles[1] = "root"', 'table.insert(context.roles, "root")'):
+            with self.assertRaisesRegex(RuntimeError, "read-only"):
+                self.vm.execute(script)
+        self.assertEqual(self.vm.get_globals(["context"])["context"], {"user": "alice", "roles": ["admin", "dev"]})
+
+    def test_cached_arg(self):
+        """Test large arguments sent once and then referenced by digest"""
+        self.vm.execute("""
+        function count_rules(config, extra)
+            return #config.rules + extra
+        end
+        """)
+        config = CachedArg({"rules": list(range(1000))})
+        sent = []
+        send = self.vm._send
+        with mock.patch.object(self.vm, '_send', side_effect=lambda m: (sent.append(m), send(m))[1]):
+            self.assertEqual(self.vm.call("count_rules", config, 1), 1001)
+            self.assertEqual(self.vm.call("count_rules", config, 2), 1002)
+        self.assertIsNotNone(sent[0][2][1][0].value)
+        self.assertIsNone(sent[1][2][1][0].value)
+
+        # The worker evicted it behind the parent's back: resent in full
+        for i in range(20):
+            self.vm.call("count_rules", CachedArg({"rules": [i]}), 0)
+        self.vm._arg_mirror.encode([config])
+        self.assertEqual(self.vm.call("count_rules", config, 3), 1003)
+
+        # Shared by every call, so read-only
+        self.vm.execute("function drop_rule(config) config.rules[1] = nil end")
+        with self.assertRaisesRegex(RuntimeError, "read-only"):
+            self.vm.call("drop_rule", config)
+
+        # Batches send digests too
+        sent.clear()
+        with mock.patch.object(self.vm, '_send', side_effect=lambda m: (sent.append(m), send(m))[1]):
+            results = self.vm.call_batch("count_rules", [(config, 4), (config, 5)])
+        self.assertEqual(results, [(True, 1004), (True, 1005)])
+        self.assertTrue(all(args[0].value is None for args in sent[0][2][1]))
+
+    def test_pipeline(self):
+        """Test stages called on each other's results inside the worker"""
+        self.vm.execute("""
+        function split(s) return string.match(s, "(%w+):(%d+)") end
+        function weigh(name, n) return name, tonumber(n) * 2 end
+        function label(name, n) return name .. "=" .. n end
+        function spin(x) for i = 1, 1000 do end return x end
+        """)
+        self.assertEqual(self.vm.pipeline(["split", "weigh", "label"], "a:21"), "a=42")
+        self.assertEqual(self.vm.pipeline_batch(("split", "weigh", "label"), [("b:1",), ("c:2",), ("bad",)]),
+                         [(True, "b=2"), (True, "c=4"), (False, mock.ANY)])
+        with self.assertRaises(RuntimeError) as cm:
+            self.vm.pipeline(["split", "ghost"], "a:1")
+        self.assertIn("not a function", str(cm.exception))
+
+        # One instruction budget for all the stages
+        limited = IsolatedLuaVM(instruction_limit=5000)
+        try:
+            limited.execute("function spin(x) for i = 1, 1000 do end return x end")
+            self.assertEqual(limited.call("spin", 1), 1)
+            with self.assertRaises(RuntimeError) as cm:
+                limited.pipeline(["spin"] * 10, 1)
+            self.assertIn("Instruction limit exceeded", str(cm.exception))
+        finally:
+            limited.close()
+
     def test_missing_function_call(self):
         """Test calling a non-existent function"""
         with self.assertRaises(RuntimeError) as cm:
             self.vm.call("ghost_function", 1, 2)
         
         self.assertIn("not a function", str(cm.exception))
+
+    def test_callback_executor(self):
+        """Test callbacks dispatched to an executor instead of inline"""
+        executor = ThreadPoolExecutor(max_workers=2, thread_name_prefix="lw-cb")
+        vm = IsolatedLuaVM(callbacks={
+            "thread_name": lambda: threading.current_thread().name,
+            "fail": lambda: 1 / 0,
+        }, callback_executor=executor)
+        try:
+            vm.execute("function who() return thread_name() end")
+            self.assertTrue(vm.call("who").startswith("lw-cb"))
+
+            vm.execute("function broken() return fail() end")
+            self.assertIn("Error in callback fail", vm.call("broken"))
+        finally:
+            vm.close()
+            executor.shutdown()
@@ -0,0 +1,84 @@
+import os
+import tempfile
+import itertools
+import unittest
+from luaward import IsolatedLuaVM
+from luaward.capture import CaptureLog, read_log, replay
+
+SCRIPT = """
+function score(x)
+    return x * 10 + next_id()
+end
+"""
+
+class TestCapture(unittest.TestCase):
+    def setUp(self):
+        fd, self.path = tempfile.mkstemp(suffix=".lwcap")
+        os.close(fd)
+        self.ids = itertools.count(1)
+
+    def tearDown(self):
+        os.unlink(self.path)
+
+    def record(self, **options):
+        log = CaptureLog(self.path, **options)
+        vm = IsolatedLuaVM(instruction_limit=100000, callbacks={"next_id": lambda: next(self.ids)}, capture=log)
+        try:
+            vm.execute(SCRIPT)
+            results = [vm.call("score", i) for i in range(5)]
+            with self.assertRaises(RuntimeError):
+                vm.call("missing")
+        finally:
+            vm.close()
+            log.close()
+        return log, results
+
+    def test_record_and_replay(self):
+        """Test a replay reproduces results with the recorded callback responses"""
+        log, results = self.record()
+        self.assertEqual(results, [1, 12, 23, 34, 45])
+        kinds = [record[0] for record in read_log(self.path)]
+        self.assertEqual(kinds, ["vm", "script", "execute"] + ["call"] * 6)
+
+        report = replay(self.path)
+        self.assertEqual(report.requests, 7)
+        self.assertEqual(report.errors, 1)
+        self.assertEqual(report.mismatches, [])
+        self.assertEqual(len(report.timings["score"]), 5)
+        self.assertIn("score: 5 calls", report.summary())
+
+    def test_batches_and_state(self):
+        """Test batches, pipelines and global state are recorded and replayed"""
+        log = CaptureLog(self.path, sample_rate=0.0)
+        vm = IsolatedLuaVM(instruction_limit=100000, callbacks={"next_id": lambda: next(self.ids)}, capture=log)
+        try:
+            vm.execute(SCRIPT + "function offset(x) return x + base + context.step end")
+            vm.set_globals({"base": 100})
+            vm.set_context({"step": 5})
+            log.sample_rate = 1.0
+            self.assertEqual(vm.call_batch("score", [(1,), (2,)]), [(True, 11), (True, 22)])
+            self.assertEqual(vm.pipeline(["offset", "score"], 1), 1063)
+            self.assertEqual(vm.pipeline_batch(["offset"], [(1,), (2,)]), [(True, 106), (True, 107)])
+        finally:
+            vm.close()
+            log.close()
+        kinds = [record[0] for record in read_log(self.path)]
+        self.assertEqual(kinds, ["vm", "script", "execute", "set_globals", "set_context",
+                                 "call_batch", "pipeline", "pipeline_batch"])
+
+        report = replay(self.path)
+        self.assertEqual(report.requests, 6)
+        self.assertEqual(report.errors, 0)
+        self.assertEqual(report.mismatches, [])
+        self.assertIn("call_batch:score", report.timings)
+        self.assertIn("offset | score", report.timings)
+
+    def test_sampling(self):
+        """Test unsampled calls are dropped while scripts are always kept"""
+        log, _ = self.record(sample_rate=0.0)
+        kinds = [record[0] for record in read_log(self.path)]
+        self.assertEqual(kinds, ["vm", "script", "execute"])
+        self.assertEqual(log.dropped, 6)
+
+if __name__ == '__main__':
+    unittest.main()
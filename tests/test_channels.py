@@ -0,0 +1,107 @@
+import os
+import time
+import signal
+import unittest
+import multiprocessing
+from luaward import IsolatedLuaVM
+from luaward.channels import Channel
+from luaward.errors import DeadlineExceededError
+
+STAGES = """
+function parse(n)
+    for i = 1, n do
+        local ok, line = channel.recv("raw")
+        local name, score = string.match(line, "(%w+)=(%d+)")
+        channel.send("parsed", {name = name, score = tonumber(score)})
+    end
+    return n
+end
+
+function total(n)
+    local sum = 0
+    for i = 1, n do
+        local ok, record = channel.recv("parsed")
+        sum = sum + record.score
+        channel.send("totals", {record.name, sum})
+    end
+    return sum
+end
+"""
+
+class TestChannels(unittest.TestCase):
+    def setUp(self):
+        self.channels = {"raw": Channel(capacity=8), "parsed": Channel(capacity=8), "totals": Channel(capacity=8)}
+
+    def tearDown(self):
+        for channel in self.channels.values():
+            channel.close()
+
+    def test_pipeline(self):
+        """Test values flow between two workers without going through the parent"""
+        first = IsolatedLuaVM(channels=self.channels)
+        second = IsolatedLuaVM(channels=self.channels)
+        try:
+            first.execute(STAGES)
+            second.execute(STAGES)
+            for line in ("a=1", "b=2", "c=3"):
+                self.channels["raw"].send(line)
+            self.assertEqual(first.call("parse", 3), 3)
+            self.assertEqual(len(self.channels["parsed"]), 3)
+            self.assertEqual(second.call("total", 3), 6)
+            self.assertEqual([self.channels["totals"].recv(1) for _ in range(3)],
+                             [["a", 1], ["b", 3], ["c", 6]])
+        finally:
+            first.close()
+            second.close()
+
+    def test_timeouts(self):
+        """Test send and recv report a full or empty channel after their timeout"""
+        vm = IsolatedLuaVM(channels=self.channels, isolation="inprocess")
+        try:
+            vm.execute("""
+                function try_recv() return channel.recv("raw", 0) end
+                function fill()
+                    local sent = 0
+                    while channel.send("raw", sent, 0.01) do sent = sent + 1 end
+                    return sent
+                end
+            """)
+            self.assertFalse(vm.call("try_recv"))
+            self.assertEqual(vm.call("fill"), 8)
+            with self.assertRaises(TimeoutError):
+                self.channels["raw"].send("more", timeout=0)
+            with self.assertRaises(RuntimeError):
+                vm.execute('channel.send("missing", 1)')
+        finally:
+            vm.close()
+
+    def test_deadline_interrupts_wait(self):
+        """Test a recv blocked on an empty channel ends at the request deadline"""
+        vm = IsolatedLuaVM(channels=self.channels)
+        try:
+            vm.execute('function wait() return channel.recv("raw") end')
+            start = time.monotonic()
+            with self.assertRaises(DeadlineExceededError):
+                vm.call("wait", timeout=0.3)
+            self.assertLess(time.monotonic() - start, 2.0)
+        finally:
+            vm.close()
+
+    def test_holder_killed(self):
+        """Test a process killed while holding the ring lock leaves the channel usable"""
+        channel = self.channels["raw"]
+        channel.send("before")
+
+        def die():
+            with channel._locked():
+                os.kill(os.getpid(), signal.SIGKILL)
+        process = multiprocessing.get_context("fork").Process(target=die)
+        process.start()
+        process.join()
+        self.assertEqual(process.exitcode, -signal.SIGKILL)
+        channel.send("after", timeout=1)
+        self.assertEqual([channel.recv(1), channel.recv(1)], ["before", "after"])
+        self.assertEqual(len(channel), 0)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,64 @@
+import zlib
+import base64
+import hashlib
+import unittest
+from luaward import IsolatedLuaVM
+
+# call() returns one scalar, so each function picks the i-th result
+ENCODE = """
+function encode(s, i)
+    return ({codec.sha256(s), codec.crc32(s), codec.base64_encode(s), codec.hex_encode(s)})[i]
+end
+
+function decode(b64, hex, i)
+    return ({codec.base64_decode(b64), codec.hex_decode(hex)})[i]
+end
+"""
+
+class TestCodec(unittest.TestCase):
+    def setUp(self):
+        self.vm = IsolatedLuaVM(instruction_limit=1000000)
+        self.vm.execute(ENCODE)
+
+    def tearDown(self):
+        self.vm.close()
+
+    def test_encodings(self):
+        """Test digests and encodings against Python's implementations"""
+        for data in ("", "a", "abc", "hello world", "x" * 1000):
+            raw = data.encode()
+            self.assertEqual([self.vm.call("encode", data, i) for i in range(1, 5)],
+                             [hashlib.sha256(raw).hexdigest(), zlib.crc32(raw),
+                              base64.b64encode(raw).decode(), raw.hex()])
+        # Reference XXH64 values, as the signed integers Lua holds
+        self.vm.execute("""
+        assert(codec.xxh64("") == -1205034819632174695)
+        assert(codec.xxh64("abc") == 0x44bc2cf5ad770999)
+        assert(codec.xxh64("Nobody inspects the spammish repetition") == 0xfbcea83c8a378bf1)
+        """)
+        self.vm.execute("assert(codec.crc32('world', codec.crc32('hello ')) == codec.crc32('hello world'))")
+        self.vm.execute("assert(#codec.sha256('abc', true) == 32)")
+
+    def test_decoding(self):
+        """Test decoding, with and without padding, and invalid input"""
+        self.assertEqual([self.vm.call("decode", "aGVsbG8=", "68656C6c6f", i) for i in (1, 2)], ["hello", "hello"])
+        self.assertEqual([self.vm.call("decode", "aGVsbG8", "6869", i) for i in (1, 2)], ["hello", "hi"])
+        self.vm.execute("""
+        local value, err = codec.base64_decode("aGV*bG8=")
+        assert(value == nil and err:find("position 4"))
+        assert(codec.base64_decode("a") == nil and codec.hex_decode("abc") == nil and codec.hex_decode("zz") == nil)
+        """)
+
+    def test_charged_by_length(self):
+        """Test that hashing counts against the instruction limit"""
+        vm = IsolatedLuaVM(instruction_limit=10000)
+        try:
+            vm.execute("big = string.rep('x', 1000000)")
+            with self.assertRaises(RuntimeError) as cm:
+                vm.execute("codec.sha256(big)")
+            self.assertIn("Instruction limit exceeded", str(cm.exception))
+        finally:
+            vm.close()
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,90 @@
+import unittest
+from luaward import IsolatedLuaVM
+
+class TestCollections(unittest.TestCase):
+    def setUp(self):
+        self.vm = IsolatedLuaVM(instruction_limit=10000000)
+
+    def tearDown(self):
+        self.vm.close()
+
+    def test_sets(self):
+        """Test integer and string sets through growth and removals"""
+        self.vm.execute("""
+        ints = collections.intset()
+        for i = 1, 5000 do assert(ints:add(i * 7)) end
+        assert(not ints:add(7))
+        for i = 1, 5000, 2 do assert(ints:remove(i * 7)) end
+        assert(not ints:remove(7))
+        words = collections.strset(16)
+        for i = 1, 3000 do words:add("w" .. i) end
+        for i = 1, 3000, 3 do words:remove("w" .. i) end
+        for i = 1, 500 do words:add("x" .. i) end
+        seen = 0
+        for w in words:items() do seen = seen + 1 end
+        """)
+        self.assertEqual(self.vm.get_globals(["seen"]), {"seen": 2500})
+        self.vm.execute("assert(#ints == 2500 and ints:has(14) and not ints:has(21))")
+        self.vm.execute("assert(#words == 2500 and words:has('w2') and not words:has('w1') and words:has('x9'))")
+        self.vm.execute("ints:clear() words:clear() assert(#ints == 0 and not words:has('w2'))")
+        with self.assertRaises(RuntimeError):
+            self.vm.execute("ints:add('seven')")
+
+    def test_bitset_and_bloom(self):
+        """Test bit operations and Bloom filter membership"""
+        self.vm.execute("""
+        bits = collections.bitset(1000)
+        for i = 3, 1000, 3 do bits:set(i) end
+        bits:set(3, false)
+        assert(#bits == 1000 and bits:count() == 332 and bits:get(6) and not bits:get(3))
+
+        filter = collections.bloom(1000, 0.01)
+        for i = 1, 1000 do filter:add("user:" .. i) end
+        for i = 1, 1000 do assert(filter:has("user:" .. i)) end
+        false_positives = 0
+        for i = 1001, 11000 do
+            if filter:has("user:" .. i) then false_positives = false_positives + 1 end
+        end
+        """)
+        self.assertLess(self.vm.get_globals(["false_positives"])["false_positives"], 300)
+        with self.assertRaises(RuntimeError):
+            self.vm.execute("bits:get(1001)")
+
+    def test_heap(self):
+        """Test priority order, and insertion order between equal priorities"""
+        self.vm.execute("""
+        queue = collections.heap()
+        for i, p in ipairs({5, 1, 4, 1, 3, 9, 2}) do queue:push(p, "item" .. i) end
+        order = {}
+        while #queue > 0 do
+            local value, priority = queue:pop()
+            order[#order + 1] = value .. "@" .. priority
+        end
+        assert(queue:pop() == nil)
+        """)
+        self.assertEqual(self.vm.get_globals(["order"])["order"],
+                         ["item2@1.0", "item4@1.0", "item7@2.0", "item5@3.0",
+                          "item3@4.0", "item1@5.0", "item6@9.0"])
+
+    def test_table_new_and_clear(self):
+        """Test presized tables and clearing in place"""
+        self.vm.execute("""
+        t = table.new(100, 10)
+        for i = 1, 100 do t[i] = i end
+        t.name = "x"
+        table.clear(t)
+        assert(next(t) == nil and #t == 0)
+        """)
+
+    def test_memory_limit(self):
+        """Test that collection storage counts toward the memory limit"""
+        vm = IsolatedLuaVM(memory_limit=2 * 1024 * 1024)
+        try:
+            with self.assertRaises(RuntimeError) as cm:
+                vm.execute("local s = collections.intset() for i = 1, 10000000 do s:add(i) end")
+            self.assertIn("not enough memory", str(cm.exception))
+        finally:
+            vm.close()
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,73 @@
+import os
+import itertools
+import signal
+import time
+import unittest
+from luaward import IsolatedLuaVM, Reactor
+from luaward.errors import DeadlineExceededError, WorkerDiedError
+
+class TestDeadlines(unittest.TestCase):
+    def test_deadline_cancels_request(self):
+        """Test a request past its deadline is aborted and the worker reused"""
+        vm = IsolatedLuaVM()
+        try:
+            vm.execute("function spin() while true do end end")
+            start = time.monotonic()
+            with self.assertRaises(DeadlineExceededError):
+                vm.call("spin", timeout=0.2)
+            self.assertLess(time.monotonic() - start, 1.0)
+
+            vm.execute("function ping() return 'pong' end")
+            self.assertEqual(vm.call("ping"), "pong")
+        finally:
+            vm.close()
+
+    def test_request_ids_past_int_range(self):
+        """Test requests and cancellation once IDs no longer fit an int"""
+        vm = IsolatedLuaVM()
+        try:
+            vm._request_ids = itertools.count(2**32 - 2)
+            vm.execute("function spin() while true do end end")
+            with self.assertRaises(DeadlineExceededError):
+                vm.call("spin", timeout=0.2)
+            vm.execute("function ping() return 'pong' end")
+            self.assertEqual(vm.call("ping"), "pong")
+            vm.cancel_request(None)
+        finally:
+            vm.close()
+
+    def test_default_timeout(self):
+        vm = IsolatedLuaVM(default_timeout=0.2)
+        try:
+            with self.assertRaises(DeadlineExceededError):
+                vm.execute("while true do end")
+        finally:
+            vm.close()
+
+    def test_worker_death_is_typed(self):
+        """Test a killed worker surfaces as WorkerDiedError with its signal"""
+        vm = IsolatedLuaVM()
+        try:
+            vm.execute("x = 1")
+            os.kill(vm.process.pid, signal.SIGKILL)
+            with self.assertRaises(WorkerDiedError) as cm:
+                vm.execute("x = 2")
+            self.assertEqual(cm.exception.signal, signal.SIGKILL)
+            self.assertIn("memory_used", cm.exception.stats)
+        finally:
+            vm.close()
+
+    def test_deadline_with_reactor(self):
+        reactor = Reactor()
+        vm = IsolatedLuaVM(reactor=reactor)
+        try:
+            future = vm.execute_async("while true do end", timeout=0.2)
+            with self.assertRaises(DeadlineExceededError):
+                future.result(timeout=2)
+            self.assertIsNone(vm.execute("x = 1"))
+        finally:
+            vm.close()
+            reactor.close()
+
+if __name__ == '__main__':
+    unittest.main()
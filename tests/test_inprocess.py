@@ -0,0 +1,85 @@
+import os
+import time
+import threading
+import unittest
+from unittest import mock
+from luaward import IsolatedLuaVM, LuaVMPool, Reactor
+from luaward.isolated import InProcessLuaVM
+from luaward.errors import DeadlineExceededError
+
+class TestInProcess(unittest.TestCase):
+    def setUp(self):
+        self.vm = IsolatedLuaVM(
+            isolation="inprocess",
+            memory_limit=1024 * 1024,
+            instruction_limit=100000,
+            callbacks={"add": lambda a, b: a + b, "fail": lambda: 1 / 0},
+        )
+
+    def tearDown(self):
+        self.vm.close()
+
+    def test_same_api(self):
+        self.assertIsInstance(self.vm, InProcessLuaVM)
+        self.assertEqual(self.vm.pid, os.getpid())
+        self.vm.execute("function inc(x) return add(x, 1) end")
+        self.assertEqual(self.vm.call("inc", 41), 42)
+        self.assertTrue(self.vm.function_exists("inc"))
+        self.assertFalse(self.vm.function_exists("missing"))
+
+    def test_callback_error_is_returned(self):
+        """Test callback errors reach Lua as strings, as in process mode"""
+        self.vm.execute("function check() return fail() end")
+        self.assertIn("Error in callback fail", self.vm.call("check"))
+
+    def test_limits(self):
+        with self.assertRaisesRegex(RuntimeError, "Instruction limit exceeded"):
+            self.vm.execute("while true do end")
+        with self.assertRaises(RuntimeError):
+            self.vm.execute("local t = {} for i = 1, 1e7 do t[i] = i end")
+        self.assertIsNotNone(self.vm.last_stats)
+        self.vm.execute("x = 1")
+
+    def test_deadline(self):
+        vm = IsolatedLuaVM(isolation="inprocess")
+        try:
+            with self.assertRaises(DeadlineExceededError):
+                vm.execute("while true do end", timeout=0.2)
+            # Hit in a nested frame, where the error carries a position
+            vm.execute("function inner() while true do end end function outer() inner() end")
+            with self.assertRaises(DeadlineExceededError):
+                vm.call("outer", timeout=0.2)
+            vm.execute("function one() return 1 end")
+            self.assertEqual(vm.call("one"), 1)
+        finally:
+            vm.close()
+
+    def test_submitted_requests_leave_reactor_free(self):
+        """Test a blocked in-process request does not stall the reactor"""
+        reactor = Reactor()
+        vm = IsolatedLuaVM(isolation="inprocess", reactor=reactor,
+                           callbacks={"pause": lambda: time.sleep(0.5)})
+        try:
+            vm.execute("function wait() pause() return 1 end")
+            future = vm.call_async("wait")
+            fired = threading.Event()
+            reactor.call_later(0.05, fired.set)
+            self.assertTrue(fired.wait(0.3))
+            self.assertEqual(future.result(timeout=5), 1)
+        finally:
+            vm.close()
+            reactor.close()
+
+    def test_environment_switch(self):
+        with mock.patch.dict(os.environ, {"LUAWARD_ISOLATION": "inprocess"}):
+            pool = LuaVMPool(size=2, setup_script="function triple(x) return x * 3 end")
+            try:
+                self.assertTrue(all(isinstance(vm, InProcessLuaVM) for vm in pool._workers.values()))
+                self.assertEqual([pool.call("triple", i) for i in range(4)], [0, 3, 6, 9])
+            finally:
+                pool.close()
+        with self.assertRaises(ValueError):
+            IsolatedLuaVM(isolation="threads")
+
+if __name__ == '__main__':
+    unittest.main()
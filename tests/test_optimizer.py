@@ -0,0 +1,113 @@
+import unittest
+from luaward import IsolatedLuaVM
+from luaward.optimizer import Optimizer, optimize
+
+SCRIPT = """
+local rate = RATE * 100
+function report(items)
+    local lines = {}
+    for i, item in ipairs(items) do
+        lines[#lines + 1] = string.format("%s=%d", item, math.floor(i * rate / 3))
+    end
+    return table.concat(lines, ",") .. LABEL
+end
+"""
+
+class TestOptimizer(unittest.TestCase):
+    def test_hoisting(self):
+        """Test library reads moved into locals without moving lines"""
+        result = optimize("local s = string.format('%d', math.floor(x))\nfor k in pairs(t) do end")
+        self.assertEqual(result, "local __lw_string_format, __lw_math_floor = string.format, math.floor; "
+                                 "local s = __lw_string_format('%d', __lw_math_floor(x))\n"
+                                 "for k in pairs(t) do end")
+        # Reads in table keys and fields are not uses of the globals
+        self.assertIn("__lw_string_len(s)", optimize("local t = {string = 1}\nreturn string.len(s), t.string"))
+
+    def test_unsafe_names_left_alone(self):
+        """Test that assigned, declared or aliased names are not hoisted"""
+        for source in ("string.format = nil\nreturn string.format('x')",
+                       "local string = {}\nreturn string.format('x')",
+                       "local s = string\nreturn string.format('x')",
+                       "function string.trim(s) return s end\nreturn string.format('x')",
+                       "return _G.string.format('x'), string.format('y')",
+                       "return string.dump, string.format('x')"):
+            self.assertNotIn("__lw_string", optimize(source), source)
+
+    def test_hoisting_leaves_local_slots(self):
+        """Test hoisting stops at the main chunk's local limit"""
+        fields = ["string.format", "string.rep", "string.sub", "string.upper", "string.lower",
+                  "math.floor", "math.ceil", "math.abs", "math.max", "math.min",
+                  "table.concat", "table.insert", "table.remove", "table.sort", "utf8.char"]
+        source = ("".join("local v%d = %d\n" % (i, i) for i in range(190))
+                  + "for i = 1, 2 do local a, b = i, i end\n"
+                  + "return %s, v189" % ", ".join(fields))
+        prologue = optimize(source).split(";")[0]
+        self.assertEqual(prologue.count("__lw_"), 3) # 200 - 190 - 4 for loop state - 3 loop locals
+        vm = IsolatedLuaVM(optimizer=Optimizer())
+        try:
+            vm.execute(source)
+        finally:
+            vm.close()
+
+    def test_libraries_read_only(self):
+        """Test scripts cannot replace library functions hoisted code relies on"""
+        vm = IsolatedLuaVM(optimizer=Optimizer())
+        try:
+            vm.execute("function shout(s) return string.upper(s) end")
+            with self.assertRaises(RuntimeError):
+                vm.execute("string.upper = function() return 'pwned' end")
+            self.assertEqual(vm.call("shout", "hi"), "HI")
+            vm.execute("for name in pairs(math) do assert(math[name] ~= nil) end assert(('x'):rep(2) == 'xx')")
+        finally:
+            vm.close()
+        # Without an optimizer the libraries stay writable
+        vm = IsolatedLuaVM()
+        try:
+            vm.execute("function string.shout(s) return s:upper() .. '!' end\n"
+                       "function shout(s) return s:shout() end")
+            self.assertEqual(vm.call("shout", "hi"), "HI!")
+        finally:
+            vm.close()
+
+    def test_folding(self):
+        """Test constant folding with Lua precedence and number types"""
+        cases = {
+            "return 2 * 3 + 4": "return 10",
+            "return 1 - 2 - 3": "return -4",
+            "return a - 1 - 2": "return a - 1 - 2",
+            "return 2 ^ 3 ^ 2": "return 512.0",
+            "return 7 // 2, 7 / 2, 7.5 // 2": "return 3, 3.5, 3.0",
+            "return -7 % 3, 2 * 3 ^ 2": "return -7 % 3, 18.0",
+            "return (2 + 3) * 4": "return 20",
+            "return 1 // 0, 1e308 * 10": "return 1 // 0, 1e308 * 10",
+            "return 9223372036854775807 + 1": "return 9223372036854775807 + 1",
+            "return 2 *\n 3": "return 6\n",
+        }
+        for source, expected in cases.items():
+            self.assertEqual(optimize(source), expected, source)
+
+    def test_constants(self):
+        """Test inlining of registered constants"""
+        optimizer = Optimizer(constants={"LIMIT": 10, "NEG": -3, "NAME": 'say "hi"', "DEBUG": False})
+        self.assertEqual(optimizer.optimize("return LIMIT * 2, NEG ^ 2, NAME, DEBUG"),
+                         'return 20, 9.0, "say \\034hi\\034", false')
+        self.assertEqual(optimizer.optimize("LIMIT = 5\nreturn LIMIT"), "LIMIT = 5\nreturn LIMIT")
+        with self.assertRaises(ValueError):
+            Optimizer(constants={"BIG": 2**70})
+
+    def test_same_results_in_vm(self):
+        """Test that optimized scripts behave like the original"""
+        results = []
+        for optimizer in (None, Optimizer(constants={"RATE": 0.5, "LABEL": "!"})):
+            vm = IsolatedLuaVM(instruction_limit=1000000, optimizer=optimizer)
+            try:
+                vm.set_globals({"RATE": 0.5, "LABEL": "!", "ITEMS": ["a", "b", "c"]})
+                vm.execute(SCRIPT + "function report_items() return report(ITEMS) end")
+                results.append(vm.call("report_items"))
+            finally:
+                vm.close()
+        self.assertEqual(results[0], "a=16,b=33,c=50!")
+        self.assertEqual(results[0], results[1])
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,312 @@
+import os
+import signal
+import time
+import unittest
+import threading
+import concurrent.futures
+from luaward import LuaVMPool
+from luaward.cache import ResultCache
+from luaward.autoscale import ScalingPolicy
+from luaward.errors import WorkerDiedError, DeadlineExceededError, PoolOverloadedError
+
+SETUP = """
+function double(x) return x * 2 end
+function spin() while true do end end
+"""
+
+class TestPool(unittest.TestCase):
+    def setUp(self):
+        self.pool = LuaVMPool(size=3, setup_script=SETUP)
+
+    def tearDown(self):
+        self.pool.close()
+
+    def test_call(self):
+        futures = [self.pool.submit("call", "double", i) for i in range(20)]
+        self.assertEqual([f.result(timeout=10) for f in futures], [i * 2 for i in range(20)])
+        self.assertTrue(self.pool.function_exists("double"))
+
+    def test_deadline(self):
+        with self.assertRaises(DeadlineExceededError):
+            self.pool.call("spin", timeout=0.2)
+        self.assertEqual(self.pool.call("double", 4), 8)
+
+    def test_dead_worker_replaced(self):
+        """Test a worker killed mid-request is reported and replaced"""
+        future = self.pool.submit("call", "spin")
+        time.sleep(0.3)
+        busy = [vm for vm in self.pool._workers.values() if vm._pending]
+        os.kill(busy[0].process.pid, signal.SIGKILL)
+        with self.assertRaises(WorkerDiedError):
+            future.result(timeout=5)
+
+        deadline = time.monotonic() + 5
+        while len(self.pool._idle) < 3 and time.monotonic() < deadline:
+            time.sleep(0.05)
+        self.assertEqual(len(self.pool._workers), 3)
+        self.assertEqual(self.pool.call("double", 21), 42)
+
+class TestPureCalls(unittest.TestCase):
+    def setUp(self):
+        self.executions = 0
+        self.lock = threading.Lock()
+        def tick():
+            with self.lock:
+                self.executions += 1
+            time.sleep(0.2)
+        self.pool = LuaVMPool(
+            size=2,
+            setup_script="function score(x) tick() return x + 1 end",
+            result_cache=ResultCache(maxsize=16, ttl=60),
+            callbacks={"tick": tick},
+        )
+
+    def tearDown(self):
+        self.pool.close()
+
+    def test_inflight_coalescing(self):
+        """Test identical concurrent pure calls share one execution"""
+        futures = [self.pool.submit("call", "score", 1, pure=True) for _ in range(10)]
+        self.assertEqual([f.result(timeout=10) for f in futures], [2] * 10)
+        self.assertEqual(self.executions, 1)
+
+    def test_coalesced_default_timeout(self):
+        """Test waiters sharing an execution get the pool's default timeout"""
+        self.pool.default_timeout = 0.05
+        owner = self.pool.submit("call", "score", 2, pure=True, timeout=5)
+        waiter = self.pool.submit("call", "score", 2, pure=True)
+        with self.assertRaises(DeadlineExceededError):
+            waiter.result(timeout=2)
+        self.assertEqual(owner.result(timeout=5), 3)
+
+    def test_result_cache(self):
+        self.assertEqual(self.pool.call("score", 5, pure=True), 6)
+        self.assertEqual(self.pool.call("score", 5, pure=True), 6)
+        self.assertEqual(self.executions, 1)
+        self.assertEqual(self.pool.result_cache.hits, 1)
+
+        # Calls not declared pure always execute
+        self.pool.call("score", 5)
+        self.assertEqual(self.executions, 2)
+
+class TestAffinity(unittest.TestCase):
+    def setUp(self):
+        self.executor = concurrent.futures.ThreadPoolExecutor(max_workers=4)
+        self.pool = LuaVMPool(
+            size=3,
+            setup_script="served = 0\nfunction serve() pause() served = served + 1 return served end",
+            callbacks={"pause": lambda: time.sleep(0.2)},
+            callback_executor=self.executor,
+            spill_threshold=2,
+        )
+
+    def tearDown(self):
+        self.pool.close()
+        self.executor.shutdown()
+
+    def test_tenant_routing(self):
+        """Test requests of one tenant are served by the same worker"""
+        counts = [self.pool.call("serve", tenant="alice") for _ in range(4)]
+        self.assertEqual(counts, [1, 2, 3, 4])
+
+    def test_spill_over(self):
+        """Test a saturated worker sheds requests to the others"""
+        start = time.monotonic()
+        futures = [self.pool.submit("call", "serve", tenant="alice") for _ in range(6)]
+        for f in futures:
+            f.result(timeout=10)
+        self.assertLess(time.monotonic() - start, 1.0)
+
+    def test_sticky_tenant(self):
+        """Test a sticky tenant stays on its worker even under load"""
+        futures = [self.pool.submit("call", "serve", tenant="bob", sticky=True) for _ in range(4)]
+        counts = sorted(f.result(timeout=10) for f in futures)
+        self.assertEqual(counts, list(range(counts[0], counts[0] + 4)))
+
+class TestScheduling(unittest.TestCase):
+    def setUp(self):
+        self.order = []
+        self.pool = LuaVMPool(
+            size=1,
+            setup_script="function job(name) record(name) end\nfunction hold() pause() end",
+            callbacks={"record": self.order.append, "pause": lambda: time.sleep(0.3)},
+            max_queue=2,
+        )
+
+    def tearDown(self):
+        self.pool.close()
+
+    def test_priority_and_deadline_order(self):
+        """Test interactive work overtakes batch work, earliest deadline first"""
+        blocker = self.pool.submit("call", "hold")
+        futures = [
+            self.pool.submit("call", "job", "batch", priority="batch"),
+            self.pool.submit("call", "job", "late", priority="interactive", timeout=5),
+            self.pool.submit("call", "job", "early", priority="interactive", timeout=2),
+        ]
+        blocker.result(timeout=5)
+        for f in futures:
+            f.result(timeout=5)
+        self.assertEqual(self.order, ["early", "late", "batch"])
+
+    def test_queue_full(self):
+        self.pool.submit("call", "hold")
+        for _ in range(2):
+            self.pool.submit("call", "job", "batch", priority="batch")
+        with self.assertRaises(PoolOverloadedError):
+            self.pool.submit("call", "job", "batch", priority="batch")
+        # Other classes have their own bound
+        self.pool.call("job", "interactive", priority="interactive")
+
+    def test_unknown_priority(self):
+        with self.assertRaises(ValueError) as cm:
+            self.pool.submit("call", "job", "x", priority="urgent")
+        self.assertIn("interactive", str(cm.exception))
+
+    def test_cancel_queued(self):
+        blocker = self.pool.submit("call", "hold")
+        queued = self.pool.submit("call", "job", "cancelled")
+        self.assertTrue(queued.cancel())
+        self.assertEqual(len(self.pool._queue), 0)
+        blocker.result(timeout=5)
+        self.pool.call("job", "after")
+        self.assertEqual(self.order, ["after"])
+
+    def test_memory_budget(self):
+        pool = LuaVMPool(size=4, memory_limit=1024 * 1024, memory_budget=2 * 1024 * 1024)
+        try:
+            self.assertEqual(len(pool._workers), 2)
+        finally:
+            pool.close()
+        with self.assertRaises(ValueError):
+            LuaVMPool(size=1, memory_budget=1024 * 1024)
+
+class TestAutoscale(unittest.TestCase):
+    def setUp(self):
+        self.executor = concurrent.futures.ThreadPoolExecutor(max_workers=8)
+        self.pool = LuaVMPool(
+            size=1,
+            setup_script="function work() pause() return 1 end",
+            callbacks={"pause": lambda: time.sleep(0.3)},
+            callback_executor=self.executor,
+            autoscale=ScalingPolicy(1, 3, target_wait=0.05, idle_timeout=0.5, interval=0.1),
+            spares=1,
+        )
+
+    def tearDown(self):
+        self.pool.close()
+        self.executor.shutdown()
+
+    def test_grow_and_shrink(self):
+        """Test the pool grows under queueing and retires idle workers"""
+        futures = [self.pool.submit("call", "work") for _ in range(12)]
+        for f in futures:
+            f.result(timeout=10)
+        self.assertEqual(len(self.pool._workers), 3)
+
+        deadline = time.monotonic() + 5
+        while len(self.pool._workers) > 1 and time.monotonic() < deadline:
+            time.sleep(0.1)
+        self.assertEqual(len(self.pool._workers), 1)
+        self.assertEqual(len(self.pool._spare_vms), 1)
+        self.assertEqual(self.pool.call("work"), 1)
+
+    def test_policy(self):
+        policy = ScalingPolicy(1, 2, target_wait=0.1, idle_timeout=10)
+        self.assertEqual(policy.decide(1, 1, 5, 0.5, None, None), 1)
+        self.assertEqual(policy.decide(2, 2, 5, 0.5, None, None), 0)
+        self.assertEqual(policy.decide(2, 1, 0, 0.0, 20.0, None), -1)
+        self.assertEqual(policy.decide(1, 0, 0, 0.0, 20.0, None), 0)
+
+class TestBatching(unittest.TestCase):
+    def setUp(self):
+        self.pool = LuaVMPool(
+            size=2,
+            setup_script="function score(x) if x < 0 then error('negative') end return x * 2 end",
+            batch_window=0.01, max_batch=8,
+        )
+
+    def tearDown(self):
+        self.pool.close()
+
+    def test_concurrent_calls_batched(self):
+        """Test concurrent calls to one function travel as batches"""
+        sent = []
+        for vm in self.pool._workers.values():
+            submit = vm.submit
+            vm.submit = lambda method, *args, submit=submit, **kw: (sent.append(method), submit(method, *args, **kw))[1]
+        futures = [self.pool.submit("call", "score", i) for i in range(-1, 20)]
+        with self.assertRaisesRegex(RuntimeError, "negative"):
+            futures[0].result(timeout=5)
+        self.assertEqual([f.result(timeout=5) for f in futures[1:]], [i * 2 for i in range(20)])
+        self.assertEqual(sent, ["call_batch"] * 3)
+
+    def test_single_call(self):
+        """Test a lone call is sent as a plain call after the window"""
+        self.assertEqual(self.pool.call("score", 21), 42)
+        self.assertEqual(self.pool.submit("call", "score", 1, tenant="t").result(timeout=5), 2)
+
+    def test_held_calls_queued(self):
+        """Test calls held for a batch count toward max_queue and expire on time"""
+        pool = LuaVMPool(size=1, setup_script="function score(x) return x * 2 end",
+                         batch_window=0.5, max_queue=2)
+        try:
+            held = [pool.submit("call", "score", 1, timeout=0.1), pool.submit("call", "score", 2)]
+            with self.assertRaises(PoolOverloadedError):
+                pool.submit("call", "score", 3)
+            with self.assertRaises(DeadlineExceededError):
+                held[0].result(timeout=0.4)
+            self.assertEqual(held[1].result(timeout=5), 4)
+        finally:
+            pool.close()
+
+    def test_queue_drains_after_batch(self):
+        """Test a flushed batch leaves no calls counted as queued"""
+        pool = LuaVMPool(size=1, setup_script="function score(x) return x * 2 end",
+                         batch_window=0.05, max_queue=8)
+        try:
+            for _ in range(3):
+                futures = [pool.submit("call", "score", i) for i in range(8)]
+                self.assertEqual([f.result(timeout=5) for f in futures], [i * 2 for i in range(8)])
+                self.assertEqual(sum(pool._queued.values()), 0)
+        finally:
+            pool.close()
+
+class TestHedging(unittest.TestCase):
+    def setUp(self):
+        self.executor = concurrent.futures.ThreadPoolExecutor(max_workers=4)
+        self.pool = LuaVMPool(
+            size=2,
+            setup_script="slow = false\nfunction work(x) if slow then pause() end return x end",
+            callbacks={"pause": lambda: time.sleep(2)},
+            callback_executor=self.executor,
+            hedge_quantile=0.95,
+        )
+
+    def tearDown(self):
+        self.pool.close()
+        self.executor.shutdown()
+
+    def test_slow_worker_hedged(self):
+        """Test a pure call stuck on a slow worker is answered by a second one"""
+        for i in range(30):
+            self.pool.call("work", i, pure=True)
+        workers = list(self.pool._workers.values())
+        workers[0].execute("slow = true")
+
+        # Both workers are busy when the slow call is due a hedge; it runs on
+        # the fast one as soon as that is free
+        start = time.monotonic()
+        futures = [self.pool.submit("call", "work", i, pure=True) for i in range(2)]
+        self.assertEqual([f.result(timeout=5) for f in futures], [0, 1])
+        self.assertLess(time.monotonic() - start, 1.5)
+        self.assertEqual(self.pool.hedged, 1)
+
+    def test_plain_calls_not_hedged(self):
+        """Test calls not declared pure are never duplicated"""
+        for i in range(30):
+            self.pool.call("work", i)
+        self.assertEqual(self.pool.hedged, 0)
+
+if __name__ == '__main__':
+    unittest.main()
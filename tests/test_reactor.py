@@ -0,0 +1,76 @@
+import os
+import signal
+import time
+import unittest
+from concurrent.futures import ThreadPoolExecutor
+from luaward import IsolatedLuaVM, Reactor
+
+class TestReactor(unittest.TestCase):
+    def setUp(self):
+        self.reactor = Reactor()
+        self.executor = ThreadPoolExecutor(max_workers=8)
+        self.vms = []
+
+    def tearDown(self):
+        for vm in self.vms:
+            vm.close()
+        self.reactor.close()
+        self.executor.shutdown()
+
+    def spawn(self, **kwargs):
+        vm = IsolatedLuaVM(reactor=self.reactor, callback_executor=self.executor, **kwargs)
+        self.vms.append(vm)
+        return vm
+
+    def test_many_workers_one_thread(self):
+        """Test futures of many workers completed by the reactor thread"""
+        vms = [self.spawn() for _ in range(8)]
+        for vm in vms:
+            vm.execute("function square(x) return x * x end")
+
+        futures = [vm.call_async("square", i) for i, vm in enumerate(vms)]
+        self.assertEqual([f.result(timeout=10) for f in futures], [i * i for i in range(8)])
+        self.assertTrue(vms[0].function_exists("square"))
+
+    def test_callbacks_run_concurrently(self):
+        """Test slow callbacks of different workers overlap"""
+        def slow(x):
+            time.sleep(0.5)
+            return x
+        vms = [self.spawn(callbacks={"slow": slow}) for _ in range(4)]
+        for vm in vms:
+            vm.execute("function wait(x) return slow(x) end")
+
+        start = time.monotonic()
+        futures = [vm.call_async("wait", i) for i, vm in enumerate(vms)]
+        self.assertEqual([f.result(timeout=10) for f in futures], [0, 1, 2, 3])
+        self.assertLess(time.monotonic() - start, 1.5)
+
+    def test_requests_sent_during_callback(self):
+        """Test requests queued behind one waiting on a callback all complete"""
+        def slow(x):
+            time.sleep(0.3)
+            return x
+        vm = self.spawn(callbacks={"slow": slow})
+        vm.execute("function wait(x) return slow(x) end function double(x) return 2 * x end")
+
+        futures = [vm.call_async("wait", 1), vm.call_async("double", 2), vm.call_async("wait", 3)]
+        self.assertEqual([f.result(timeout=10) for f in futures], [1, 4, 3])
+
+    def test_worker_death_detected(self):
+        """Test a killed worker fails its pending future"""
+        vm = self.spawn()
+        future = vm.execute_async("while true do end")
+        time.sleep(0.2)
+        os.kill(vm.process.pid, signal.SIGKILL)
+        with self.assertRaises(SystemError):
+            future.result(timeout=5)
+
+    def test_async_needs_reactor(self):
+        vm = IsolatedLuaVM()
+        self.vms.append(vm)
+        with self.assertRaises(RuntimeError):
+            vm.call_async("print")
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,96 @@
+import os
+import signal
+import time
+import tempfile
+import unittest
+from luaward import LuaVMPool
+from luaward.remote import HostAgent, RemoteLuaVM, RemoteHost
+from luaward.errors import WorkerDiedError, DeadlineExceededError
+
+AUTHKEY = b"test-authkey"
+
+class TestRemoteLuaVM(unittest.TestCase):
+    def setUp(self):
+        # Agent on the loopback interface, as a remote host would run it
+        self.agent = HostAgent(("127.0.0.1", 0), authkey=AUTHKEY).start()
+
+    def tearDown(self):
+        self.agent.close()
+
+    def test_requests_and_callbacks(self):
+        vm = RemoteLuaVM(self.agent.address, authkey=AUTHKEY, callbacks={"add": lambda a, b: a + b})
+        try:
+            vm.execute("function inc(x) return add(x, 1) end\nfunction spin() while true do end end")
+            self.assertEqual(vm.call("inc", 41), 42)
+            self.assertTrue(vm.function_exists("inc"))
+            with self.assertRaises(DeadlineExceededError):
+                vm.call("spin", timeout=0.2)
+            self.assertEqual(vm.call("inc", 1), 2)
+        finally:
+            vm.close()
+
+    def test_worker_death(self):
+        vm = RemoteLuaVM(self.agent.address, authkey=AUTHKEY)
+        try:
+            vm.execute("x = 1")
+            os.kill(vm.process.pid, signal.SIGKILL) # Same machine in this test
+            with self.assertRaises(WorkerDiedError) as ctx:
+                vm.execute("x = 2")
+            self.assertEqual(ctx.exception.signal, signal.SIGKILL)
+        finally:
+            vm.close()
+
+    def test_bad_authkey(self):
+        with self.assertRaises(Exception):
+            RemoteLuaVM(self.agent.address, authkey=b"wrong")
+
+    def test_network_agent_needs_authkey(self):
+        with self.assertRaises(ValueError):
+            HostAgent(("127.0.0.1", 0))
+
+    def test_agent_caps_limits(self):
+        """Test limits a client asks for are lowered to the agent's"""
+        with tempfile.TemporaryDirectory() as tmpdir:
+            with HostAgent(os.path.join(tmpdir, "agent.sock"), instruction_limit=10000).start() as agent:
+                vm = RemoteLuaVM(agent.address, instruction_limit=10**9)
+                try:
+                    with self.assertRaisesRegex(RuntimeError, "Instruction limit exceeded"):
+                        vm.execute("for i = 1, 10000000 do end")
+                finally:
+                    vm.close()
+
+class TestRemotePool(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.path = os.path.join(self.tmpdir.name, "agent.sock")
+        self.agent = HostAgent(self.path, authkey=AUTHKEY).start()
+
+    def tearDown(self):
+        self.agent.close()
+        self.tmpdir.cleanup()
+
+    def test_reconnect(self):
+        """Test a pool routes around a lost host and reconnects to it"""
+        pool = LuaVMPool(size=1, hosts=[RemoteHost(self.path, workers=2, authkey=AUTHKEY)],
+                         setup_script="function double(x) return x * 2 end")
+        try:
+            self.assertEqual(len(pool._workers), 3)
+            self.assertEqual([pool.call("double", i) for i in range(6)], [0, 2, 4, 6, 8, 10])
+
+            self.agent.close()
+            deadline = time.monotonic() + 10
+            while len(pool._workers) > 1 and time.monotonic() < deadline:
+                time.sleep(0.1)
+            self.assertEqual(len(pool._workers), 1)
+            self.assertEqual(pool.call("double", 21), 42)
+
+            self.agent = HostAgent(self.path, authkey=AUTHKEY).start()
+            deadline = time.monotonic() + 10
+            while len(pool._workers) < 3 and time.monotonic() < deadline:
+                time.sleep(0.1)
+            self.assertEqual(len(pool._workers), 3)
+        finally:
+            pool.close()
+
+if __name__ == '__main__':
+    unittest.main()
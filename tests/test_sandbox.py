@@ -50,5 +50,64 @@ class TestSandbox(unittest.TestCase):
         # Verify normal string methods work
         self.vm.execute("assert(('abc'):upper() == 'ABC')")
 
+    def test_string_utilities(self):
+        """Test the native split, trim, startswith, endswith, replace and join"""
+        self.vm.execute("""
+        local parts = ("a,b,,c"):split(",")
+        assert(#parts == 4 and parts[3] == "" and parts[4] == "c")
+        local head = string.split("k=v=w", "=", 2)
+        assert(#head == 2 and head[1] == "k" and head[2] == "v=w")
+        assert(#(""):split(",") == 1)
+        assert(("  hi there\\n"):trim() == "hi there" and ("x"):trim() == "x")
+        assert(("prefix.rest"):startswith("prefix.") and not ("ab"):startswith("abc"))
+        assert(("file.lua"):endswith(".lua") and not ("file.lua"):endswith(".py"))
+        local out, n = ("a.b.c"):replace(".", "%")
+        assert(out == "a%b%c" and n == 2)
+        assert(("aaa"):replace("a", "bb", 2) == "bbbba")
+        assert(string.join(", ", {1, "two", true}) == "1, two, true")
+        assert(not pcall(string.split, "abc", ""))
+        """)
+
+    def test_safe_load(self):
+        """Test the opt-in load() compiles text only, into an explicit environment"""
+        vm = IsolatedLuaVM(safe_load=True, instruction_limit=100000)
+        try:
+            vm.execute("""
+            function formula(src, x)
+                local f, err = load("return " .. src, "=formula", "t", {x = x, math = math})
+                if not f then return err end
+                return f()
+            end
+            """)
+            self.assertEqual(vm.call("formula", "x * 2 + 1", 20), 41)
+            self.assertEqual(vm.call("formula", "math.floor(x / 3)", 10), 3)
+            self.assertEqual(vm.call("formula", "x * 2 + 1", 5), 11) # Cached chunk, new environment
+            self.assertIn("unexpected symbol", vm.call("formula", "x +* 2", 1))
+
+            # No globals unless passed in, and no bytecode
+            vm.execute("assert(load('return print')() == nil)")
+            with self.assertRaises(RuntimeError):
+                vm.execute("load('\\27Lua', nil, 'b')")
+
+            # Compiling is charged one instruction per source byte
+            with self.assertRaises(RuntimeError) as cm:
+                vm.execute("load(string.rep(' ', 200000))")
+            self.assertIn("Instruction limit exceeded", str(cm.exception))
+        finally:
+            vm.close()
+
+    def test_load_cache_bounded_by_bytes(self):
+        """Test many large distinct chunks do not pile up in the load cache"""
+        vm = IsolatedLuaVM(safe_load=True, memory_limit=2 * 1024 * 1024, instruction_limit=1000000)
+        try:
+            vm.execute("""
+            function compile(i)
+                return load("return " .. i .. " --" .. string.rep("x", 30000))()
+            end
+            """)
+            self.assertEqual([vm.call("compile", i) for i in range(200)], list(range(200)))
+        finally:
+            vm.close()
+
 if __name__ == '__main__':
     unittest.main()
@@ -0,0 +1,71 @@
+import os
+import stat
+import socket
+import tempfile
+import unittest
+import multiprocessing
+from luaward.server import LuaServer, LuaClient
+from luaward.errors import DeadlineExceededError
+
+SETUP = """
+function double(x) return x * 2 end
+function spin() while true do end end
+"""
+
+class TestServer(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.path = os.path.join(self.tmpdir.name, "luaward.sock")
+        self.server = LuaServer(self.path, size=2, setup_script=SETUP).start()
+
+    def tearDown(self):
+        self.server.close()
+        self.tmpdir.cleanup()
+
+    def test_shared_pool(self):
+        """Test several clients served by the same pool"""
+        clients = [LuaClient(self.path) for _ in range(3)]
+        try:
+            for i, client in enumerate(clients):
+                self.assertEqual(client.call("double", i), i * 2)
+            self.assertTrue(clients[0].function_exists("double"))
+            futures = [clients[1].call_async("double", i) for i in range(10)]
+            self.assertEqual([f.result(timeout=5) for f in futures], [i * 2 for i in range(10)])
+        finally:
+            for client in clients:
+                client.close()
+
+    def test_errors(self):
+        with LuaClient(self.path) as client:
+            with self.assertRaises(DeadlineExceededError):
+                client.call("spin", timeout=0.2)
+            with self.assertRaisesRegex(RuntimeError, "is not a function"):
+                client.call("missing")
+            self.assertEqual(client.call("double", 4), 8)
+
+    def test_stalled_client(self):
+        """Test a client stopping mid-message does not hold up the others"""
+        stalled = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            stalled.connect(self.path)
+            stalled.sendall(b"\x00\x00\x10\x00partial") # Header of a 4 KB message
+            with LuaClient(self.path) as client:
+                self.assertEqual(client.call("double", 5, timeout=5), 10)
+        finally:
+            stalled.close()
+
+    def test_socket_permissions(self):
+        self.assertEqual(stat.S_IMODE(os.stat(self.path).st_mode), 0o600)
+
+class TestServerAuth(unittest.TestCase):
+    def test_authkey(self):
+        with tempfile.TemporaryDirectory() as tmpdir:
+            path = os.path.join(tmpdir, "luaward.sock")
+            with LuaServer(path, authkey=b"secret", size=1).start():
+                with self.assertRaises(multiprocessing.AuthenticationError):
+                    LuaClient(path, authkey=b"wrong")
+                with LuaClient(path, authkey=b"secret") as client:
+                    self.assertFalse(client.function_exists("double"))
+
+if __name__ == '__main__':
+    unittest.main()
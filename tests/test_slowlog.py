@@ -0,0 +1,85 @@
+import os
+import json
+import tempfile
+import unittest
+from luaward import IsolatedLuaVM
+from luaward.slowlog import SlowLog
+
+SCRIPT = """
+function spin(n)
+    local total = 0
+    for i = 1, n do
+        total = total + i % 7
+    end
+    return total
+end
+
+function quick(x)
+    return x + 1
+end
+"""
+
+class TestSlowLog(unittest.TestCase):
+    def setUp(self):
+        fd, self.path = tempfile.mkstemp(suffix=".jsonl")
+        os.close(fd)
+
+    def tearDown(self):
+        for path in (self.path, self.path + ".1"):
+            if os.path.exists(path):
+                os.unlink(path)
+
+    def entries(self):
+        with open(self.path) as f:
+            return [json.loads(line) for line in f]
+
+    def run_requests(self, log, isolation=None, instruction_limit=10000000):
+        vm = IsolatedLuaVM(instruction_limit=instruction_limit, slow_log=log, isolation=isolation)
+        try:
+            vm.execute(SCRIPT)
+            vm.call("quick", 1)
+            vm.call("spin", 200000)
+        finally:
+            vm.close()
+            log.close()
+
+    def test_slow_call_logged_with_profile(self):
+        """Test only the call crossing the threshold is logged, with its stack samples"""
+        log = SlowLog(self.path, instructions=100000, profile=True, profile_interval=100)
+        self.run_requests(log)
+        entries = self.entries()
+        self.assertEqual(len(entries), 1)
+        entry = entries[0]
+        self.assertEqual(entry["function"], "spin")
+        self.assertEqual(entry["args"], "(200000,)")
+        self.assertEqual(entry["crossed"], ["instructions"])
+        self.assertGreaterEqual(entry["stats"]["instructions"], 100000)
+        self.assertTrue(any("spin@" in stack for stack in entry["profile"]))
+
+    def test_inprocess(self):
+        """Test the in-process mode logs the same entries"""
+        log = SlowLog(self.path, instructions=100000)
+        self.run_requests(log, isolation="inprocess")
+        entries = self.entries()
+        self.assertEqual([entry["function"] for entry in entries], ["spin"])
+        self.assertNotIn("profile", entries[0])
+
+    def test_counted_without_limit(self):
+        """Test the instruction threshold works on VMs with no instruction limit"""
+        for isolation in (None, "inprocess"):
+            log = SlowLog(self.path, instructions=100000)
+            self.run_requests(log, isolation=isolation, instruction_limit=None)
+            entries = self.entries()
+            self.assertEqual([entry["function"] for entry in entries], ["spin"])
+            self.assertGreaterEqual(entries[0]["stats"]["instructions"], 100000)
+            os.unlink(self.path)
+
+    def test_rotation(self):
+        """Test the log moves to path.1 once it holds half of max_bytes"""
+        log = SlowLog(self.path, wall_time=0.0, max_bytes=1024)
+        self.run_requests(log)
+        self.assertTrue(os.path.exists(self.path + ".1"))
+        self.assertLessEqual(os.path.getsize(self.path), 512)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,74 @@
+import unittest
+from luaward import IsolatedLuaVM
+
+RENDER = """
+function render(source)
+    return template.render(source, ctx or {})
+end
+"""
+
+class TestTemplate(unittest.TestCase):
+    def setUp(self):
+        self.vm = IsolatedLuaVM(instruction_limit=1000000)
+        self.vm.execute(RENDER)
+
+    def tearDown(self):
+        self.vm.close()
+
+    def test_interpolation_and_escaping(self):
+        """Test values, nested paths, escaping and raw output"""
+        self.vm.set_globals({"ctx": {"user": {"name": "<Ann & Bo>"}, "count": 3, "ok": True}})
+        self.assertEqual(self.vm.call("render", "Hi {{ user.name }}!"), "Hi &lt;Ann &amp; Bo&gt;!")
+        self.assertEqual(self.vm.call("render", "{{{user.name}}} {{& user.name}}"), "<Ann & Bo> <Ann & Bo>")
+        self.assertEqual(self.vm.call("render", "{{count}} {{ok}} [{{missing}}]{{! note }}"), "3 true []")
+        self.vm.execute("assert(template.escape([[<'\"&>]]) == '&lt;&#39;&quot;&amp;&gt;')")
+
+    def test_blocks(self):
+        """Test conditionals and loops with the current item and index"""
+        self.vm.set_globals({"ctx": {"admin": False, "tag": "x",
+                                     "items": [{"name": "a"}, {"name": "b"}], "words": ["p", "q"]}})
+        self.assertEqual(self.vm.call("render", "{{#if admin}}admin{{else}}user{{/if}}"), "user")
+        self.assertEqual(self.vm.call("render", "{{#each items}}{{@index}}.{{name}}-{{tag}} {{/each}}"),
+                         "1.a-x 2.b-x ")
+        self.assertEqual(self.vm.call("render", "{{#each words}}{{.}}{{#if admin}}!{{/if}}{{/each}}|{{items.2.name}}"),
+                         "pq|b")
+
+    def test_compiled_template(self):
+        """Test a compiled template rendered against several tables"""
+        self.vm.execute("""
+        local greeting = template.compile("Dear {{name}},")
+        function greet(name) return greeting:render({name = name}) end
+        """)
+        self.assertEqual(self.vm.call("greet", "Ann"), "Dear Ann,")
+        self.assertEqual(self.vm.call("greet", "Bo"), "Dear Bo,")
+
+    def test_large_output(self):
+        """Test output well past the buffer's inline storage, through variables"""
+        words = ["<w%d>" % i for i in range(1000)]
+        self.vm.set_globals({"ctx": {"words": words, "big": "x" * 5000}})
+        self.assertEqual(self.vm.call("render", "{{#each words}}{{.}} {{{.}}} {{/each}}"),
+                         "".join("&lt;%s&gt; %s " % (w[1:-1], w) for w in words))
+        self.assertEqual(self.vm.call("render", "{{big}}|{{{big}}}|{{big}}"), "|".join(["x" * 5000] * 3))
+
+    def test_cache_bounded_by_bytes(self):
+        """Test many large distinct templates do not pile up in the render cache"""
+        vm = IsolatedLuaVM(memory_limit=2 * 1024 * 1024, instruction_limit=1000000)
+        try:
+            vm.execute(RENDER)
+            for i in range(200):
+                self.assertEqual(vm.call("render", "%d{{!%s}}" % (i, "x" * 20000)), str(i))
+        finally:
+            vm.close()
+
+    def test_errors(self):
+        """Test malformed templates, and rendering charged to the instruction limit"""
+        for source in ("{{#if a}}x", "{{/each}}", "{{name", "{{#while a}}{{/while}}", "{{}}"):
+            with self.assertRaises(RuntimeError):
+                self.vm.call("render", source)
+        self.vm.execute("nested = {} for i = 1, 1000 do nested[i] = i end")
+        with self.assertRaises(RuntimeError) as cm:
+            self.vm.execute("template.render('{{#each n}}{{#each n}}{{/each}}{{/each}}', {n = nested})")
+        self.assertIn("Instruction limit exceeded", str(cm.exception))
+
+if __name__ == '__main__':
+    unittest.main()